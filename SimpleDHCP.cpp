@@ -15,28 +15,247 @@
 
 #include "SimpleDHCP.h"
 
+// ********** DHCP MESSAGES **********
+
+// Append an option to an options list, returns the index following the option or the unchanged index if it does not fit
+uint16_t addDHCPOption(uint8_t *options, uint16_t index, uint8_t code, uint8_t length, const uint8_t *data) {
+    if (index + 2 + length >= DHCP_DEFAULT_OPTIONS_SIZE) return index; // Always leave room for DHCP_END
+    options[index++] = code;
+    options[index++] = length;
+    for (int i = 0; i < length; i++) {
+        options[index++] = data[i];
+    }
+    return index;
+}
+
+// Find an option in a message, returns the index of its code or -1 if it is not present
+int16_t findDHCPOption(DHCP_MESSAGE *message, uint8_t code) {
+    int opt_index = 0;
+    while (opt_index < DHCP_DEFAULT_OPTIONS_SIZE - 1) {
+        if (message->options[opt_index] == DHCP_END) return -1;
+        if (message->options[opt_index] == DHCP_PAD) {
+            opt_index++;
+            continue;
+        }
+        if (message->options[opt_index] == code) return opt_index;
+        opt_index += 2 + message->options[opt_index + 1];
+    }
+    return -1;
+}
+
+// Put the 16 bit fields of a message read off the wire into host order, in place. Messages are held in host order
+// so that serializeDHCPMessage() writes them back out the right way round
+void readDHCPHeader(DHCP_MESSAGE *message) {
+    const uint8_t *raw = (const uint8_t *)message;
+    uint16_t secs = ((uint16_t)raw[8] << 8) | raw[9];
+    uint16_t flags = ((uint16_t)raw[10] << 8) | raw[11];
+    message->secs = secs;
+    message->flags = flags;
+}
+
+// Find the End option of a message, returns its index or -1 if the options run out without one
+int16_t findDHCPOptionsEnd(DHCP_MESSAGE *message) {
+    int opt_index = 0;
+    while (opt_index < DHCP_DEFAULT_OPTIONS_SIZE) {
+        if (message->options[opt_index] == DHCP_END) return opt_index;
+        if (message->options[opt_index] == DHCP_PAD) {
+            opt_index++;
+            continue;
+        }
+        if (opt_index + 1 >= DHCP_DEFAULT_OPTIONS_SIZE) return -1;
+        opt_index += 2 + message->options[opt_index + 1];
+    }
+    return -1;
+}
+
+// Get the message type of a message, 0 if it has none
+uint8_t getDHCPMessageType(DHCP_MESSAGE *message) {
+    int16_t opt_index = findDHCPOption(message, DHCP_MESSAGE_TYPE);
+    if (opt_index < 0 || message->options[opt_index + 1] < 1) return 0;
+    return message->options[opt_index + 2];
+}
+
+// CRC32 (IEEE 802.3) of a block of bytes
+static uint32_t crc32(const uint8_t *data, uint16_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (int i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+// Key identifying the client that sent a message, the client identifier option when present, otherwise chaddr
+uint32_t getDHCPClientKey(DHCP_MESSAGE *message) {
+    int16_t opt_index = findDHCPOption(message, DHCP_CLIENT_IDENTIFIER);
+    if (opt_index >= 0 && opt_index + 2 + message->options[opt_index + 1] <= DHCP_DEFAULT_OPTIONS_SIZE) {
+        return crc32(&message->options[opt_index + 2], message->options[opt_index + 1]);
+    }
+    uint8_t hlen = message->hlen;
+    if (hlen > 16) hlen = 16;
+    return crc32(message->chaddr, hlen);
+}
+
+// Write a 32 bit value in network order
+static void writeUInt32(uint8_t *buffer, uint32_t value) {
+    buffer[0] = (uint8_t)(value >> 24);
+    buffer[1] = (uint8_t)(value >> 16);
+    buffer[2] = (uint8_t)(value >> 8);
+    buffer[3] = (uint8_t)value;
+}
+
+// Read a 32 bit value in network order
+static uint32_t readUInt32(const uint8_t *buffer) {
+    return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
+}
+
+// Copy a single option into an overload area, returns the new index or the unchanged index if it does not fit
+static uint16_t placeDHCPOption(uint8_t *area, uint16_t index, uint16_t size, const uint8_t *option, uint16_t length) {
+    if (index + length > size) return index;
+    memcpy(&area[index], option, length);
+    return index + length;
+}
+
+// Write a DHCP message to buffer using only the bytes it needs, options that do not fit within max_size
+// are overloaded into the file and then the sname fields. Returns the number of bytes written
+uint16_t serializeDHCPMessage(DHCP_MESSAGE *message, uint8_t *buffer, uint16_t max_size) {
+    if (max_size < DHCP_HEADER_SIZE + 1) return 0;
+    // Fixed fields, 16 bit fields are held in host order and go out in network order
+    memcpy(buffer, message, DHCP_HEADER_SIZE);
+    buffer[8] = (uint8_t)(message->secs >> 8);
+    buffer[9] = (uint8_t)(message->secs & 0xFF);
+    buffer[10] = (uint8_t)(message->flags >> 8);
+    buffer[11] = (uint8_t)(message->flags & 0xFF);
+    buffer[236] = (uint8_t)(DHCP_MAGIC_COOKIE >> 24);
+    buffer[237] = (uint8_t)((DHCP_MAGIC_COOKIE >> 16) & 0xFF);
+    buffer[238] = (uint8_t)((DHCP_MAGIC_COOKIE >> 8) & 0xFF);
+    buffer[239] = (uint8_t)(DHCP_MAGIC_COOKIE & 0xFF);
+    // Measure the options, padding is dropped
+    uint16_t options_length = 0;
+    int opt_index = 0;
+    while (opt_index < DHCP_DEFAULT_OPTIONS_SIZE && message->options[opt_index] != DHCP_END) {
+        if (message->options[opt_index] == DHCP_PAD) {
+            opt_index++;
+        } else {
+            options_length += 2 + message->options[opt_index + 1];
+            opt_index += 2 + message->options[opt_index + 1];
+        }
+    }
+    uint8_t *options = &buffer[DHCP_HEADER_SIZE];
+    uint16_t capacity = max_size - DHCP_HEADER_SIZE;
+    uint16_t main_index = 0, file_index = 0, sname_index = 0;
+    bool overloaded = options_length + 1 > capacity;
+    if (overloaded) {
+        if (capacity < 4) return 0;
+        capacity -= 3;  // Room for the overload option itself
+        memset(&buffer[DHCP_SNAME_OFFSET], 0, DHCP_SNAME_SIZE + DHCP_FILE_SIZE);
+    }
+    // Place each option in the first area that can hold it, in order
+    opt_index = 0;
+    while (opt_index < DHCP_DEFAULT_OPTIONS_SIZE && message->options[opt_index] != DHCP_END) {
+        if (message->options[opt_index] == DHCP_PAD) {
+            opt_index++;
+            continue;
+        }
+        const uint8_t *option = &message->options[opt_index];
+        uint16_t length = 2 + option[1];
+        opt_index += length;
+        uint16_t placed = placeDHCPOption(options, main_index, capacity - 1, option, length);
+        if (placed != main_index) {
+            main_index = placed;
+            continue;
+        }
+        if (!overloaded) continue;
+        placed = placeDHCPOption(&buffer[DHCP_FILE_OFFSET], file_index, DHCP_FILE_SIZE - 1, option, length);
+        if (placed != file_index) {
+            file_index = placed;
+            continue;
+        }
+        sname_index = placeDHCPOption(&buffer[DHCP_SNAME_OFFSET], sname_index, DHCP_SNAME_SIZE - 1, option, length);
+    }
+    if (overloaded) {
+        uint8_t overload = DHCP_OVERLOAD_FILE;
+        buffer[DHCP_FILE_OFFSET + file_index] = DHCP_END;
+        if (sname_index > 0) {
+            overload = DHCP_OVERLOAD_BOTH;
+            buffer[DHCP_SNAME_OFFSET + sname_index] = DHCP_END;
+        }
+        options[main_index++] = DHCP_OPTION_OVERLOAD;
+        options[main_index++] = 1;
+        options[main_index++] = overload;
+    }
+    options[main_index++] = DHCP_END;
+    uint16_t length = DHCP_HEADER_SIZE + main_index;
+    // Legacy BOOTP relays drop anything shorter than DHCP_MIN_PACKET_SIZE
+    if (length < DHCP_MIN_PACKET_SIZE && max_size >= DHCP_MIN_PACKET_SIZE) {
+        memset(&buffer[length], 0, DHCP_MIN_PACKET_SIZE - length);
+        length = DHCP_MIN_PACKET_SIZE;
+    }
+    return length;
+}
+
 // ********** DHCP SERVER **********
 
 // DHCP_SERVER Default constructor, this constructor should be avoided
 DHCP_SERVER::DHCP_SERVER() {
-    SERVER_ADDRESS = IPAddress(10,0,0,1);
-    assignAddressPool(SERVER_ADDRESS, 255);
-    _verbose = false;
-    DHCP_SOCKET.begin(DHCP_SERVER_PORT);
+    initServer(IPAddress(10,0,0,1), 255, false);
 }
 
 // DHCP_SERVER Intended Constructor, sets the address pool and server IP
 DHCP_SERVER::DHCP_SERVER(IPAddress server_address, uint8_t range) {
-    SERVER_ADDRESS = server_address;
-    assignAddressPool(SERVER_ADDRESS, range);
-    _verbose = false;
-    DHCP_SOCKET.begin(DHCP_SERVER_PORT);
+    initServer(server_address, range, false);
 }
 
 // DHCP_SERVER Intended Constructor, sets the address pool, server IP, and verbosity
 DHCP_SERVER::DHCP_SERVER(IPAddress server_address, uint8_t range, bool verbose) {
-    SERVER_ADDRESS = server_address;
-    assignAddressPool(SERVER_ADDRESS, range);
+    initServer(server_address, range, verbose);
+}
+
+// Shared constructor body
+void DHCP_SERVER::initServer(IPAddress server_address, uint8_t range, bool verbose) {
+    _addresses = NULL;
+    _leases = NULL;
+    _offer_queue = NULL;
+    _offer_hold_time = DHCP_DEFAULT_OFFER_HOLD_TIME;
+    _config = NULL;
+    _config_version = 0;
+    _retired_config = NULL;
+    _retired_addresses = NULL;
+    _retired_leases = NULL;
+    _max_message_size = DHCP_MESSAGE_SIZE;
+    _prober = NULL;
+    _allocation_policy = DHCP_ALLOCATE_LOWEST;
+    for (int i = 0; i < DHCP_MAX_PENDING_PROBES; i++) {
+        _probes[i].active = false;
+    }
+    _failover_role = DHCP_FAILOVER_DISABLED;
+    _failover_port = DHCP_FAILOVER_PORT;
+    _failover_peer_port = DHCP_FAILOVER_PORT;
+    _snapshot = NULL;
+    _snapshot_size = 0;
+    _snapshot_count = 0;
+    _snapshot_epoch = 0;
+    for (int i = 0; i < DHCP_PRIORITY_CLASSES; i++) {
+        _queues[i] = NULL;
+        _queue_sizes[i] = NULL;
+        _queue_drops[i] = 0;
+    }
+    freeQueues();
+    _clock = millis;
+    DHCP_SERVER_CONFIG config;
+    memset(&config, 0, sizeof(config));
+    for (int i = 0; i < 4; i++) {
+        config.server_address[i] = server_address[i];
+        config.subnet_mask[i] = i < 3 ? 255 : 0;
+    }
+    config.pool.firstOctet  = server_address[0];
+    config.pool.secondOctet = server_address[1];
+    config.pool.thirdOctet  = server_address[2];
+    config.pool.range = range;
+    config.lease_time = DHCP_DEFAULT_LEASE_TIME;
+    reloadConfig(config);
     _verbose = verbose;
     DHCP_SOCKET.begin(DHCP_SERVER_PORT);
     if (_verbose) Serial.println(F("DHCP UDP Socket opened"));
@@ -44,78 +263,537 @@ DHCP_SERVER::DHCP_SERVER(IPAddress server_address, uint8_t range, bool verbose)
 
 // DHCP Server Destructor
 DHCP_SERVER::~DHCP_SERVER() {
+    DHCP_SOCKET.stop();
+    if (_failover_role != DHCP_FAILOVER_DISABLED) FAILOVER_SOCKET.stop();
+    freeRetiredConfig();
+    delete _config;
     delete [] _addresses;
+    delete [] _leases;
+    delete [] _offer_queue;
+    delete [] _snapshot;
+    freeQueues();
 }
 
-// Set the DHCP Address Pool
+// Set the DHCP Address Pool, leases on addresses the old and new pool share are kept
 void DHCP_SERVER::assignAddressPool(IPAddress server_address, uint8_t address_range) {
-    address_pool.firstOctet  = server_address[0];
-    address_pool.secondOctet = server_address[1];
-    address_pool.thirdOctet  = server_address[2];
+    DHCP_SERVER_CONFIG config;
+    getConfig(config);
+    config.pool.firstOctet  = server_address[0];
+    config.pool.secondOctet = server_address[1];
+    config.pool.thirdOctet  = server_address[2];
     if (address_range > 255) {
-        address_pool.range = 255;
+        config.pool.range = 255;
     } else {
-        address_pool.range = address_range;
+        config.pool.range = address_range;
+    }
+    reloadConfig(config);
+}
+
+// Copy the current configuration, a starting point for building the next one
+void DHCP_SERVER::getConfig(DHCP_SERVER_CONFIG &config) {
+    config = *_config;
+    config.lease_time = _lease_time;
+}
+
+// Get the number of configurations loaded, it increases with every successful reload
+uint32_t DHCP_SERVER::getConfigVersion() {
+    return _config_version;
+}
+
+// Check if Rapid Commit is allowed
+bool DHCP_SERVER::getRapidCommit() {
+    return _config->rapid_commit;
+}
+
+// Allow Rapid Commit (RFC 4039), a DISCOVER that asks for it is bound right away and answered with an ACK. Only
+// enable this where this is the only server a client can hear, a client takes the first ACK it gets
+void DHCP_SERVER::setRapidCommit(bool rapid_commit) {
+    DHCP_SERVER_CONFIG config;
+    getConfig(config);
+    config.rapid_commit = rapid_commit;
+    reloadConfig(config);
+}
+
+// Swap in a new configuration. Everything is built before anything is replaced, so a failed allocation leaves the
+// running configuration untouched and requests never see a half built one. Leases and pending probes on addresses
+// the old and new pool share carry over. The replaced arrays are kept until the next handleTimers() so anything
+// still working against them can finish. Failover peers must be reloaded with the same pool
+bool DHCP_SERVER::reloadConfig(const DHCP_SERVER_CONFIG &config) {
+    freeRetiredConfig();
+    DHCP_SERVER_CONFIG *next_config = new DHCP_SERVER_CONFIG;
+    bool *next_addresses = new bool[config.pool.range];
+    DHCP_LEASE *next_leases = new DHCP_LEASE[config.pool.range];
+    DHCP_OFFER_EXPIRY *next_offer_queue = new DHCP_OFFER_EXPIRY[config.pool.range];
+    if (next_config == NULL || next_addresses == NULL || next_leases == NULL || next_offer_queue == NULL) {
+        delete next_config;
+        delete [] next_addresses;
+        delete [] next_leases;
+        delete [] next_offer_queue;
+        return false;
+    }
+    *next_config = config;
+    if (next_config->reservation_count > DHCP_MAX_RESERVATIONS) next_config->reservation_count = DHCP_MAX_RESERVATIONS;
+    for (int i = 0; i < config.pool.range; i++) {
+        int16_t index = -1;
+        if (_config != NULL) {
+            index = getPoolIndex(IPAddress(config.pool.firstOctet, config.pool.secondOctet, config.pool.thirdOctet, i + 2));
+        }
+        if (index >= 0) {
+            next_addresses[i] = _addresses[index];
+            next_leases[i] = _leases[index];
+            continue;
+        }
+        next_addresses[i] = true;
+        next_leases[i].status = DHCP_LEASE_FREE;
+        next_leases[i].expires = 0;
+        next_leases[i].probe = DHCP_PROBE_PENDING;
+        next_leases[i].probe_expires = 0;
+        next_leases[i].mac_crc = 0;
+        next_leases[i].host_crc = 0;
     }
-    _addresses = new bool[address_pool.range];
+    IPAddress probed[DHCP_MAX_PENDING_PROBES];
+    for (int i = 0; i < DHCP_MAX_PENDING_PROBES; i++) {
+        if (_probes[i].active) probed[i] = getPoolAddress(_probes[i].index);
+    }
+    // Swap
+    _retired_config = _config;
+    _retired_addresses = _addresses;
+    _retired_leases = _leases;
+    _config = next_config;
+    _addresses = next_addresses;
+    _leases = next_leases;
+    address_pool = next_config->pool;
+    SERVER_ADDRESS = IPAddress(next_config->server_address[0], next_config->server_address[1],
+                               next_config->server_address[2], next_config->server_address[3]);
+    setLeaseTime(next_config->lease_time);
+    resetScope();
+    // Offers that carried over are queued again in expiry order, the queue is never shared so it goes right away
+    delete [] _offer_queue;
+    _offer_queue = next_offer_queue;
+    _offer_queue_head = 0;
+    _offer_queue_count = 0;
     for (int i = 0; i < address_pool.range; i++) {
-        _addresses[i] = true;
+        if (_leases[i].status != DHCP_LEASE_OFFERED) continue;
+        int slot = _offer_queue_count++;
+        while (slot > 0 && (long)(_offer_queue[slot - 1].expires - _leases[i].expires) > 0) {
+            _offer_queue[slot] = _offer_queue[slot - 1];
+            slot--;
+        }
+        _offer_queue[slot].index = i;
+        _offer_queue[slot].expires = _leases[i].expires;
+    }
+    for (int i = 0; i < DHCP_MAX_PENDING_PROBES; i++) {
+        if (!_probes[i].active) continue;
+        int16_t index = getPoolIndex(probed[i]);
+        if (index < 0) {
+            _probes[i].active = false;              // The client will retransmit and get an address from the new pool
+        } else {
+            _probes[i].index = index;
+        }
+    }
+    _config_version++;
+    return true;
+}
+
+// Free the configuration and arrays the last reload replaced
+void DHCP_SERVER::freeRetiredConfig() {
+    delete _retired_config;
+    delete [] _retired_addresses;
+    delete [] _retired_leases;
+    _retired_config = NULL;
+    _retired_addresses = NULL;
+    _retired_leases = NULL;
+}
+
+// Get the lease time handed to clients
+uint32_t DHCP_SERVER::getLeaseTime() {
+    return _lease_time;
+}
+
+// Set the lease time handed to clients, clamped so lease deadlines stay comparable across millis() rollover
+void DHCP_SERVER::setLeaseTime(uint32_t lease_time) {
+    if (lease_time > DHCP_MAX_LEASE_TIME) lease_time = DHCP_MAX_LEASE_TIME;
+    if (lease_time < 1) lease_time = 1;
+    _lease_time = lease_time;
+    if (_config != NULL) buildOptionTemplates();
+}
+
+// Get the time in ms offers are held waiting for a REQUEST
+unsigned long DHCP_SERVER::getOfferHoldTime() {
+    return _offer_hold_time;
+}
+
+// Set the time in ms offers are held waiting for a REQUEST, offers already made keep their deadline and later
+// offers are queued in deadline order among them
+void DHCP_SERVER::setOfferHoldTime(unsigned long hold_time) {
+    _offer_hold_time = hold_time;
+}
+
+// Pre-build the option blocks replies on the fast paths are sent with
+void DHCP_SERVER::buildOptionTemplates() {
+    uint8_t message_type = DHCP_ACK;
+    uint8_t server_id[4] = {SERVER_ADDRESS[0], SERVER_ADDRESS[1], SERVER_ADDRESS[2], SERVER_ADDRESS[3]};
+    uint8_t lease_time[4];
+    writeUInt32(lease_time, _lease_time);
+    uint16_t opt_index = 0;
+    opt_index = addDHCPOption(_ack_template, opt_index, DHCP_MESSAGE_TYPE, 1, &message_type);
+    opt_index = addDHCPOption(_ack_template, opt_index, DHCP_SERVER_IDENTIFIER, 4, server_id);
+    opt_index = addDHCPOption(_ack_template, opt_index, DHCP_IP_LEASE_TIME, 4, lease_time);
+    opt_index = addDHCPOption(_ack_template, opt_index, DHCP_SUBNET_MASK, 4, _config->subnet_mask);
+    if (readUInt32(_config->router) != 0) {
+        opt_index = addDHCPOption(_ack_template, opt_index, DHCP_ROUTER, 4, _config->router);
+    }
+    if (readUInt32(_config->dns_server) != 0) {
+        opt_index = addDHCPOption(_ack_template, opt_index, DHCP_DNS_NAME_SERVER, 4, _config->dns_server);
     }
+    _ack_template[opt_index++] = DHCP_END;
+    _ack_template_size = opt_index;
+    // INFORM replies carry the same configuration without a lease, RFC 2131 section 3.4
+    opt_index = 0;
+    opt_index = addDHCPOption(_inform_template, opt_index, DHCP_MESSAGE_TYPE, 1, &message_type);
+    opt_index = addDHCPOption(_inform_template, opt_index, DHCP_SERVER_IDENTIFIER, 4, server_id);
+    opt_index = addDHCPOption(_inform_template, opt_index, DHCP_SUBNET_MASK, 4, _config->subnet_mask);
+    if (readUInt32(_config->router) != 0) {
+        opt_index = addDHCPOption(_inform_template, opt_index, DHCP_ROUTER, 4, _config->router);
+    }
+    if (readUInt32(_config->dns_server) != 0) {
+        opt_index = addDHCPOption(_inform_template, opt_index, DHCP_DNS_NAME_SERVER, 4, _config->dns_server);
+    }
+    _inform_template[opt_index++] = DHCP_END;
+    _inform_template_size = opt_index;
+}
+
+// Probe addresses for conflicts before offering them, probes are polled from handleTimers() so event loops
+// should call it when the prober completes as well as at nextTimerDeadline()
+void DHCP_SERVER::setConflictProber(DHCP_CONFLICT_PROBER *prober) {
+    _prober = prober;
+}
+
+// Get the allocation policy
+uint8_t DHCP_SERVER::getAllocationPolicy() {
+    return _allocation_policy;
+}
+
+// Set the allocation policy, leases that are already bound are left where they are
+void DHCP_SERVER::setAllocationPolicy(uint8_t policy) {
+    if (policy != DHCP_ALLOCATE_HASHED) policy = DHCP_ALLOCATE_LOWEST;
+    _allocation_policy = policy;
 }
 
 // Assign network address from available addresses in the pool
 IPAddress DHCP_SERVER::assignAddress(IPAddress requested_ip) {
+    return assignAddress(requested_ip, 0);
+}
+
+// Assign network address from available addresses in the pool to the client identified by client_key
+IPAddress DHCP_SERVER::assignAddress(IPAddress requested_ip, uint32_t client_key) {
     IPAddress address;
-    if (isAddressAvailable(requested_ip)) {
+    int16_t index = getPoolIndex(requested_ip);
+    if (index >= _scope_start && index < _scope_end && _addresses[index] && !isReservedForOther(index, client_key)) {
         address = requested_ip;
     } else {
-        address = getAddressFromPool();
+        address = getAddressFromPool(client_key);
+    }
+    index = getPoolIndex(address);
+    if (index >= 0 && _addresses[index]) {
+        _addresses[index] = false;
+        _leases[index].status = DHCP_LEASE_BOUND;
+        _leases[index].expires = _clock() + _lease_time * 1000UL;
+        _leases[index].mac_crc = client_key;
+        logLeaseChange(DHCP_FAILOVER_ASSIGN, index);
     }
-    if (isAddressAvailable(address)) _addresses[address[3] - 2] = false;
     return address;
 }
 
 // Get a valid network address from the address pool
 IPAddress DHCP_SERVER::getAddressFromPool() {
-    uint8_t fourthOctet;
-    for (int i = 0; i < address_pool.range; i++) {
-        if (_addresses[i]) {
-            fourthOctet = i + 2;
-            break;
-        }
+    return getAddressFromPool(0);
+}
+
+// Get a valid network address from the address pool for a client. The hashed policy starts at the slot the client
+// key maps to and walks forward through the scope, so a client gets the same address back whenever its slot is free
+IPAddress DHCP_SERVER::getAddressFromPool(uint32_t client_key) {
+    DHCP_TRACE_SCOPE(DHCP_TRACE_ALLOCATE);
+    uint8_t scope = _scope_end - _scope_start;
+    uint8_t offset = 0;
+    if (_scope_end <= _scope_start) return IPAddress(0, 0, 0, 0);
+    int16_t reserved = getReservedIndex(client_key);
+    if (reserved >= _scope_start && reserved < _scope_end && _addresses[reserved]) return getPoolAddress(reserved);
+    if (_allocation_policy == DHCP_ALLOCATE_HASHED) offset = client_key % scope;
+    for (int i = 0; i < scope; i++) {
+        int index = _scope_start + (offset + i) % scope;
+        if (_addresses[index] && !isReservedForOther(index, client_key)) return getPoolAddress(index);
     }
-    IPAddress address(address_pool.firstOctet, address_pool.secondOctet, address_pool.thirdOctet, fourthOctet);
-    if (isAddressAvailable(address)) {
-        return address;
-    } else {
-        return IPAddress(0, 0, 0, 0);
+    return IPAddress(0, 0, 0, 0);
+}
+
+// Get the pool index reserved for a client key, -1 if the client has no reservation in the pool
+int16_t DHCP_SERVER::getReservedIndex(uint32_t client_key) {
+    if (client_key == 0) return -1;
+    for (int i = 0; i < _config->reservation_count; i++) {
+        DHCP_RESERVATION *reservation = &_config->reservations[i];
+        if (reservation->client_key != client_key) continue;
+        return getPoolIndex(IPAddress(reservation->address[0], reservation->address[1],
+                                      reservation->address[2], reservation->address[3]));
+    }
+    return -1;
+}
+
+// Check if a pool index is reserved for a client other than client_key
+bool DHCP_SERVER::isReservedForOther(uint8_t index, uint32_t client_key) {
+    for (int i = 0; i < _config->reservation_count; i++) {
+        DHCP_RESERVATION *reservation = &_config->reservations[i];
+        if (reservation->client_key == client_key) continue;
+        if (getPoolIndex(IPAddress(reservation->address[0], reservation->address[1],
+                                   reservation->address[2], reservation->address[3])) == index) return true;
     }
+    return false;
+}
+
+// Get the index of a network address in the pool, -1 if it is outside the pool
+int16_t DHCP_SERVER::getPoolIndex(IPAddress address) {
+    if (address[0] != address_pool.firstOctet) return -1;
+    if (address[1] != address_pool.secondOctet) return -1;
+    if (address[2] != address_pool.thirdOctet) return -1;
+    if (address[3] < 2 || address[3] - 2 >= address_pool.range) return -1;
+    return address[3] - 2;
+}
+
+// Get the network address at an index in the pool
+IPAddress DHCP_SERVER::getPoolAddress(uint8_t index) {
+    return IPAddress(address_pool.firstOctet, address_pool.secondOctet, address_pool.thirdOctet, index + 2);
 }
 
 // Check if a network address is in the pool and available
 bool DHCP_SERVER::isAddressAvailable(IPAddress address) {
-    if (address[0] != address_pool.firstOctet) return false;
-    if (address[1] != address_pool.secondOctet) return false;
-    if (address[2] != address_pool.thirdOctet) return false;
-    if (address[3] > address_pool.range) return false;
-    return _addresses[address[3] - 2];
+    int16_t index = getPoolIndex(address);
+    if (index < 0) return false;
+    return _addresses[index];
 }
 
 // Release assigned address
 void DHCP_SERVER::releaseAddress(IPAddress address) {
-    if (!_addresses[address[3] - 2]) {
-        _addresses[address[3] - 2] = true;
+    int16_t index = getPoolIndex(address);
+    if (index < 0) return;
+    if (!_addresses[index]) {
+        if (_leases[index].status == DHCP_LEASE_BOUND) logLeaseChange(DHCP_FAILOVER_RELEASE, index);
+        _addresses[index] = true;
+        _leases[index].status = DHCP_LEASE_FREE;
+    }
+}
+
+// Hold an address for a client that is being sent an OFFER. It is reserved without a lease, so nothing is
+// replicated, and goes back to the pool unless a REQUEST claims it within the hold time. A retransmitted
+// DISCOVER gets the address already offered to the client
+IPAddress DHCP_SERVER::offerAddress(IPAddress requested_ip, uint32_t client_key) {
+    int16_t index = findOffer(client_key);
+    if (index < 0) {
+        index = getPoolIndex(requested_ip);
+        if (index < _scope_start || index >= _scope_end || !_addresses[index] || isReservedForOther(index, client_key)) {
+            index = getPoolIndex(getAddressFromPool(client_key));
+        }
+        if (index < 0) return IPAddress(0, 0, 0, 0);
+    }
+    _addresses[index] = false;
+    _leases[index].status = DHCP_LEASE_OFFERED;
+    _leases[index].expires = _clock() + _offer_hold_time;
+    _leases[index].mac_crc = client_key;
+    queueOfferExpiry(index);
+    return getPoolAddress(index);
+}
+
+// Get the pool index offered to a client key, -1 if the client has no offer outstanding
+int16_t DHCP_SERVER::findOffer(uint32_t client_key) {
+    DHCP_TRACE_SCOPE(DHCP_TRACE_LOOKUP);
+    for (int i = _scope_start; i < _scope_end; i++) {
+        if (_leases[i].status == DHCP_LEASE_OFFERED && _leases[i].mac_crc == client_key) return i;
+    }
+    return -1;
+}
+
+// Add an offer to the expiry queue in deadline order. Offers share one hold time so this is normally the back, a
+// shortened hold time moves the new offer ahead of older ones. Claimed, released and re-made offers leave stale
+// entries behind, so a full queue is compacted first, there is at most one live offer per address
+void DHCP_SERVER::queueOfferExpiry(uint8_t index) {
+    if (_offer_queue_count == address_pool.range) {
+        uint8_t live = 0;
+        for (int i = 0; i < _offer_queue_count; i++) {
+            DHCP_OFFER_EXPIRY entry = _offer_queue[(_offer_queue_head + i) % address_pool.range];
+            if (entry.index == index) continue;
+            if (_leases[entry.index].status != DHCP_LEASE_OFFERED || _leases[entry.index].expires != entry.expires) continue;
+            _offer_queue[live++] = entry;
+        }
+        _offer_queue_head = 0;
+        _offer_queue_count = live;
+    }
+    unsigned long expires = _leases[index].expires;
+    int slot = _offer_queue_count++;
+    while (slot > 0) {
+        DHCP_OFFER_EXPIRY *previous = &_offer_queue[(_offer_queue_head + slot - 1) % address_pool.range];
+        if ((long)(previous->expires - expires) <= 0) break;
+        _offer_queue[(_offer_queue_head + slot) % address_pool.range] = *previous;
+        slot--;
+    }
+    DHCP_OFFER_EXPIRY *entry = &_offer_queue[(_offer_queue_head + slot) % address_pool.range];
+    entry->index = index;
+    entry->expires = expires;
+}
+
+// Return offers nobody claimed to the pool, only the front of the queue is ever looked at
+void DHCP_SERVER::expireOffers(unsigned long now) {
+    while (_offer_queue_count > 0) {
+        DHCP_OFFER_EXPIRY *entry = &_offer_queue[_offer_queue_head];
+        DHCP_LEASE *lease = &_leases[entry->index];
+        bool live = lease->status == DHCP_LEASE_OFFERED && lease->expires == entry->expires;
+        if (live && (long)(now - entry->expires) < 0) break;
+        if (live) {
+            _addresses[entry->index] = true;
+            lease->status = DHCP_LEASE_FREE;
+        }
+        _offer_queue_head = (_offer_queue_head + 1) % address_pool.range;
+        _offer_queue_count--;
+    }
+}
+
+// Answer a REQUEST in SELECTING or INIT-REBOOT state. The client's own offer or lease at the requested address
+// becomes a lease and is replicated, anything else is refused. A client that chose another server gives its
+// offer back, and a client we have no record of is left for the server that does
+DHCP_MESSAGE DHCP_SERVER::confirmRequest(DHCP_MESSAGE *request, IPAddress requested_ip, IPAddress server_id) {
+    DHCP_TRACE_SCOPE(DHCP_TRACE_LOOKUP);
+    uint32_t client_key = getDHCPClientKey(request);
+    int16_t index;
+    if (server_id != DHCP_CLIENT_ADDRESS && server_id != SERVER_ADDRESS) {
+        index = findOffer(client_key);
+        if (index >= 0) releaseAddress(getPoolAddress(index));
+        DHCP_MESSAGE reply;
+        reply.op = DHCP_NO_REPLY;
+        return reply;
+    }
+    index = getPoolIndex(requested_ip);
+    if (index >= 0 && _leases[index].mac_crc == client_key &&
+        (_leases[index].status == DHCP_LEASE_OFFERED || _leases[index].status == DHCP_LEASE_BOUND)) {
+        _addresses[index] = false;
+        _leases[index].status = DHCP_LEASE_BOUND;
+        _leases[index].expires = _clock() + _lease_time * 1000UL;
+        logLeaseChange(DHCP_FAILOVER_ASSIGN, index);
+        return createDHCPReply(DHCP_ACK, requested_ip, request->xid);
+    }
+    if (server_id == DHCP_CLIENT_ADDRESS && index >= 0 && _leases[index].status == DHCP_LEASE_FREE) {
+        DHCP_MESSAGE reply;
+        reply.op = DHCP_NO_REPLY;
+        return reply;
+    }
+    return createDHCPReply(DHCP_NAK, DHCP_CLIENT_ADDRESS, request->xid);
+}
+
+// Hold an offer until its address has been probed, returns false if the offer can be made right away
+bool DHCP_SERVER::beginConflictProbe(DHCP_MESSAGE *request, IPAddress requested_ip) {
+    // A retransmitted DISCOVER waits on the probe already in flight
+    for (int i = 0; i < DHCP_MAX_PENDING_PROBES; i++) {
+        if (!_probes[i].active) continue;
+        if (_probes[i].xid == request->xid && memcmp(_probes[i].chaddr, request->chaddr, 16) == 0) return true;
+    }
+    if (findOffer(getDHCPClientKey(request)) >= 0) return false;      // Already probed and offered, offer it again
+    int16_t index = getPoolIndex(requested_ip);
+    if (index < 0 || !_addresses[index]) index = getPoolIndex(getAddressFromPool(getDHCPClientKey(request)));
+    if (index < 0) return true;                 // Pool exhausted, there is nothing to offer
+    unsigned long now = _clock();
+    if (_leases[index].probe == DHCP_PROBE_CLEAR && (long)(_leases[index].probe_expires - now) > 0) return false;
+    DHCP_PENDING_PROBE *probe = NULL;
+    for (int i = 0; i < DHCP_MAX_PENDING_PROBES; i++) {
+        if (!_probes[i].active) {
+            probe = &_probes[i];
+            break;
+        }
+    }
+    if (probe == NULL) return true;             // Too many probes in flight, the client will retransmit
+    if (!_prober->beginProbe(getPoolAddress(index))) return false;
+    probe->active = true;
+    probe->index = index;
+    probe->started = now;
+    probe->xid = request->xid;
+    probe->htype = request->htype;
+    probe->hlen = request->hlen;
+    memcpy(probe->giaddr, request->giaddr, 4);
+    memcpy(probe->chaddr, request->chaddr, 16);
+    probe->client_key = getDHCPClientKey(request);
+    probe->max_message_size = _max_message_size;
+    _addresses[index] = false;
+    _leases[index].status = DHCP_LEASE_PROBING;
+    _leases[index].expires = now + DHCP_PROBE_TIMEOUT;
+    return true;
+}
+
+// Offer addresses whose probes came back clear or timed out, quarantine those that were answered
+void DHCP_SERVER::handleConflictProbes(unsigned long now) {
+    for (int i = 0; i < DHCP_MAX_PENDING_PROBES; i++) {
+        DHCP_PENDING_PROBE *probe = &_probes[i];
+        if (!probe->active) continue;
+        IPAddress address = getPoolAddress(probe->index);
+        uint8_t status = DHCP_PROBE_CLEAR;
+        if (_prober != NULL) status = _prober->probeStatus(address);
+        if (status == DHCP_PROBE_PENDING) {
+            if ((long)(now - probe->started) < (long)DHCP_PROBE_TIMEOUT) continue;
+            status = DHCP_PROBE_CLEAR;          // Nobody answered in time
+        }
+        if (status == DHCP_PROBE_CONFLICT) {
+            _leases[probe->index].status = DHCP_LEASE_QUARANTINED;
+            _leases[probe->index].expires = now + DHCP_QUARANTINE_TIME;
+            _leases[probe->index].probe = DHCP_PROBE_CONFLICT;
+            _leases[probe->index].probe_expires = now + DHCP_QUARANTINE_TIME;
+            if (_verbose) Serial.println(F("DHCP address conflict, address quarantined"));
+            // Move on to the next candidate, it is offered right away if it was recently probed
+            int16_t index = getPoolIndex(getAddressFromPool(probe->client_key));
+            if (index < 0) {
+                probe->active = false;
+                continue;
+            }
+            probe->index = index;
+            probe->started = now;
+            _addresses[index] = false;
+            _leases[index].status = DHCP_LEASE_PROBING;
+            _leases[index].expires = now + DHCP_PROBE_TIMEOUT;
+            address = getPoolAddress(index);
+            bool cached = _leases[index].probe == DHCP_PROBE_CLEAR && (long)(_leases[index].probe_expires - now) > 0;
+            if (!cached && _prober != NULL && _prober->beginProbe(address)) continue;
+        } else {
+            _leases[probe->index].probe = DHCP_PROBE_CLEAR;
+            _leases[probe->index].probe_expires = now + DHCP_PROBE_CACHE_TIME;
+        }
+        probe->active = false;
+        releaseAddress(address);
+        address = offerAddress(address, probe->client_key);
+        DHCP_MESSAGE reply = createDHCPReply(DHCP_OFFER, address, probe->xid);
+        reply.htype = probe->htype;
+        reply.hlen = probe->hlen;
+        memcpy(reply.giaddr, probe->giaddr, 4);
+        memcpy(reply.chaddr, probe->chaddr, 16);
+        uint8_t buffer[sizeof(DHCP_MESSAGE)];
+        sendDHCPReply(&reply, buffer, probe->max_message_size);
     }
 }
 
 // Parse DHCP Messages: If received from client then will allocate an address as required
 DHCP_MESSAGE DHCP_SERVER::parseDHCPRequest(DHCP_MESSAGE message) {
+    DHCP_TRACE_SCOPE(DHCP_TRACE_PARSE);
     // Simple check to make sure request is from a client
     if (message.op != DHCP_BOOTREQUEST) return createDHCPReply(DHCP_NAK, DHCP_CLIENT_ADDRESS, message.xid);
+    DHCP_MESSAGE reply;
+    // A standby leaves the clients to its primary while the primary is up
+    if (!isServing()) {
+        reply.op = DHCP_NO_REPLY;
+        return reply;
+    }
+    // INFORMs and renewals skip the full option walk and the allocator
+    if (getDHCPMessageType(&message) == DHCP_INFORM) return answerInform(&message);
+    if (readUInt32(message.ciaddr) != 0 && isRenewal(&message)) return renewLease(&message);
     int opt_index = 0;
     uint8_t opt_len = 0;
     uint8_t message_type = 0;
     IPAddress client_ip = {0, 0, 0, 0};
+    IPAddress server_id = {0, 0, 0, 0};
+    bool rapid_commit = false;
+    _max_message_size = DHCP_MESSAGE_SIZE;
     // Parse the relevant DHCP options
     while (opt_index < DHCP_DEFAULT_OPTIONS_SIZE) {
         switch (message.options[opt_index]) {
@@ -169,6 +847,9 @@ DHCP_MESSAGE DHCP_SERVER::parseDHCPRequest(DHCP_MESSAGE message) {
             opt_index++;
             opt_len = message.options[opt_index];
             opt_index++;
+            for (int i = 0; i < opt_len && i < 4; i++) {
+                server_id[i] = message.options[opt_index + i];
+            }
             opt_index += opt_len;
             break;
         case DHCP_PARAMETER_REQUEST_LIST:           // Client included a parameter list
@@ -181,6 +862,10 @@ DHCP_MESSAGE DHCP_SERVER::parseDHCPRequest(DHCP_MESSAGE message) {
             opt_index++;
             opt_len = message.options[opt_index];
             opt_index++;
+            if (opt_len == 2) {
+                uint16_t max_size = ((uint16_t)message.options[opt_index] << 8) | message.options[opt_index + 1];
+                if (max_size > DHCP_MESSAGE_SIZE) _max_message_size = max_size;
+            }
             opt_index += opt_len;
             break;
         case DHCP_MESSAGE_OPTION:                   // Client included a message
@@ -189,6 +874,13 @@ DHCP_MESSAGE DHCP_SERVER::parseDHCPRequest(DHCP_MESSAGE message) {
             opt_index++;
             opt_index += opt_len;
             break;
+        case DHCP_RAPID_COMMIT:                     // Client accepts an ACK in answer to its DISCOVER
+            opt_index++;
+            opt_len = message.options[opt_index];
+            opt_index++;
+            rapid_commit = true;
+            opt_index += opt_len;
+            break;
         default:                                    // All other options are not relevant to clients
             opt_index++;
             opt_len = message.options[opt_index];
@@ -200,22 +892,142 @@ DHCP_MESSAGE DHCP_SERVER::parseDHCPRequest(DHCP_MESSAGE message) {
     // Send back the appropriate DHCP Reply
     switch (message_type) {
     case DHCP_DISCOVER:
-        assignAddress(client_ip);
-        return createDHCPReply(DHCP_OFFER, client_ip, message.xid);
+        if (_prober != NULL && beginConflictProbe(&message, client_ip)) {
+            reply.op = DHCP_NO_REPLY;
+            return reply;
+        }
+        client_ip = offerAddress(client_ip, getDHCPClientKey(&message));
+        if (client_ip == DHCP_CLIENT_ADDRESS) {     // Pool exhausted
+            reply.op = DHCP_NO_REPLY;
+            return reply;
+        }
+        if (rapid_commit && _config->rapid_commit) {
+            // Commit the offer right away, the ACK must carry Rapid Commit back (RFC 4039 section 4). An ACK with no
+            // room left for it falls back to the normal OFFER
+            reply = createDHCPReply(DHCP_ACK, client_ip, message.xid);
+            int16_t end_index = findDHCPOptionsEnd(&reply);
+            uint16_t opt_index = end_index < 0 ? 0 : addDHCPOption(reply.options, end_index, DHCP_RAPID_COMMIT, 0, NULL);
+            if (end_index >= 0 && opt_index != (uint16_t)end_index) {
+                reply.options[opt_index] = DHCP_END;
+                int16_t index = getPoolIndex(client_ip);
+                _leases[index].status = DHCP_LEASE_BOUND;
+                _leases[index].expires = _clock() + _lease_time * 1000UL;
+                logLeaseChange(DHCP_FAILOVER_ASSIGN, index);
+                break;
+            }
+        }
+        reply = createDHCPReply(DHCP_OFFER, client_ip, message.xid);
+        break;
     case DHCP_REQUEST:
-        return createDHCPReply(DHCP_ACK, DHCP_CLIENT_ADDRESS, message.xid);
+        reply = confirmRequest(&message, client_ip, server_id);
+        if (reply.op != DHCP_BOOTREPLY) return reply;
+        break;
     case DHCP_DECLINE:
-        return createDHCPReply(DHCP_NAK, DHCP_CLIENT_ADDRESS, message.xid);
+        reply = createDHCPReply(DHCP_NAK, DHCP_CLIENT_ADDRESS, message.xid);
+        break;
     case DHCP_RELEASE:
-        return createDHCPReply(DHCP_NAK, DHCP_CLIENT_ADDRESS, message.xid);
+        reply = createDHCPReply(DHCP_NAK, DHCP_CLIENT_ADDRESS, message.xid);
+        break;
+    default:
+        reply = createDHCPReply(DHCP_NAK, DHCP_CLIENT_ADDRESS, message.xid);
+        break;
+    }
+    reply.htype = message.htype;
+    reply.hlen = message.hlen;
+    memcpy(reply.giaddr, message.giaddr, 4);
+    memcpy(reply.chaddr, message.chaddr, 16);
+    return reply;
+}
+
+// Check if a request is a renewal, a REQUEST from a client in RENEWING or REBINDING state carries its address in
+// ciaddr and neither a requested address nor a server identifier
+bool DHCP_SERVER::isRenewal(DHCP_MESSAGE *message) {
+    uint8_t message_type = 0;
+    int opt_index = 0;
+    while (opt_index < DHCP_DEFAULT_OPTIONS_SIZE - 2) {
+        uint8_t code = message->options[opt_index];
+        if (code == DHCP_END) break;
+        if (code == DHCP_PAD) {
+            opt_index++;
+            continue;
+        }
+        if (code == DHCP_REQUESTED_IP || code == DHCP_SERVER_IDENTIFIER) return false;
+        if (code == DHCP_MESSAGE_TYPE) message_type = message->options[opt_index + 2];
+        opt_index += 2 + message->options[opt_index + 1];
+    }
+    return message_type == DHCP_REQUEST;
+}
+
+// Extend the lease a client holds at ciaddr and answer from the ACK template. A lease we have no record of gets no
+// reply so the client can reach the server that does, one bound to another client gets a NAK
+DHCP_MESSAGE DHCP_SERVER::renewLease(DHCP_MESSAGE *request) {
+    DHCP_TRACE_SCOPE(DHCP_TRACE_LOOKUP);
+    _max_message_size = DHCP_MESSAGE_SIZE;
+    int16_t index = getPoolIndex(IPAddress(request->ciaddr[0], request->ciaddr[1], request->ciaddr[2], request->ciaddr[3]));
+    uint8_t reply_type = DHCP_ACK;
+    if (index < 0 || _leases[index].status != DHCP_LEASE_BOUND) {
+        reply_type = DHCP_NO_REPLY;
+    } else if (_leases[index].mac_crc != getDHCPClientKey(request)) {
+        reply_type = DHCP_NAK;
+    }
+    // Built in place so the reply is not copied on its way out
+    DHCP_MESSAGE reply = createTemplateReply(request, _ack_template, _ack_template_size);
+    switch (reply_type) {
+    case DHCP_NO_REPLY:
+        reply.op = DHCP_NO_REPLY;
+        break;
+    case DHCP_NAK: {
+        memset(reply.ciaddr, 0, 4);
+        reply.flags = DHCP_BROADCAST_FLAG;
+        uint8_t server_id[4] = {SERVER_ADDRESS[0], SERVER_ADDRESS[1], SERVER_ADDRESS[2], SERVER_ADDRESS[3]};
+        uint16_t opt_index = 0;
+        opt_index = addDHCPOption(reply.options, opt_index, DHCP_MESSAGE_TYPE, 1, &reply_type);
+        opt_index = addDHCPOption(reply.options, opt_index, DHCP_SERVER_IDENTIFIER, 4, server_id);
+        reply.options[opt_index] = DHCP_END;
+        break;
+    }
     default:
-        return createDHCPReply(DHCP_NAK, DHCP_CLIENT_ADDRESS, message.xid);
+        _leases[index].expires = _clock() + _lease_time * 1000UL;
+        logLeaseChange(DHCP_FAILOVER_ASSIGN, index);
+        memcpy(reply.yiaddr, request->ciaddr, 4);
+        break;
+    }
+    return reply;
+}
+
+// Answer an INFORM from the INFORM template, the client already has an address so no lease state is read or written
+DHCP_MESSAGE DHCP_SERVER::answerInform(DHCP_MESSAGE *request) {
+    _max_message_size = DHCP_MESSAGE_SIZE;
+    DHCP_MESSAGE reply = createTemplateReply(request, _inform_template, _inform_template_size);
+    if (readUInt32(request->ciaddr) == 0) reply.op = DHCP_NO_REPLY;     // Nowhere to send it
+    return reply;
+}
+
+// Reply to a request with a pre-built option block, only the fixed fields are filled in
+DHCP_MESSAGE DHCP_SERVER::createTemplateReply(DHCP_MESSAGE *request, const uint8_t *options, uint8_t options_size) {
+    DHCP_TRACE_SCOPE(DHCP_TRACE_BUILD);
+    DHCP_MESSAGE reply;
+    memset(&reply, 0, DHCP_HEADER_SIZE);
+    reply.op = DHCP_BOOTREPLY;
+    reply.htype = request->htype;
+    reply.hlen = request->hlen;
+    reply.xid = request->xid;
+    reply.flags = request->flags;
+    memcpy(reply.ciaddr, request->ciaddr, 4);
+    for (int i = 0; i < 4; i++) {
+        reply.siaddr[i] = SERVER_ADDRESS[i];
     }
+    memcpy(reply.giaddr, request->giaddr, 4);
+    memcpy(reply.chaddr, request->chaddr, 16);
+    memcpy(reply.options, options, options_size);
+    return reply;
 }
 
 // Create DHCP Reply based on the received DHCP Request
 DHCP_MESSAGE DHCP_SERVER::createDHCPReply(uint8_t message_type, IPAddress client_ip, uint32_t xid) {
+    DHCP_TRACE_SCOPE(DHCP_TRACE_BUILD);
     DHCP_MESSAGE reply;
+    memset(&reply, 0, sizeof(reply));
     reply.op = DHCP_BOOTREPLY;
     reply.htype = DHCP_ETHERNET;
     reply.hlen = DHCP_MAC_ADDRESS_LENGTH;
@@ -223,80 +1035,638 @@ DHCP_MESSAGE DHCP_SERVER::createDHCPReply(uint8_t message_type, IPAddress client
     reply.xid = xid;
     reply.secs = 0;
     reply.flags = DHCP_BROADCAST_FLAG;
-    reply.ciaddr[0] = 0;
-    reply.ciaddr[1] = 0;
-    reply.ciaddr[2] = 0;
-    reply.ciaddr[3] = 0;
+    for (int i = 0; i < 4; i++) {
+        reply.siaddr[i] = SERVER_ADDRESS[i];
+    }
+    uint16_t opt_index = 0;
+    uint8_t server_id[4] = {SERVER_ADDRESS[0], SERVER_ADDRESS[1], SERVER_ADDRESS[2], SERVER_ADDRESS[3]};
+    opt_index = addDHCPOption(reply.options, opt_index, DHCP_MESSAGE_TYPE, 1, &message_type);
+    opt_index = addDHCPOption(reply.options, opt_index, DHCP_SERVER_IDENTIFIER, 4, server_id);
     switch (message_type) {
     case DHCP_OFFER:
+    case DHCP_ACK: {
+        for (int i = 0; i < 4; i++) {
+            reply.yiaddr[i] = client_ip[i];
+        }
+        uint8_t lease_time[4] = {(uint8_t)(_lease_time >> 24), (uint8_t)(_lease_time >> 16),
+                                 (uint8_t)(_lease_time >> 8), (uint8_t)_lease_time};
+        opt_index = addDHCPOption(reply.options, opt_index, DHCP_IP_LEASE_TIME, 4, lease_time);
+        opt_index = addDHCPOption(reply.options, opt_index, DHCP_SUBNET_MASK, 4, _config->subnet_mask);
+        if (readUInt32(_config->router) != 0) {
+            opt_index = addDHCPOption(reply.options, opt_index, DHCP_ROUTER, 4, _config->router);
+        }
+        if (readUInt32(_config->dns_server) != 0) {
+            opt_index = addDHCPOption(reply.options, opt_index, DHCP_DNS_NAME_SERVER, 4, _config->dns_server);
+        }
         break;
-    case DHCP_ACK:
-    
-        break;
+    }
     case DHCP_NAK:
         break;
     default:
         break;
     }
+    reply.options[opt_index] = DHCP_END;
     return reply;
 }
 
-// DHCP Server Check for Requests
+// DHCP Server Check for Requests, for use from loop() when the server does not run inside an event loop
 uint8_t DHCP_SERVER::checkForRequests() {
-    uint16_t packet_size = DHCP_SOCKET.parsePacket();
-    uint8_t packet_buffer[DHCP_MESSAGE_SIZE];
-    if (packet_size > 0) {
-        DHCP_MESSAGE *request, reply;
-        DHCP_SOCKET.read((unsigned char *)&packet_buffer, DHCP_MESSAGE_SIZE);
-        if (_verbose) printRawUDPPayload(packet_buffer, packet_size);
-        request = (DHCP_MESSAGE*)packet_buffer;
-        if (_verbose) printDHCPMessage(*request);
-        reply = parseDHCPRequest(*request);
-        if (_verbose) printDHCPMessage(reply);
-        DHCP_SOCKET.beginPacket(DHCP_BROADCAST, DHCP_CLIENT_PORT);
-        DHCP_SOCKET.write((uint8_t *)&reply, sizeof(reply));
-        DHCP_SOCKET.endPacket();
-        delete request;
+    uint8_t handled = handleReadable();
+    handleTimers();
+    return handled;
+}
+
+// Socket the server receives on, event loops watch it and call handleReadable() when it has data
+EthernetUDP *DHCP_SERVER::getSocket() {
+    return &DHCP_SOCKET;
+}
+
+// Run the timers that are due now
+void DHCP_SERVER::handleTimers() {
+    handleTimers(_clock());
+}
+
+// Run the timers that are due at now, expired leases are returned to the pool
+void DHCP_SERVER::handleTimers(unsigned long now) {
+    freeRetiredConfig();                        // Nothing from before the last reload is still in use by now
+    // Serve one scheduling round of queued requests, the socket may have nothing new to wake the event loop
+    if (_queue_depth > 0) {
+        int served = DHCP_PRIORITY_ROUND;
+        uint8_t *request;
+        uint16_t request_size;
+        while (served-- > 0 && (request = dequeueRequest(request_size)) != NULL) handleRequest(request, request_size);
+    }
+    handleConflictProbes(now);
+    expireOffers(now);
+    handleFailover(now);
+    // Other leases are still found by walking the pool, O(range) per call. They last the lease time rather than the
+    // offer hold time, so there are far fewer of them to expire than offers
+    for (int i = 0; i < address_pool.range; i++) {
+        if (_leases[i].status == DHCP_LEASE_FREE || _leases[i].status == DHCP_LEASE_PROBING) continue;
+        if (_leases[i].status == DHCP_LEASE_OFFERED) continue;      // Left to expireOffers()
+        if ((long)(now - _leases[i].expires) >= 0) {
+            releaseAddress(IPAddress(address_pool.firstOctet, address_pool.secondOctet, address_pool.thirdOctet, i + 2));
+        }
     }
 }
 
-// Print a DHCP Message
-void DHCP_SERVER::printDHCPMessage(DHCP_MESSAGE message) {
-    Serial.println(F("DHCP Message"));
-    Serial.print(F("    op: "));
-    switch (message.op) {
-    case DHCP_BOOTREQUEST:
-        Serial.print(F("BOOTREQUEST"));
-        break;
-    case DHCP_BOOTREPLY:
-        Serial.print(F("BOOTREPLY"));
-        break;
-    default:
-        break;
+// Set the time source in ms, a simulator hands in a virtual clock. NULL restores millis()
+void DHCP_SERVER::setClock(DHCP_CLOCK clock) {
+    _clock = clock == NULL ? millis : clock;
+}
+
+// Find when handleTimers() next has work to do, an event loop can sleep until then
+bool DHCP_SERVER::nextTimerDeadline(unsigned long &deadline) {
+    bool pending = false;
+    unsigned long now = _clock();
+    for (int i = 0; i < address_pool.range; i++) {
+        if (_leases[i].status == DHCP_LEASE_FREE) continue;
+        if (!pending || (long)(_leases[i].expires - now) < (long)(deadline - now)) deadline = _leases[i].expires;
+        pending = true;
     }
-    Serial.println();
-    Serial.print(F("    htype: "));
-    switch (message.htype) {
-    case DHCP_ETHERNET:
-        Serial.print(F("Ethernet (10Mb)"));
-        break;
-    case DHCP_IEEE_802:
-        Serial.print(F("IEEE 802 Network"));
-        break;
-    case DHCP_ARCNET:
-        Serial.print(F("ARCNET"));
-        break;
-    case DHCP_LOCAL_TALK:
-        Serial.print(F("LocalTalk"));
-        break;
-    case DHCP_LOCAL_NET:
-        Serial.print(F("LocalNet"));
-        break;
-    case DHCP_SMDS:
-        Serial.print(F("SMDS"));
-        break;
-    case DHCP_FRAME_RELAY:
-        Serial.print(F("Frame Relay"));
+    if (_failover_role != DHCP_FAILOVER_DISABLED) {
+        unsigned long failover_deadline = _failover_last_sent + DHCP_FAILOVER_INTERVAL;
+        if (!pending || (long)(failover_deadline - now) < (long)(deadline - now)) deadline = failover_deadline;
+        pending = true;
+    }
+    // Requests still queued are served by handleTimers()
+    for (int i = 0; i < DHCP_PRIORITY_CLASSES; i++) {
+        if (_queue_count[i] == 0) continue;
+        deadline = now;
+        pending = true;
+    }
+    return pending;
+}
+
+// Replicate leases with a peer, the primary allocates from the lower half of the pool and the standby from the upper
+// half so both can answer during a partition, the standby only answers while the primary is not heard from
+void DHCP_SERVER::enableFailover(IPAddress peer, uint8_t role) {
+    enableFailover(peer, role, DHCP_FAILOVER_PORT, DHCP_FAILOVER_PORT);
+}
+
+// Replicate leases with a peer over the given ports, two servers on one host listen on different ports
+void DHCP_SERVER::enableFailover(IPAddress peer, uint8_t role, uint16_t local_port, uint16_t peer_port) {
+    if (_failover_role != DHCP_FAILOVER_DISABLED) FAILOVER_SOCKET.stop();
+    FAILOVER_PEER = peer;
+    _failover_port = local_port;
+    _failover_peer_port = peer_port;
+    _failover_role = role;
+    resetScope();
+    _failover_session = (uint32_t)random(2147483647) ^ micros();
+    _failover_peer_session = 0;
+    _failover_seq = 0;
+    _failover_acked = 0;
+    _failover_sent = 0;
+    _failover_received = 0;
+    _failover_bulk_next = 0;
+    _failover_ack_pending = true;               // Announce ourselves to the peer straight away
+    _failover_last_heard = _clock() - DHCP_FAILOVER_TIMEOUT;
+    _failover_last_sent = _clock() - DHCP_FAILOVER_INTERVAL;
+    if (role != DHCP_FAILOVER_DISABLED) FAILOVER_SOCKET.begin(_failover_port);
+}
+
+// Listen for requests on another port, a failover pair on one host cannot both hold DHCP_SERVER_PORT
+void DHCP_SERVER::setServerPort(uint16_t port) {
+    DHCP_SOCKET.stop();
+    DHCP_SOCKET.begin(port);
+}
+
+// Set the part of the pool this server allocates from, the whole pool unless failover splits it with the peer
+void DHCP_SERVER::resetScope() {
+    uint8_t half = address_pool.range / 2;
+    _scope_start = 0;
+    _scope_end = address_pool.range;
+    if (_failover_role == DHCP_FAILOVER_PRIMARY) _scope_end = half;
+    if (_failover_role == DHCP_FAILOVER_STANDBY) _scope_start = half;
+}
+
+// Check if this server answers clients, a standby stays silent while its primary is up
+bool DHCP_SERVER::isServing() {
+    if (_failover_role != DHCP_FAILOVER_STANDBY) return true;
+    return (long)(_clock() - _failover_last_heard) >= (long)DHCP_FAILOVER_TIMEOUT;
+}
+
+// Record a lease change in the failover log, the oldest change is overwritten once the log is full
+void DHCP_SERVER::logLeaseChange(uint8_t op, uint8_t index) {
+    if (_failover_role == DHCP_FAILOVER_DISABLED) return;
+    _failover_seq++;
+    DHCP_FAILOVER_RECORD *record = &_failover_log[_failover_seq % DHCP_FAILOVER_LOG_SIZE];
+    record->seq = _failover_seq;
+    record->op = op;
+    record->index = index;
+    record->client_key = _leases[index].mac_crc;
+    record->expires = _leases[index].expires;
+}
+
+// Apply a lease change received from the failover peer
+void DHCP_SERVER::applyLeaseChange(uint8_t op, uint8_t index, uint32_t client_key, uint32_t remaining, unsigned long now) {
+    if (index >= address_pool.range) return;
+    if (op == DHCP_FAILOVER_ASSIGN) {
+        _addresses[index] = false;
+        _leases[index].status = DHCP_LEASE_BOUND;
+        _leases[index].expires = now + remaining * 1000UL;
+        _leases[index].mac_crc = client_key;
+    } else if (op == DHCP_FAILOVER_RELEASE && _leases[index].status == DHCP_LEASE_BOUND) {
+        _addresses[index] = true;
+        _leases[index].status = DHCP_LEASE_FREE;
+    }
+}
+
+// Build the next failover packet into buffer, cursor starts at 0 and is advanced over the changes written.
+// The first packet is always built so it can carry the acknowledgement and heartbeat, 0 means nothing is left
+uint16_t DHCP_SERVER::createFailoverPacket(uint8_t *buffer, uint16_t &cursor, unsigned long now) {
+    uint8_t type = DHCP_FAILOVER_UPDATE;
+    uint8_t count = 0;
+    uint16_t offset = DHCP_FAILOVER_HEADER_SIZE;
+    if (_failover_seq - _failover_acked > DHCP_FAILOVER_LOG_SIZE) {
+        // The changes the peer is missing have left the log, send the whole lease table instead
+        type = DHCP_FAILOVER_BULK;
+        if (cursor >= address_pool.range) return 0;
+        while (cursor < address_pool.range && count < DHCP_FAILOVER_BATCH) {
+            DHCP_LEASE *lease = &_leases[cursor];
+            bool bound = lease->status == DHCP_LEASE_BOUND;
+            writeUInt32(&buffer[offset], _failover_seq);
+            buffer[offset + 4] = bound ? DHCP_FAILOVER_ASSIGN : DHCP_FAILOVER_RELEASE;
+            buffer[offset + 5] = cursor;
+            writeUInt32(&buffer[offset + 6], lease->mac_crc);
+            writeUInt32(&buffer[offset + 10], (bound && (long)(lease->expires - now) > 0) ? (lease->expires - now) / 1000UL : 0);
+            offset += DHCP_FAILOVER_RECORD_SIZE;
+            cursor++;
+            count++;
+        }
+    } else {
+        uint32_t seq = _failover_acked + 1 + cursor;
+        if (cursor > 0 && seq > _failover_seq) return 0;
+        while (seq <= _failover_seq && count < DHCP_FAILOVER_BATCH) {
+            DHCP_FAILOVER_RECORD *record = &_failover_log[seq % DHCP_FAILOVER_LOG_SIZE];
+            bool live = record->op == DHCP_FAILOVER_ASSIGN && (long)(record->expires - now) > 0;
+            writeUInt32(&buffer[offset], record->seq);
+            buffer[offset + 4] = record->op;
+            buffer[offset + 5] = record->index;
+            writeUInt32(&buffer[offset + 6], record->client_key);
+            writeUInt32(&buffer[offset + 10], live ? (record->expires - now) / 1000UL : 0);
+            offset += DHCP_FAILOVER_RECORD_SIZE;
+            seq++;
+            cursor++;
+            count++;
+        }
+        if (count == 0) cursor = 0xFFFF;        // Only the acknowledgement and heartbeat to send
+    }
+    writeUInt32(buffer, DHCP_FAILOVER_MAGIC);
+    buffer[4] = type;
+    buffer[5] = count;
+    writeUInt32(&buffer[6], _failover_session);
+    writeUInt32(&buffer[10], _failover_received);
+    return offset;
+}
+
+// Apply a failover packet received from the peer
+void DHCP_SERVER::parseFailoverPacket(uint8_t *buffer, uint16_t length, unsigned long now) {
+    if (length < DHCP_FAILOVER_HEADER_SIZE) return;
+    if (readUInt32(buffer) != DHCP_FAILOVER_MAGIC) return;
+    uint8_t type = buffer[4];
+    uint8_t count = buffer[5];
+    if (length < DHCP_FAILOVER_HEADER_SIZE + count * DHCP_FAILOVER_RECORD_SIZE) return;
+    uint32_t session = readUInt32(&buffer[6]);
+    uint32_t ack = readUInt32(&buffer[10]);
+    if (session != _failover_peer_session) {
+        // The peer restarted, its sequence numbers start over
+        _failover_peer_session = session;
+        _failover_received = 0;
+        _failover_bulk_next = 0;
+    }
+    // An acknowledgement that goes backwards means the peer lost its state and needs it resent
+    if (ack <= _failover_seq) _failover_acked = ack;
+    _failover_last_heard = now;
+    uint16_t offset = DHCP_FAILOVER_HEADER_SIZE;
+    for (int i = 0; i < count; i++, offset += DHCP_FAILOVER_RECORD_SIZE) {
+        uint32_t seq = readUInt32(&buffer[offset]);
+        uint8_t op = buffer[offset + 4];
+        uint8_t index = buffer[offset + 5];
+        uint32_t client_key = readUInt32(&buffer[offset + 6]);
+        uint32_t remaining = readUInt32(&buffer[offset + 10]);
+        if (type == DHCP_FAILOVER_UPDATE) {
+            if (seq != _failover_received + 1) continue;    // Duplicate or gap, the peer resends from our acknowledgement
+            applyLeaseChange(op, index, client_key, remaining, now);
+            _failover_received = seq;
+        } else if (type == DHCP_FAILOVER_BULK) {
+            if (index == 0) _failover_bulk_next = 0;
+            if (index != _failover_bulk_next) break;        // Lost a slice, wait for the next full resend
+            // Addresses this server allocates from are its own to release
+            if (op == DHCP_FAILOVER_ASSIGN || index < _scope_start || index >= _scope_end) {
+                applyLeaseChange(op, index, client_key, remaining, now);
+            }
+            _failover_bulk_next = index + 1;
+            if (_failover_bulk_next >= address_pool.range) {
+                _failover_received = seq;
+                _failover_bulk_next = 0;
+            }
+        }
+    }
+    if (count > 0) _failover_ack_pending = true;
+}
+
+// Receive lease changes from the peer and send ours, batches go out every DHCP_FAILOVER_INTERVAL, as soon as a
+// full batch is waiting, or when the peer is owed an acknowledgement. Unacknowledged changes are resent each time
+void DHCP_SERVER::handleFailover(unsigned long now) {
+    if (_failover_role == DHCP_FAILOVER_DISABLED) return;
+    uint8_t buffer[DHCP_FAILOVER_PACKET_SIZE];
+    while (FAILOVER_SOCKET.parsePacket() > 0) {
+        uint16_t length = FAILOVER_SOCKET.read(buffer, sizeof(buffer));
+        if (FAILOVER_SOCKET.remoteIP() != FAILOVER_PEER) continue;
+        parseFailoverPacket(buffer, length, now);
+    }
+    bool due = (long)(now - _failover_last_sent) >= (long)DHCP_FAILOVER_INTERVAL;
+    if (!due && !_failover_ack_pending && _failover_seq - _failover_sent < DHCP_FAILOVER_BATCH) return;
+    uint16_t cursor = 0, length;
+    while ((length = createFailoverPacket(buffer, cursor, now)) > 0) {
+        FAILOVER_SOCKET.beginPacket(FAILOVER_PEER, _failover_peer_port);
+        FAILOVER_SOCKET.write(buffer, length);
+        FAILOVER_SOCKET.endPacket();
+    }
+    _failover_sent = _failover_seq;
+    _failover_last_sent = now;
+    _failover_ack_pending = false;
+}
+
+// Take a lease snapshot for admin tooling. Only the copy is read while iterating or exporting, so exports can be
+// written in slices with handleReadable() called in between and requests never wait on a large dump
+uint16_t DHCP_SERVER::snapshotLeases() {
+    if (_snapshot_size < address_pool.range) {
+        delete [] _snapshot;
+        _snapshot = new DHCP_LEASE_INFO[address_pool.range];
+        _snapshot_size = address_pool.range;
+    }
+    unsigned long now = _clock();
+    _snapshot_count = 0;
+    for (int i = 0; i < address_pool.range; i++) {
+        if (_leases[i].status == DHCP_LEASE_FREE) continue;
+        DHCP_LEASE_INFO *info = &_snapshot[_snapshot_count++];
+        IPAddress address = getPoolAddress(i);
+        for (int j = 0; j < 4; j++) {
+            info->address[j] = address[j];
+        }
+        info->status = _leases[i].status;
+        info->remaining = (long)(_leases[i].expires - now) > 0 ? (_leases[i].expires - now) / 1000UL : 0;
+        info->client_key = _leases[i].mac_crc;
+    }
+    _snapshot_epoch++;
+    return _snapshot_count;
+}
+
+// Get the number of the current snapshot
+uint32_t DHCP_SERVER::getSnapshotEpoch() {
+    return _snapshot_epoch;
+}
+
+// Get the lease at an index in the snapshot, false once the index is past the end
+bool DHCP_SERVER::getSnapshotLease(uint16_t index, DHCP_LEASE_INFO &info) {
+    if (index >= _snapshot_count) return false;
+    info = _snapshot[index];
+    return true;
+}
+
+// Write the whole snapshot as JSON
+size_t DHCP_SERVER::exportLeasesJSON(Print &out) {
+    return exportLeasesJSON(out, 0, _snapshot_count);
+}
+
+// Write a slice of the snapshot as JSON, consecutive slices concatenate into a single document
+size_t DHCP_SERVER::exportLeasesJSON(Print &out, uint16_t start, uint16_t count) {
+    size_t written = 0;
+    if (start == 0) {
+        written += out.print(F("{\"epoch\":"));
+        written += out.print(_snapshot_epoch);
+        written += out.print(F(",\"leases\":["));
+    }
+    for (uint16_t i = start; i < _snapshot_count && i - start < count; i++) {
+        DHCP_LEASE_INFO *info = &_snapshot[i];
+        if (i > 0) written += out.print(F(","));
+        written += out.print(F("{\"address\":\""));
+        for (int j = 0; j < 4; j++) {
+            if (j > 0) written += out.print(F("."));
+            written += out.print(info->address[j]);
+        }
+        written += out.print(F("\",\"state\":\""));
+        switch (info->status) {
+        case DHCP_LEASE_BOUND:
+            written += out.print(F("bound"));
+            break;
+        case DHCP_LEASE_PROBING:
+            written += out.print(F("probing"));
+            break;
+        case DHCP_LEASE_QUARANTINED:
+            written += out.print(F("quarantined"));
+            break;
+        case DHCP_LEASE_OFFERED:
+            written += out.print(F("offered"));
+            break;
+        default:
+            written += out.print(F("unknown"));
+            break;
+        }
+        written += out.print(F("\",\"remaining\":"));
+        written += out.print(info->remaining);
+        written += out.print(F(",\"client\":"));
+        written += out.print(info->client_key);
+        written += out.print(F("}"));
+    }
+    if (start + count >= _snapshot_count) written += out.print(F("]}"));
+    return written;
+}
+
+// Write the whole snapshot in binary
+size_t DHCP_SERVER::exportLeasesBinary(Print &out) {
+    return exportLeasesBinary(out, 0, _snapshot_count);
+}
+
+// Write a slice of the snapshot in binary, the header goes with the first slice and all values are in network order
+size_t DHCP_SERVER::exportLeasesBinary(Print &out, uint16_t start, uint16_t count) {
+    size_t written = 0;
+    uint8_t buffer[DHCP_EXPORT_HEADER_SIZE];
+    if (start == 0) {
+        writeUInt32(buffer, DHCP_EXPORT_MAGIC);
+        writeUInt32(&buffer[4], _snapshot_epoch);
+        buffer[8] = (uint8_t)(_snapshot_count >> 8);
+        buffer[9] = (uint8_t)_snapshot_count;
+        written += out.write(buffer, DHCP_EXPORT_HEADER_SIZE);
+    }
+    for (uint16_t i = start; i < _snapshot_count && i - start < count; i++) {
+        uint8_t record[DHCP_EXPORT_RECORD_SIZE];
+        memcpy(record, _snapshot[i].address, 4);
+        record[4] = _snapshot[i].status;
+        writeUInt32(&record[5], _snapshot[i].remaining);
+        writeUInt32(&record[9], _snapshot[i].client_key);
+        written += out.write(record, DHCP_EXPORT_RECORD_SIZE);
+    }
+    return written;
+}
+
+// Handle pending requests, returns how many were handled. Without priority scheduling that is the one packet read.
+// With it, up to a scheduling round of packets is sorted into the queues and one request is served for each packet
+// read, so the socket is never drained faster than it is answered and a flood is dropped by the full queues
+uint8_t DHCP_SERVER::handleReadable() {
+    uint8_t packet_buffer[sizeof(DHCP_MESSAGE)];
+    if (_queue_depth == 0) {
+        uint16_t packet_size = receivePacket(packet_buffer);
+        if (packet_size == 0) return 0;
+        if (isValidRequest(packet_buffer, packet_size)) handleRequest(packet_buffer, packet_size);
+        return 1;
+    }
+    uint8_t read = 0;
+    while (read < DHCP_PRIORITY_ROUND) {
+        uint16_t packet_size = receivePacket(packet_buffer);
+        if (packet_size == 0) break;
+        read++;
+        if (isValidRequest(packet_buffer, packet_size)) enqueueRequest(packet_buffer, packet_size);
+    }
+    uint8_t handled = 0;
+    uint16_t request_size;
+    uint8_t *request;
+    while (handled < read && (request = dequeueRequest(request_size)) != NULL) {
+        handleRequest(request, request_size);
+        handled++;
+    }
+    return handled;
+}
+
+// Read a pending packet into buffer, which must hold a DHCP_MESSAGE, returns its size or 0 if there was none.
+// The trace message type is set here so the receive stage is put down to the packet just read, isValidRequest()
+// and handleRequest() set it again from the buffer they are given
+uint16_t DHCP_SERVER::receivePacket(uint8_t *packet_buffer) {
+    DHCP_TRACE_MESSAGE_TYPE(0);
+    DHCP_TRACE_SCOPE(DHCP_TRACE_RECEIVE);
+    uint16_t packet_size = DHCP_SOCKET.parsePacket();
+    if (packet_size == 0) return 0;
+    memset(packet_buffer, 0, sizeof(DHCP_MESSAGE));
+    DHCP_SOCKET.read(packet_buffer, sizeof(DHCP_MESSAGE));
+    DHCP_TRACE_MESSAGE_TYPE(getDHCPMessageType((DHCP_MESSAGE *)packet_buffer));
+    return packet_size;
+}
+
+// Check the fixed header of a raw request, anything too short, not from a client or without the magic cookie is dropped
+bool DHCP_SERVER::isValidRequest(uint8_t *packet_buffer, uint16_t packet_size) {
+    DHCP_TRACE_MESSAGE_TYPE(getDHCPMessageType((DHCP_MESSAGE *)packet_buffer));
+    DHCP_TRACE_SCOPE(DHCP_TRACE_VALIDATE);
+    if (packet_size < DHCP_HEADER_SIZE) return false;
+    if (packet_buffer[0] != DHCP_BOOTREQUEST) return false;
+    return readUInt32(&packet_buffer[DHCP_HEADER_SIZE - 4]) == DHCP_MAGIC_COOKIE;
+}
+
+// Parse a raw request and send the reply, the request buffer is reused for the outgoing packet
+void DHCP_SERVER::handleRequest(uint8_t *packet_buffer, uint16_t packet_size) {
+    DHCP_MESSAGE *request, reply;
+    DHCP_TRACE_MESSAGE_TYPE(getDHCPMessageType((DHCP_MESSAGE *)packet_buffer));
+    if (_verbose) printRawUDPPayload(packet_buffer, packet_size);
+    request = (DHCP_MESSAGE*)packet_buffer;
+    readDHCPHeader(request);
+    if (_verbose) printDHCPMessage(*request);
+    reply = parseDHCPRequest(*request);
+    if (reply.op != DHCP_BOOTREPLY) return;
+    if (_verbose) printDHCPMessage(reply);
+    sendDHCPReply(&reply, packet_buffer, _max_message_size);
+}
+
+// Queue requests by message type so REQUESTs that finish bindings are not stuck behind a flood of DISCOVERs.
+// Each class gets depth slots of a full message and its size, so this costs 3 * depth * (sizeof(DHCP_MESSAGE) + 2) bytes.
+// Depths over DHCP_PRIORITY_MAX_DEPTH are refused so the size of a queue cannot overflow a 16 bit size_t
+bool DHCP_SERVER::enablePriorityScheduling(uint8_t depth) {
+    if (depth > DHCP_PRIORITY_MAX_DEPTH) return false;
+    freeQueues();
+    if (depth == 0) return true;
+    for (int i = 0; i < DHCP_PRIORITY_CLASSES; i++) {
+        _queues[i] = new uint8_t[(size_t)depth * sizeof(DHCP_MESSAGE)];
+        _queue_sizes[i] = new uint16_t[depth];
+        if (_queues[i] == NULL || _queue_sizes[i] == NULL) {
+            freeQueues();
+            return false;
+        }
+    }
+    _queue_credit[DHCP_PRIORITY_REQUEST] = DHCP_PRIORITY_WEIGHT_REQUEST;
+    _queue_credit[DHCP_PRIORITY_INFORM] = DHCP_PRIORITY_WEIGHT_INFORM;
+    _queue_credit[DHCP_PRIORITY_DISCOVER] = DHCP_PRIORITY_WEIGHT_DISCOVER;
+    _queue_depth = depth;
+    return true;
+}
+
+// Free the priority queues, anything still queued is dropped
+void DHCP_SERVER::freeQueues() {
+    for (int i = 0; i < DHCP_PRIORITY_CLASSES; i++) {
+        delete [] _queues[i];
+        delete [] _queue_sizes[i];
+        _queues[i] = NULL;
+        _queue_sizes[i] = NULL;
+        _queue_head[i] = 0;
+        _queue_count[i] = 0;
+    }
+    _queue_depth = 0;
+}
+
+// Get the priority class of a raw request from its message type alone
+uint8_t DHCP_SERVER::classifyRequest(uint8_t *packet) {
+    switch (getDHCPMessageType((DHCP_MESSAGE *)packet)) {
+    case DHCP_REQUEST:
+    case DHCP_DECLINE:
+    case DHCP_RELEASE:
+        return DHCP_PRIORITY_REQUEST;
+    case DHCP_INFORM:
+        return DHCP_PRIORITY_INFORM;
+    default:
+        return DHCP_PRIORITY_DISCOVER;
+    }
+}
+
+// Copy a raw request into the queue for its class, it is dropped and counted if the queue is full. Only a
+// DHCP_MESSAGE worth is kept, so the size is capped to that
+bool DHCP_SERVER::enqueueRequest(uint8_t *packet, uint16_t packet_size) {
+    uint8_t priority = classifyRequest(packet);
+    if (_queue_count[priority] == _queue_depth) {
+        _queue_drops[priority]++;
+        return false;
+    }
+    uint8_t slot = (_queue_head[priority] + _queue_count[priority]) % _queue_depth;
+    memcpy(&_queues[priority][(size_t)slot * sizeof(DHCP_MESSAGE)], packet, sizeof(DHCP_MESSAGE));
+    _queue_sizes[priority][slot] = packet_size < sizeof(DHCP_MESSAGE) ? packet_size : sizeof(DHCP_MESSAGE);
+    _queue_count[priority]++;
+    return true;
+}
+
+// Take the next request in weighted round robin order, higher classes go first while they have credit and
+// DISCOVERs still get a turn every round. The buffer stays valid until the next enqueueRequest()
+uint8_t *DHCP_SERVER::dequeueRequest(uint16_t &packet_size) {
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < DHCP_PRIORITY_CLASSES; i++) {
+            if (_queue_count[i] == 0 || _queue_credit[i] == 0) continue;
+            uint8_t *packet = &_queues[i][(size_t)_queue_head[i] * sizeof(DHCP_MESSAGE)];
+            packet_size = _queue_sizes[i][_queue_head[i]];
+            _queue_head[i] = (_queue_head[i] + 1) % _queue_depth;
+            _queue_count[i]--;
+            _queue_credit[i]--;
+            return packet;
+        }
+        _queue_credit[DHCP_PRIORITY_REQUEST] = DHCP_PRIORITY_WEIGHT_REQUEST;
+        _queue_credit[DHCP_PRIORITY_INFORM] = DHCP_PRIORITY_WEIGHT_INFORM;
+        _queue_credit[DHCP_PRIORITY_DISCOVER] = DHCP_PRIORITY_WEIGHT_DISCOVER;
+    }
+    return NULL;
+}
+
+// Get the number of packets waiting in a priority class
+uint8_t DHCP_SERVER::getQueueDepth(uint8_t priority) {
+    if (priority >= DHCP_PRIORITY_CLASSES) return 0;
+    return _queue_count[priority];
+}
+
+// Get the number of packets dropped from a priority class because its queue was full
+uint32_t DHCP_SERVER::getDropCount(uint8_t priority) {
+    if (priority >= DHCP_PRIORITY_CLASSES) return 0;
+    return _queue_drops[priority];
+}
+
+// Serialize a reply into buffer, which must hold a DHCP_MESSAGE, and send it
+void DHCP_SERVER::sendDHCPReply(DHCP_MESSAGE *reply, uint8_t *buffer, uint16_t max_message_size) {
+    DHCP_TRACE_SCOPE(DHCP_TRACE_SEND);
+    uint16_t max_size = max_message_size - DHCP_IP_UDP_HEADER_SIZE;
+    if (max_size > sizeof(DHCP_MESSAGE)) max_size = sizeof(DHCP_MESSAGE);
+    uint16_t reply_size = serializeDHCPMessage(reply, buffer, max_size);
+    uint16_t port;
+    IPAddress destination = getReplyDestination(reply, port);
+    DHCP_SOCKET.beginPacket(destination, port);
+    DHCP_SOCKET.write(buffer, reply_size);
+    DHCP_SOCKET.endPacket();
+}
+
+// Get where a reply goes: back through the relay agent if there is one, straight to a client that already has an
+// address in ciaddr, and broadcast otherwise
+IPAddress DHCP_SERVER::getReplyDestination(DHCP_MESSAGE *reply, uint16_t &port) {
+    if (readUInt32(reply->giaddr) != 0) {
+        port = DHCP_SERVER_PORT;
+        return IPAddress(reply->giaddr[0], reply->giaddr[1], reply->giaddr[2], reply->giaddr[3]);
+    }
+    port = DHCP_CLIENT_PORT;
+    if (readUInt32(reply->ciaddr) != 0) {
+        return IPAddress(reply->ciaddr[0], reply->ciaddr[1], reply->ciaddr[2], reply->ciaddr[3]);
+    }
+    return DHCP_BROADCAST;
+}
+
+// Print a DHCP Message
+void DHCP_SERVER::printDHCPMessage(DHCP_MESSAGE message) {
+    Serial.println(F("DHCP Message"));
+    Serial.print(F("    op: "));
+    switch (message.op) {
+    case DHCP_BOOTREQUEST:
+        Serial.print(F("BOOTREQUEST"));
+        break;
+    case DHCP_BOOTREPLY:
+        Serial.print(F("BOOTREPLY"));
+        break;
+    default:
+        break;
+    }
+    Serial.println();
+    Serial.print(F("    htype: "));
+    switch (message.htype) {
+    case DHCP_ETHERNET:
+        Serial.print(F("Ethernet (10Mb)"));
+        break;
+    case DHCP_IEEE_802:
+        Serial.print(F("IEEE 802 Network"));
+        break;
+    case DHCP_ARCNET:
+        Serial.print(F("ARCNET"));
+        break;
+    case DHCP_LOCAL_TALK:
+        Serial.print(F("LocalTalk"));
+        break;
+    case DHCP_LOCAL_NET:
+        Serial.print(F("LocalNet"));
+        break;
+    case DHCP_SMDS:
+        Serial.print(F("SMDS"));
+        break;
+    case DHCP_FRAME_RELAY:
+        Serial.print(F("Frame Relay"));
         break;
     case DHCP_ATM_A:
         Serial.print(F("Asynchronous Transfer Mode(ATM)"));
@@ -439,136 +1809,1111 @@ void DHCP_SERVER::printRawUDPPayload(uint8_t *packet_buffer, uint16_t packet_siz
     Serial.println();
 }
 
-// ********** DHCP CLIENT **********
-// TODO: Fully Implement this class
+// ********** DHCP TRACE **********
 
-DHCP_CLIENT::DHCP_CLIENT(uint8_t chaddr[], uint8_t hlen) {
-    for (int i = 0; i < 16; i++) {
-        if (i < hlen) {
-            H_ADDRESS[i] = chaddr[i];
-        } else {
-            H_ADDRESS[i] = 0;
-        }
-    }
+#ifdef SIMPLE_DHCP_TRACE
+// Stage names as they appear in the trace
+static const char *dhcp_trace_stage_names[DHCP_TRACE_STAGES] = {
+    "receive", "validate", "parse", "lookup", "allocate", "build", "send"
+};
+
+DHCP_TRACE_WRITER *DHCP_TRACE_WRITER::active = NULL;
+uint8_t DHCP_TRACE_SPAN::open = 0;
+
+// DHCP_TRACE_WRITER Constructor
+DHCP_TRACE_WRITER::DHCP_TRACE_WRITER(Print &out) {
+    _out = &out;
+    _count = 0;
+    _first = true;
+    _message_type = 0;
+    _dropped = 0;
 }
 
-DHCP_CLIENT::~DHCP_CLIENT() {
-    ;
+// Open the JSON array and make this the writer spans report to
+void DHCP_TRACE_WRITER::begin() {
+    _out->print(F("["));
+    _count = 0;
+    _first = true;
+    _dropped = 0;
+    active = this;
 }
 
-DHCP_MESSAGE DHCP_CLIENT::createDHCPMessage(uint8_t message_type, uint32_t xid) {
-    DHCP_MESSAGE message;
-    message.op = DHCP_BOOTREQUEST;
-    message.htype = DHCP_ETHERNET;
-    message.hlen = DHCP_MAC_ADDRESS_LENGTH;
-    message.hops = 0;
-    message.xid = xid;
-    message.secs = 0;
-    message.flags = DHCP_BROADCAST_FLAG;
-    for (int i = 0; i < 4; i++) {
-        message.ciaddr[i] = 0;
-        message.yiaddr[i] = 0;
-        message.siaddr[i] = 0;
-        message.giaddr[i] = 0;
-    }
-    for (int i = 0; i < 16; i++) {
-        message.chaddr[i] = 0;
+// Stop collecting, write out what is buffered and close the JSON array
+void DHCP_TRACE_WRITER::end() {
+    if (active == this) active = NULL;
+    flush();
+    _out->println(F("]"));
+}
+
+// Write the buffered events as complete ("X") events, one process and thread per server loop
+void DHCP_TRACE_WRITER::flush() {
+    for (int i = 0; i < _count; i++) {
+        DHCP_TRACE_EVENT *event = &_events[i];
+        if (!_first) _out->print(F(","));
+        _first = false;
+        _out->print(F("{\"name\":\""));
+        _out->print(dhcp_trace_stage_names[event->stage]);
+        _out->print(F("\",\"cat\":\"dhcp\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":"));
+        _out->print(event->start);
+        _out->print(F(",\"dur\":"));
+        _out->print(event->duration);
+        _out->print(F(",\"args\":{\"message_type\":"));
+        _out->print(event->message_type);
+        _out->print(F("}}"));
     }
-    for (int i = 0; i < message.hlen; i++) {
-        message.chaddr[i] = H_ADDRESS[i];
+    _count = 0;
+}
+
+// Set the message type the events that follow belong to, so time can be broken down per message type
+void DHCP_TRACE_WRITER::setMessageType(uint8_t message_type) {
+    _message_type = message_type;
+}
+
+// Buffer an event. The buffer is only written out once the outermost span has closed, so the time spent printing
+// never lands inside a stage being measured. It is flushed at half full to leave room for the spans nested in the
+// next one, an event that still finds it full is dropped and counted
+void DHCP_TRACE_WRITER::record(uint8_t stage, unsigned long start, unsigned long duration) {
+    if (_count == DHCP_TRACE_BUFFER_SIZE && DHCP_TRACE_SPAN::open == 0) flush();
+    if (_count == DHCP_TRACE_BUFFER_SIZE) {
+        _dropped++;
+        return;
     }
-    return message;
+    _events[_count].stage = stage;
+    _events[_count].message_type = _message_type;
+    _events[_count].start = start;
+    _events[_count].duration = duration;
+    _count++;
+    if (_count >= DHCP_TRACE_BUFFER_SIZE / 2 && DHCP_TRACE_SPAN::open == 0) flush();
 }
 
-// ********** DHCP UNIT TESTER **********
-// TODO: Fully Implement this class
+// Get the number of events lost since begin() because the buffer filled while spans were open
+uint32_t DHCP_TRACE_WRITER::getDropCount() {
+    return _dropped;
+}
 
-DHCP_TESTER::DHCP_TESTER() {
-    randomSeed(1111);
-    test_xid = (uint32_t)random(2147483647);
-    test_server_ip = IPAddress(10,0,0,1);
-    test_client_ip = IPAddress(10,0,0,2);
-    uint8_t test_client_mac[] = {0x01, 0xEA, 0xFD, 0xBC, 0x05, 0x06};
-    _dhcp_server = new DHCP_SERVER(IPAddress(10, 0, 0, 1), 32);
-    _dhcp_client = new DHCP_CLIENT(test_client_mac, 6);
+// DHCP_TRACE_SPAN Constructor, starts timing
+DHCP_TRACE_SPAN::DHCP_TRACE_SPAN(uint8_t stage) {
+    _stage = stage;
+    open++;
+    _start = micros();
 }
 
-DHCP_TESTER::~DHCP_TESTER() {
-    Serial.println(F("Destroying DHCP Tester"));
-    delete _dhcp_server;
-    delete _dhcp_client;
+// DHCP_TRACE_SPAN Destructor, reports the stage once the scope is left
+DHCP_TRACE_SPAN::~DHCP_TRACE_SPAN() {
+    unsigned long duration = micros() - _start;
+    open--;
+#ifdef SIMPLE_DHCP_USDT
+    DTRACE_PROBE3(simple_dhcp, stage, _stage, _start, duration);
+#endif
+    if (DHCP_TRACE_WRITER::active != NULL) DHCP_TRACE_WRITER::active->record(_stage, _start, duration);
 }
+#endif
 
-// Handle failed tests
-bool DHCP_TESTER::testFailed() {
-    Serial.print(F("[ FAIL ]"));
-    Serial.println();
-    return false;
+// ********** DHCP EXTENT ALLOCATOR **********
+
+// DHCP_EXTENT_ALLOCATOR Constructor, the whole range starts out as a single free run
+DHCP_EXTENT_ALLOCATOR::DHCP_EXTENT_ALLOCATOR(IPAddress base, uint32_t size) {
+    _base = ((uint32_t)base[0] << 24) | ((uint32_t)base[1] << 16) | ((uint32_t)base[2] << 8) | base[3];
+    _size = size;
+    _assigned = 0;
+    _extents = new DHCP_EXTENT[DHCP_EXTENT_INITIAL_CAPACITY];
+    _extent_capacity = _extents == NULL ? 0 : DHCP_EXTENT_INITIAL_CAPACITY;
+    _extent_count = 0;
+    if (_size > 0) insertExtent(0, 0, _size);
 }
 
-// Handle successful tests
-bool DHCP_TESTER::testPassed() {
-    Serial.print(F("[  OK  ]"));
-    Serial.println();
-    return true;
+// DHCP_EXTENT_ALLOCATOR Destructor
+DHCP_EXTENT_ALLOCATOR::~DHCP_EXTENT_ALLOCATOR() {
+    delete [] _extents;
 }
 
-// Run SimpleDHCP tests
-bool DHCP_TESTER::runTests() {
-    Serial.println(F("************ Running tests ************"));
-    bool results = true;
-    if (!runServerTests()) results = false;
-    if (!runClientTests()) results = false;
-    Serial.println(F("************ Test Results *************"));
-    Serial.print(F("Final result:    "));
-    if (results) {
-        return testPassed();
-    } else {
-        return testFailed();
+// Binary search for the first run starting after an offset, the run before it is the only one that can hold it
+uint16_t DHCP_EXTENT_ALLOCATOR::findExtent(uint32_t offset) {
+    uint16_t low = 0;
+    uint16_t high = _extent_count;
+    while (low < high) {
+        uint16_t mid = low + (high - low) / 2;
+        if (_extents[mid].start <= offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
+    return low;
 }
 
-// Run DHCP Server tests
-bool DHCP_TESTER::runServerTests() {
-    Serial.println(F("********** DHCP Server Tests **********"));
-    bool results = true;
-    if (!runServerAddressManagementTests()) results = false;
-    if (!runServerMessageGenerationTests()) results = false;
-    if (!runServerParsingTests()) results = false;
-    return results;
+// Insert a run at an index, growing the array if it is full
+bool DHCP_EXTENT_ALLOCATOR::insertExtent(uint16_t index, uint32_t start, uint32_t length) {
+    if (_extent_count == _extent_capacity) {
+        if (_extent_capacity >= 0x8000) return false;
+        uint16_t capacity = _extent_capacity == 0 ? DHCP_EXTENT_INITIAL_CAPACITY : _extent_capacity * 2;
+        DHCP_EXTENT *extents = new DHCP_EXTENT[capacity];
+        if (extents == NULL) return false;
+        if (_extent_count > 0) memcpy(extents, _extents, _extent_count * sizeof(DHCP_EXTENT));
+        delete [] _extents;
+        _extents = extents;
+        _extent_capacity = capacity;
+    }
+    memmove(&_extents[index + 1], &_extents[index], (_extent_count - index) * sizeof(DHCP_EXTENT));
+    _extents[index].start = start;
+    _extents[index].length = length;
+    _extent_count++;
+    return true;
 }
 
-// Run Server address management tests
-bool DHCP_TESTER::runServerAddressManagementTests() {
-    Serial.println(F("       Address Management Tests        "));
-    bool results = true;
-    if (!testAddressInRange()) results = false;
-    if (!testAddressOutOfRange()) results = false;
-    if (!testAutoAddressAssignment()) results = false;
-    if (!testAddressRelease()) results = false;
-    if (!testAddressReassignment()) results = false;
-    return results;
+// Remove the run at an index
+void DHCP_EXTENT_ALLOCATOR::removeExtent(uint16_t index) {
+    memmove(&_extents[index], &_extents[index + 1], (_extent_count - index - 1) * sizeof(DHCP_EXTENT));
+    _extent_count--;
 }
 
-//
-bool DHCP_TESTER::testAddressInRange() {
-    Serial.print(F("In Range:        "));
-    IPAddress address = _dhcp_server->assignAddress(IPAddress(10, 0, 0, 2));
-    if (address != IPAddress(10, 0, 0, 2)) return testFailed();
-    return testPassed(); // If we reached here then all the tests passed
+// Get the offset of an address from the base, false if it is outside the range
+bool DHCP_EXTENT_ALLOCATOR::getOffset(IPAddress address, uint32_t &offset) {
+    uint32_t value = ((uint32_t)address[0] << 24) | ((uint32_t)address[1] << 16) | ((uint32_t)address[2] << 8) | address[3];
+    offset = value - _base;
+    return offset < _size;
 }
 
-//
-bool DHCP_TESTER::testAddressOutOfRange() {
-    Serial.print(F("Out of Range:    "));
-    IPAddress address = _dhcp_server->assignAddress(IPAddress(192, 168, 1, 353));
-    if (address != IPAddress(10, 0, 0, 3)) return testFailed();
-    return testPassed(); // If we reached here then all the tests passed
+// Assign an offset, the run holding it is trimmed or split in two
+bool DHCP_EXTENT_ALLOCATOR::assignOffset(uint32_t offset) {
+    uint16_t index = findExtent(offset);
+    if (index == 0) return false;
+    DHCP_EXTENT *extent = &_extents[index - 1];
+    if (offset - extent->start >= extent->length) return false;
+    if (offset == extent->start) {
+        extent->start++;
+        extent->length--;
+        if (extent->length == 0) removeExtent(index - 1);
+    } else if (offset == extent->start + extent->length - 1) {
+        extent->length--;
+    } else {
+        uint32_t tail = extent->start + extent->length - offset - 1;
+        if (!insertExtent(index, offset + 1, tail)) return false;
+        _extents[index - 1].length = offset - _extents[index - 1].start;
+    }
+    _assigned++;
+    return true;
 }
 
-//
-bool DHCP_TESTER::testAutoAddressAssignment() {
-    Serial.print(F("Auto Assign:     "));
+// Release an offset, merging it with the free runs on either side
+bool DHCP_EXTENT_ALLOCATOR::releaseOffset(uint32_t offset) {
+    if (offset >= _size) return false;
+    uint16_t index = findExtent(offset);
+    DHCP_EXTENT *before = index > 0 ? &_extents[index - 1] : NULL;
+    DHCP_EXTENT *after = index < _extent_count ? &_extents[index] : NULL;
+    if (before != NULL && offset - before->start < before->length) return false;
+    bool joins_before = before != NULL && before->start + before->length == offset;
+    bool joins_after = after != NULL && after->start == offset + 1;
+    if (joins_before && joins_after) {
+        before->length += 1 + after->length;
+        removeExtent(index);
+    } else if (joins_before) {
+        before->length++;
+    } else if (joins_after) {
+        after->start--;
+        after->length++;
+    } else if (!insertExtent(index, offset, 1)) {
+        return false;
+    }
+    _assigned--;
+    return true;
+}
+
+// Check if an offset is in the range and free
+bool DHCP_EXTENT_ALLOCATOR::isOffsetAvailable(uint32_t offset) {
+    uint16_t index = findExtent(offset);
+    if (index == 0) return false;
+    return offset - _extents[index - 1].start < _extents[index - 1].length;
+}
+
+// Get the lowest free offset
+bool DHCP_EXTENT_ALLOCATOR::getFreeOffset(uint32_t &offset) {
+    if (_extent_count == 0) return false;
+    offset = _extents[0].start;
+    return true;
+}
+
+// Get the lowest free offset at or after an offset
+bool DHCP_EXTENT_ALLOCATOR::getFreeOffset(uint32_t from, uint32_t &offset) {
+    uint16_t index = findExtent(from);
+    if (index > 0 && from - _extents[index - 1].start < _extents[index - 1].length) {
+        offset = from;
+        return true;
+    }
+    if (index == _extent_count) return false;
+    offset = _extents[index].start;
+    return true;
+}
+
+// Assign the requested address if it is free, otherwise the lowest free address, 0.0.0.0 if the range is exhausted
+IPAddress DHCP_EXTENT_ALLOCATOR::assignAddress(IPAddress requested_ip) {
+    uint32_t offset;
+    if (!getOffset(requested_ip, offset) || !isOffsetAvailable(offset)) {
+        if (!getFreeOffset(offset)) return IPAddress(0, 0, 0, 0);
+    }
+    if (!assignOffset(offset)) return IPAddress(0, 0, 0, 0);
+    uint32_t value = _base + offset;
+    return IPAddress((uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value);
+}
+
+// Release an assigned address, addresses outside the range are ignored
+void DHCP_EXTENT_ALLOCATOR::releaseAddress(IPAddress address) {
+    uint32_t offset;
+    if (getOffset(address, offset)) releaseOffset(offset);
+}
+
+// Check if an address is in the range and free
+bool DHCP_EXTENT_ALLOCATOR::isAddressAvailable(IPAddress address) {
+    uint32_t offset;
+    if (!getOffset(address, offset)) return false;
+    return isOffsetAvailable(offset);
+}
+
+// Get the lowest free address without assigning it
+IPAddress DHCP_EXTENT_ALLOCATOR::getAddressFromPool() {
+    uint32_t offset;
+    if (!getFreeOffset(offset)) return IPAddress(0, 0, 0, 0);
+    uint32_t value = _base + offset;
+    return IPAddress((uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value);
+}
+
+// Get the number of assigned addresses
+uint32_t DHCP_EXTENT_ALLOCATOR::getAssignedCount() {
+    return _assigned;
+}
+
+// Get the number of free runs, this is what the allocator's memory use follows
+uint16_t DHCP_EXTENT_ALLOCATOR::getExtentCount() {
+    return _extent_count;
+}
+
+// ********** DHCP LEASE STORES **********
+
+#ifdef SIMPLE_DHCP_EEPROM
+// DHCP_EEPROM_LEASE_STORE Constructor
+DHCP_EEPROM_LEASE_STORE::DHCP_EEPROM_LEASE_STORE() {
+    _offset = DHCP_EEPROM_LEASE_OFFSET;
+}
+
+// DHCP_EEPROM_LEASE_STORE Constructor at the given EEPROM address
+DHCP_EEPROM_LEASE_STORE::DHCP_EEPROM_LEASE_STORE(int offset) {
+    _offset = offset;
+}
+
+// Read the lease cache from EEPROM
+bool DHCP_EEPROM_LEASE_STORE::readLease(uint8_t *data, uint16_t size) {
+#if defined(ESP8266) || defined(ESP32)
+    EEPROM.begin(_offset + size);
+#endif
+    for (int i = 0; i < size; i++) {
+        data[i] = EEPROM.read(_offset + i);
+    }
+    return true;
+}
+
+// Save the lease cache to EEPROM, a renewal of the same lease writes nothing
+bool DHCP_EEPROM_LEASE_STORE::writeLease(const uint8_t *data, uint16_t size) {
+#if defined(ESP8266) || defined(ESP32)
+    EEPROM.begin(_offset + size);
+#endif
+    for (int i = 0; i < size; i++) {
+        if (EEPROM.read(_offset + i) != data[i]) EEPROM.write(_offset + i, data[i]);
+    }
+#if defined(ESP8266) || defined(ESP32)
+    return EEPROM.commit();
+#else
+    return true;
+#endif
+}
+#endif
+
+#ifdef __linux__
+// DHCP_FILE_LEASE_STORE Constructor, the path must outlive the store
+DHCP_FILE_LEASE_STORE::DHCP_FILE_LEASE_STORE(const char *path) {
+    _path = path;
+}
+
+// Read the lease cache from its file
+bool DHCP_FILE_LEASE_STORE::readLease(uint8_t *data, uint16_t size) {
+    FILE *file = fopen(_path, "rb");
+    if (file == NULL) return false;
+    size_t length = fread(data, 1, size, file);
+    fclose(file);
+    return length == size;
+}
+
+// Save the lease cache to its file
+bool DHCP_FILE_LEASE_STORE::writeLease(const uint8_t *data, uint16_t size) {
+    FILE *file = fopen(_path, "wb");
+    if (file == NULL) return false;
+    size_t length = fwrite(data, 1, size, file);
+    if (fclose(file) != 0) return false;
+    return length == size;
+}
+#endif
+
+// ********** DHCP CLIENT **********
+
+// Copy a 4 byte option value out of a message, returns false if the option is missing or too short
+static bool copyDHCPOption(DHCP_MESSAGE *message, uint8_t code, uint8_t *value) {
+    int16_t opt_index = findDHCPOption(message, code);
+    if (opt_index < 0 || opt_index + 6 > DHCP_DEFAULT_OPTIONS_SIZE || message->options[opt_index + 1] < 4) return false;
+    memcpy(value, &message->options[opt_index + 2], 4);
+    return true;
+}
+
+// DHCP_CLIENT Default Constructor, without a hardware address no server can answer, this constructor should be avoided
+DHCP_CLIENT::DHCP_CLIENT() {
+    initClient(NULL, 0);
+}
+
+DHCP_CLIENT::DHCP_CLIENT(uint8_t chaddr[], uint8_t hlen) {
+    initClient(chaddr, hlen);
+}
+
+// Shared constructor body
+void DHCP_CLIENT::initClient(uint8_t chaddr[], uint8_t hlen) {
+    for (int i = 0; i < 16; i++) {
+        if (i < hlen) {
+            H_ADDRESS[i] = chaddr[i];
+        } else {
+            H_ADDRESS[i] = 0;
+        }
+    }
+    _store = NULL;
+    memset(&_lease, 0, sizeof(_lease));
+    _state = DHCP_CLIENT_INIT;
+    _xid = 0;
+    _retries = 0;
+    _sent_at = 0;
+    _bound_at = 0;
+    _rapid_commit = true;
+}
+
+DHCP_CLIENT::~DHCP_CLIENT() {
+    DHCP_SOCKET.stop();
+}
+
+// Keep the lease across restarts in the given store, NULL disables
+void DHCP_CLIENT::setLeaseStore(DHCP_LEASE_STORE *store) {
+    _store = store;
+}
+
+// Ask for Rapid Commit in DISCOVERs, a server that allows it answers with an ACK straight away. Servers that do
+// not know the option ignore it, so this is on by default
+void DHCP_CLIENT::setRapidCommit(bool rapid_commit) {
+    _rapid_commit = rapid_commit;
+}
+
+// Start the client. With a cached lease this is a single REQUEST for the cached address (INIT-REBOOT), which
+// skips the DISCOVER and OFFER of a full exchange
+void DHCP_CLIENT::begin() {
+    uint8_t buffer[sizeof(DHCP_MESSAGE)];
+    DHCP_SOCKET.begin(DHCP_CLIENT_PORT);
+    DHCP_MESSAGE message = startExchange();
+    sendDHCPMessage(&message, buffer);
+}
+
+// DHCP Client Check for Replies, for use from loop()
+uint8_t DHCP_CLIENT::checkForReplies() {
+    uint8_t handled = 0;
+    uint8_t packet_buffer[sizeof(DHCP_MESSAGE)];
+    uint16_t packet_size = DHCP_SOCKET.parsePacket();
+    if (packet_size >= DHCP_HEADER_SIZE) {
+        memset(packet_buffer, 0, sizeof(packet_buffer));
+        DHCP_SOCKET.read(packet_buffer, sizeof(packet_buffer));
+        readDHCPHeader((DHCP_MESSAGE *)packet_buffer);
+        DHCP_MESSAGE message = parseDHCPReply((DHCP_MESSAGE *)packet_buffer);
+        if (message.op == DHCP_BOOTREQUEST) sendDHCPMessage(&message, packet_buffer);
+        handled = 1;
+    }
+    handleTimers(millis());
+    return handled;
+}
+
+// Retransmit a message nobody answered, give up on an INIT-REBOOT or a REQUEST that keeps going unanswered, renew
+// the lease at T1 and rebind it at T2, and start over when it runs out. Silence is not a NAK, so the lease cache is
+// kept for the next restart
+void DHCP_CLIENT::handleTimers(unsigned long now) {
+    uint8_t buffer[sizeof(DHCP_MESSAGE)];
+    DHCP_MESSAGE message;
+    unsigned long elapsed = (now - _bound_at) / 1000;
+    switch (_state) {
+    case DHCP_CLIENT_SELECTING:
+    case DHCP_CLIENT_REQUESTING:
+    case DHCP_CLIENT_REBOOTING:
+        if (now - _sent_at < DHCP_CLIENT_RETRY_TIME) return;
+        if ((_state == DHCP_CLIENT_REBOOTING && _retries >= DHCP_CLIENT_REBOOT_RETRIES) ||
+            (_state == DHCP_CLIENT_REQUESTING && _retries >= DHCP_CLIENT_MAX_RETRIES)) {
+            message = startDiscovery();
+        } else {
+            message = createStateMessage();
+        }
+        break;
+    case DHCP_CLIENT_BOUND:
+    case DHCP_CLIENT_RENEWING:
+    case DHCP_CLIENT_REBINDING:
+        if (elapsed >= _lease.lease_time) {
+            message = startDiscovery();
+        } else if (elapsed >= _lease.rebinding_time && _state != DHCP_CLIENT_REBINDING) {
+            message = startRenewal(DHCP_CLIENT_REBINDING);
+        } else if (elapsed >= _lease.renewal_time && _state == DHCP_CLIENT_BOUND) {
+            message = startRenewal(DHCP_CLIENT_RENEWING);
+        } else if (_state != DHCP_CLIENT_BOUND && now - _sent_at >= getRenewRetryTime(now)) {
+            message = createStateMessage();
+        } else {
+            return;
+        }
+        break;
+    default:
+        return;
+    }
+    sendDHCPMessage(&message, buffer);
+}
+
+// Get how long to wait before sending the next REQUEST while renewing or rebinding: half the time left until T2,
+// or until the lease runs out once rebinding, but never less than a minute (RFC 2131 section 4.4.5)
+unsigned long DHCP_CLIENT::getRenewRetryTime(unsigned long now) {
+    uint32_t deadline = _state == DHCP_CLIENT_RENEWING ? _lease.rebinding_time : _lease.lease_time;
+    unsigned long left = (unsigned long)deadline * 1000UL - (now - _bound_at);
+    if (left / 2 < DHCP_CLIENT_RENEW_RETRY_TIME) return DHCP_CLIENT_RENEW_RETRY_TIME;
+    return left / 2;
+}
+
+// Get the client state
+uint8_t DHCP_CLIENT::getState() {
+    return _state;
+}
+
+// Get the leased address, 0.0.0.0 until the client is bound. It is kept while the lease is being renewed
+IPAddress DHCP_CLIENT::getAddress() {
+    if (_state != DHCP_CLIENT_BOUND && _state != DHCP_CLIENT_RENEWING && _state != DHCP_CLIENT_REBINDING) {
+        return DHCP_CLIENT_ADDRESS;
+    }
+    return IPAddress(_lease.address[0], _lease.address[1], _lease.address[2], _lease.address[3]);
+}
+
+// Get the server that granted the lease
+IPAddress DHCP_CLIENT::getServerAddress() {
+    return IPAddress(_lease.server_id[0], _lease.server_id[1], _lease.server_id[2], _lease.server_id[3]);
+}
+
+// Get the subnet mask of the lease
+IPAddress DHCP_CLIENT::getSubnetMask() {
+    return IPAddress(_lease.subnet_mask[0], _lease.subnet_mask[1], _lease.subnet_mask[2], _lease.subnet_mask[3]);
+}
+
+// Get the router of the lease
+IPAddress DHCP_CLIENT::getRouter() {
+    return IPAddress(_lease.router[0], _lease.router[1], _lease.router[2], _lease.router[3]);
+}
+
+// Get the DNS server of the lease
+IPAddress DHCP_CLIENT::getDNSServer() {
+    return IPAddress(_lease.dns_server[0], _lease.dns_server[1], _lease.dns_server[2], _lease.dns_server[3]);
+}
+
+// Get the lease time in seconds
+uint32_t DHCP_CLIENT::getLeaseTime() {
+    return _lease.lease_time;
+}
+
+// First message after a restart, an INIT-REBOOT REQUEST for the cached address or a DISCOVER without one
+DHCP_MESSAGE DHCP_CLIENT::startExchange() {
+    if (!loadLease()) return startDiscovery();
+    _state = DHCP_CLIENT_REBOOTING;
+    _xid = (uint32_t)random(2147483647);
+    _retries = 0;
+    return createStateMessage();
+}
+
+// First message of a full DISCOVER, OFFER, REQUEST, ACK exchange
+DHCP_MESSAGE DHCP_CLIENT::startDiscovery() {
+    memset(&_lease, 0, sizeof(_lease));
+    _state = DHCP_CLIENT_SELECTING;
+    _xid = (uint32_t)random(2147483647);
+    _retries = 0;
+    return createStateMessage();
+}
+
+// First REQUEST to extend the lease, in RENEWING it goes to the server that granted the lease and in REBINDING
+// to any server that can hear it
+DHCP_MESSAGE DHCP_CLIENT::startRenewal(uint8_t state) {
+    _state = state;
+    _xid = (uint32_t)random(2147483647);
+    _retries = 0;
+    return createStateMessage();
+}
+
+// Message the current state sends, a REQUEST in SELECTING names the server whose offer it takes while an
+// INIT-REBOOT REQUEST must not (RFC 2131 4.3.2). A REQUEST that extends a lease carries the address in ciaddr
+// and neither option, which is what sends it down the server's renewal fast path
+DHCP_MESSAGE DHCP_CLIENT::createStateMessage() {
+    IPAddress address(_lease.address[0], _lease.address[1], _lease.address[2], _lease.address[3]);
+    switch (_state) {
+    case DHCP_CLIENT_REQUESTING: {
+        DHCP_MESSAGE message;
+        uint16_t opt_index = beginDHCPMessage(&message, DHCP_REQUEST, _xid);
+        opt_index = addDHCPOption(message.options, opt_index, DHCP_REQUESTED_IP, 4, _lease.address);
+        opt_index = addDHCPOption(message.options, opt_index, DHCP_SERVER_IDENTIFIER, 4, _lease.server_id);
+        message.options[opt_index] = DHCP_END;
+        return message;
+    }
+    case DHCP_CLIENT_REBOOTING:
+        return createDHCPMessage(DHCP_REQUEST, _xid, address);
+    case DHCP_CLIENT_RENEWING:
+    case DHCP_CLIENT_REBINDING: {
+        DHCP_MESSAGE message;
+        uint16_t opt_index = beginDHCPMessage(&message, DHCP_REQUEST, _xid);
+        memcpy(message.ciaddr, _lease.address, 4);
+        message.flags = 0;                          // The client can take a unicast reply at its address
+        message.options[opt_index] = DHCP_END;
+        return message;
+    }
+    default: {
+        DHCP_MESSAGE message;
+        uint16_t opt_index = beginDHCPMessage(&message, DHCP_DISCOVER, _xid);
+        if (_rapid_commit) opt_index = addDHCPOption(message.options, opt_index, DHCP_RAPID_COMMIT, 0, NULL);
+        message.options[opt_index] = DHCP_END;
+        return message;
+    }
+    }
+}
+
+// Parse a reply to the current exchange and move through the states, returns the message to send next or one with
+// op DHCP_NO_REPLY. A NAK means the cached address is no good on this network, so the cache is dropped
+DHCP_MESSAGE DHCP_CLIENT::parseDHCPReply(DHCP_MESSAGE *reply) {
+    DHCP_MESSAGE message;
+    message.op = DHCP_NO_REPLY;
+    // Simple check to make sure the reply is for this client and exchange
+    if (reply->op != DHCP_BOOTREPLY || reply->xid != _xid) return message;
+    if (memcmp(reply->chaddr, H_ADDRESS, DHCP_MAC_ADDRESS_LENGTH) != 0) return message;
+    uint8_t message_type = getDHCPMessageType(reply);
+    switch (_state) {
+    case DHCP_CLIENT_SELECTING:
+        if (message_type == DHCP_ACK && _rapid_commit && findDHCPOption(reply, DHCP_RAPID_COMMIT) >= 0) {
+            bindLease(reply);
+            break;
+        }
+        if (message_type != DHCP_OFFER) break;
+        readLeaseOptions(reply);
+        _state = DHCP_CLIENT_REQUESTING;
+        _retries = 0;
+        message = createStateMessage();
+        break;
+    case DHCP_CLIENT_REQUESTING:
+    case DHCP_CLIENT_REBOOTING:
+    case DHCP_CLIENT_RENEWING:
+    case DHCP_CLIENT_REBINDING:
+        if (message_type == DHCP_ACK) {
+            bindLease(reply);
+        } else if (message_type == DHCP_NAK) {
+            clearLease();
+            message = startDiscovery();
+        }
+        break;
+    default:
+        break;
+    }
+    return message;
+}
+
+// Take the offered address and the lease options from a reply
+void DHCP_CLIENT::readLeaseOptions(DHCP_MESSAGE *reply) {
+    memcpy(_lease.address, reply->yiaddr, 4);
+    if (!copyDHCPOption(reply, DHCP_SERVER_IDENTIFIER, _lease.server_id)) memcpy(_lease.server_id, reply->siaddr, 4);
+    copyDHCPOption(reply, DHCP_SUBNET_MASK, _lease.subnet_mask);
+    copyDHCPOption(reply, DHCP_ROUTER, _lease.router);
+    copyDHCPOption(reply, DHCP_DNS_NAME_SERVER, _lease.dns_server);
+    uint8_t lease_time[4];
+    if (copyDHCPOption(reply, DHCP_IP_LEASE_TIME, lease_time)) _lease.lease_time = readUInt32(lease_time);
+    // T1 and T2 default to half and seven eighths of the lease (RFC 2131 section 4.4.5)
+    _lease.renewal_time = _lease.lease_time / 2;
+    _lease.rebinding_time = _lease.lease_time - _lease.lease_time / 8;
+    if (copyDHCPOption(reply, DHCP_RENEWAL_TIME_VALUE, lease_time)) _lease.renewal_time = readUInt32(lease_time);
+    if (copyDHCPOption(reply, DHCP_REBINDING_TIME_VALUE, lease_time)) _lease.rebinding_time = readUInt32(lease_time);
+}
+
+// Take the lease an ACK grants and cache it
+void DHCP_CLIENT::bindLease(DHCP_MESSAGE *reply) {
+    readLeaseOptions(reply);
+    _state = DHCP_CLIENT_BOUND;
+    _bound_at = millis();
+    saveLease();
+}
+
+// Get where the current state sends its messages: straight to the server that granted the lease while renewing,
+// and broadcast otherwise, the client has no address to send from until it is bound
+IPAddress DHCP_CLIENT::getDestination() {
+    if (_state != DHCP_CLIENT_RENEWING) return DHCP_BROADCAST;
+    return IPAddress(_lease.server_id[0], _lease.server_id[1], _lease.server_id[2], _lease.server_id[3]);
+}
+
+// Serialize and send a message to the servers
+void DHCP_CLIENT::sendDHCPMessage(DHCP_MESSAGE *message, uint8_t *buffer) {
+    uint16_t message_size = serializeDHCPMessage(message, buffer, DHCP_MESSAGE_SIZE - DHCP_IP_UDP_HEADER_SIZE);
+    DHCP_SOCKET.beginPacket(getDestination(), DHCP_SERVER_PORT);
+    DHCP_SOCKET.write(buffer, message_size);
+    DHCP_SOCKET.endPacket();
+    _sent_at = millis();
+    _retries++;
+}
+
+// Read the lease cache: marker, address, server, subnet mask, router, DNS server and lease time in network
+// order followed by a CRC32 of all of it
+bool DHCP_CLIENT::loadLease() {
+    uint8_t cache[DHCP_LEASE_CACHE_SIZE];
+    if (_store == NULL || !_store->readLease(cache, DHCP_LEASE_CACHE_SIZE)) return false;
+    if (readUInt32(cache) != DHCP_LEASE_CACHE_MAGIC) return false;
+    if (readUInt32(&cache[28]) != crc32(cache, 28)) return false;
+    memcpy(_lease.address, &cache[4], 4);
+    memcpy(_lease.server_id, &cache[8], 4);
+    memcpy(_lease.subnet_mask, &cache[12], 4);
+    memcpy(_lease.router, &cache[16], 4);
+    memcpy(_lease.dns_server, &cache[20], 4);
+    _lease.lease_time = readUInt32(&cache[24]);
+    _lease.renewal_time = _lease.lease_time / 2;
+    _lease.rebinding_time = _lease.lease_time - _lease.lease_time / 8;
+    return readUInt32(_lease.address) != 0;
+}
+
+// Write the lease cache, see loadLease() for the layout
+bool DHCP_CLIENT::saveLease() {
+    if (_store == NULL) return false;
+    uint8_t cache[DHCP_LEASE_CACHE_SIZE];
+    writeUInt32(cache, DHCP_LEASE_CACHE_MAGIC);
+    memcpy(&cache[4], _lease.address, 4);
+    memcpy(&cache[8], _lease.server_id, 4);
+    memcpy(&cache[12], _lease.subnet_mask, 4);
+    memcpy(&cache[16], _lease.router, 4);
+    memcpy(&cache[20], _lease.dns_server, 4);
+    writeUInt32(&cache[24], _lease.lease_time);
+    writeUInt32(&cache[28], crc32(cache, 28));
+    return _store->writeLease(cache, DHCP_LEASE_CACHE_SIZE);
+}
+
+// Invalidate the lease cache so the next restart does a full exchange
+void DHCP_CLIENT::clearLease() {
+    if (_store == NULL) return;
+    uint8_t cache[DHCP_LEASE_CACHE_SIZE];
+    memset(cache, 0, sizeof(cache));
+    _store->writeLease(cache, DHCP_LEASE_CACHE_SIZE);
+}
+
+// Fill the fixed fields and the message type option of a client message, returns the options index that follows
+uint16_t DHCP_CLIENT::beginDHCPMessage(DHCP_MESSAGE *message, uint8_t message_type, uint32_t xid) {
+    memset(message, 0, sizeof(DHCP_MESSAGE));
+    message->op = DHCP_BOOTREQUEST;
+    message->htype = DHCP_ETHERNET;
+    message->hlen = DHCP_MAC_ADDRESS_LENGTH;
+    message->hops = 0;
+    message->xid = xid;
+    message->secs = 0;
+    message->flags = DHCP_BROADCAST_FLAG;
+    for (int i = 0; i < message->hlen; i++) {
+        message->chaddr[i] = H_ADDRESS[i];
+    }
+    return addDHCPOption(message->options, 0, DHCP_MESSAGE_TYPE, 1, &message_type);
+}
+
+DHCP_MESSAGE DHCP_CLIENT::createDHCPMessage(uint8_t message_type, uint32_t xid) {
+    DHCP_MESSAGE message;
+    uint16_t opt_index = beginDHCPMessage(&message, message_type, xid);
+    message.options[opt_index] = DHCP_END;
+    return message;
+}
+
+// Create a message about an address. REQUEST and DECLINE carry it as the requested address, INFORM and RELEASE
+// come from a client that holds it and carry it in ciaddr
+DHCP_MESSAGE DHCP_CLIENT::createDHCPMessage(uint8_t message_type, uint32_t xid, IPAddress address) {
+    DHCP_MESSAGE message;
+    uint16_t opt_index = beginDHCPMessage(&message, message_type, xid);
+    uint8_t requested_ip[4] = {address[0], address[1], address[2], address[3]};
+    if (message_type == DHCP_REQUEST || message_type == DHCP_DECLINE) {
+        opt_index = addDHCPOption(message.options, opt_index, DHCP_REQUESTED_IP, 4, requested_ip);
+    } else {
+        memcpy(message.ciaddr, requested_ip, 4);
+        message.flags = 0;
+    }
+    message.options[opt_index] = DHCP_END;
+    return message;
+}
+
+// ********** DHCP RELAY **********
+
+// DHCP_RELAY Constructor, relay_address is the address clients see, servers send their replies there
+DHCP_RELAY::DHCP_RELAY(IPAddress relay_address) {
+    RELAY_ADDRESS = relay_address;
+    _server_count = 0;
+    _circuit_id_length = 0;
+    _remote_id_length = 0;
+    _relayed = 0;
+    _returned = 0;
+    _dropped = 0;
+    DHCP_SOCKET.begin(DHCP_SERVER_PORT);
+}
+
+DHCP_RELAY::~DHCP_RELAY() {
+    DHCP_SOCKET.stop();
+}
+
+// Add an upstream server, every request is forwarded to all of them
+bool DHCP_RELAY::addServer(IPAddress server) {
+    if (_server_count >= DHCP_RELAY_MAX_SERVERS) return false;
+    _servers[_server_count++] = server;
+    return true;
+}
+
+// Set the Agent Circuit ID sent in option 82, usually the port or VLAN the board serves
+void DHCP_RELAY::setCircuitId(const uint8_t *circuit_id, uint8_t length) {
+    if (length > DHCP_RELAY_MAX_ID_SIZE) length = DHCP_RELAY_MAX_ID_SIZE;
+    memcpy(_circuit_id, circuit_id, length);
+    _circuit_id_length = length;
+}
+
+// Set the Agent Remote ID sent in option 82, usually something naming the board itself
+void DHCP_RELAY::setRemoteId(const uint8_t *remote_id, uint8_t length) {
+    if (length > DHCP_RELAY_MAX_ID_SIZE) length = DHCP_RELAY_MAX_ID_SIZE;
+    memcpy(_remote_id, remote_id, length);
+    _remote_id_length = length;
+}
+
+// Socket the relay receives on, event loops watch it and call handleReadable() when it has data
+EthernetUDP *DHCP_RELAY::getSocket() {
+    return &DHCP_SOCKET;
+}
+
+// Handle pending packets, up to DHCP_RELAY_BATCH per call so one wakeup drains a burst without starving the rest of
+// the sketch. Requests go to every upstream server and replies back to their client
+uint8_t DHCP_RELAY::handleReadable() {
+    uint8_t handled = 0;
+    while (handled < DHCP_RELAY_BATCH) {
+        int packet_size = DHCP_SOCKET.parsePacket();
+        if (packet_size <= 0) break;
+        handled++;
+        if (packet_size > (int)sizeof(_packet)) {
+            _dropped++;
+            continue;
+        }
+        DHCP_SOCKET.read(_packet, packet_size);
+        uint16_t size;
+        if (_packet[0] == DHCP_BOOTREQUEST) {
+            size = relayRequest(_packet, packet_size);
+            if (size == 0) {
+                _dropped++;
+                continue;
+            }
+            for (int i = 0; i < _server_count; i++) {
+                sendPacket(_servers[i], DHCP_SERVER_PORT, size);
+            }
+            _relayed++;
+        } else {
+            IPAddress destination;
+            size = relayReply(_packet, packet_size, destination);
+            if (size == 0) {
+                _dropped++;
+                continue;
+            }
+            sendPacket(destination, DHCP_CLIENT_PORT, size);
+            _returned++;
+        }
+    }
+    return handled;
+}
+
+// Send the first size bytes of the receive buffer
+void DHCP_RELAY::sendPacket(IPAddress destination, uint16_t port, uint16_t size) {
+    DHCP_SOCKET.beginPacket(destination, port);
+    DHCP_SOCKET.write(_packet, size);
+    DHCP_SOCKET.endPacket();
+}
+
+// Find the End option of a raw packet, returns its index or -1 if the options run past the packet
+int16_t DHCP_RELAY::findOptionsEnd(uint8_t *packet, uint16_t size) {
+    uint16_t index = DHCP_HEADER_SIZE;
+    while (index < size) {
+        if (packet[index] == DHCP_END) return index;
+        if (packet[index] == DHCP_PAD) {
+            index++;
+            continue;
+        }
+        if (index + 1 >= size) return -1;
+        index += 2 + packet[index + 1];
+    }
+    return -1;
+}
+
+// Rewrite a raw request for the servers in place: count the hop, set giaddr if this is the first relay and append
+// option 82. The packet buffer must hold sizeof(DHCP_MESSAGE) bytes. A request that already carries option 82 with
+// no giaddr came from an untrusted client and is dropped (RFC 3046 2.1). Returns the new size or 0 to drop it
+uint16_t DHCP_RELAY::relayRequest(uint8_t *packet, uint16_t size) {
+    if (size < DHCP_HEADER_SIZE || packet[0] != DHCP_BOOTREQUEST) return 0;
+    if (readUInt32(&packet[DHCP_HEADER_SIZE - 4]) != DHCP_MAGIC_COOKIE) return 0;
+    if (packet[3] >= DHCP_RELAY_MAX_HOPS) return 0;
+    packet[3]++;
+    if (readUInt32(&packet[24]) != 0) return size;  // Already relayed, the first relay's giaddr and option 82 stand
+    int16_t end_index = findOptionsEnd(packet, size);
+    if (end_index < 0) return 0;
+    for (int i = DHCP_HEADER_SIZE; i < end_index; ) {
+        if (packet[i] == DHCP_PAD) {
+            i++;
+            continue;
+        }
+        if (packet[i] == DHCP_RELAY_AGENT_INFORMATION) return 0;
+        i += 2 + packet[i + 1];
+    }
+    for (int i = 0; i < 4; i++) {
+        packet[24 + i] = RELAY_ADDRESS[i];
+    }
+    // Option 82 goes where End was, unless it would not fit in a minimum size message
+    uint8_t option_length = 0;
+    if (_circuit_id_length > 0) option_length += 2 + _circuit_id_length;
+    if (_remote_id_length > 0) option_length += 2 + _remote_id_length;
+    if (option_length > 0 && end_index + 2 + option_length + 1 <= DHCP_MESSAGE_SIZE - DHCP_IP_UDP_HEADER_SIZE) {
+        uint16_t index = end_index;
+        packet[index++] = DHCP_RELAY_AGENT_INFORMATION;
+        packet[index++] = option_length;
+        if (_circuit_id_length > 0) {
+            packet[index++] = DHCP_AGENT_CIRCUIT_ID;
+            packet[index++] = _circuit_id_length;
+            memcpy(&packet[index], _circuit_id, _circuit_id_length);
+            index += _circuit_id_length;
+        }
+        if (_remote_id_length > 0) {
+            packet[index++] = DHCP_AGENT_REMOTE_ID;
+            packet[index++] = _remote_id_length;
+            memcpy(&packet[index], _remote_id, _remote_id_length);
+            index += _remote_id_length;
+        }
+        packet[index++] = DHCP_END;
+        if (index > size) size = index;
+    }
+    if (size < DHCP_MIN_PACKET_SIZE) {
+        memset(&packet[size], 0, DHCP_MIN_PACKET_SIZE - size);
+        size = DHCP_MIN_PACKET_SIZE;
+    }
+    return size;
+}
+
+// Rewrite a raw reply for the client in place: option 82 is taken out and the destination picked. Only replies to
+// this relay's giaddr are taken. A client that asked for broadcast or has no address yet is answered by broadcast,
+// a client with an address in ciaddr directly. Returns the new size or 0 to drop it
+uint16_t DHCP_RELAY::relayReply(uint8_t *packet, uint16_t size, IPAddress &destination) {
+    if (size < DHCP_HEADER_SIZE || packet[0] != DHCP_BOOTREPLY) return 0;
+    if (readUInt32(&packet[DHCP_HEADER_SIZE - 4]) != DHCP_MAGIC_COOKIE) return 0;
+    for (int i = 0; i < 4; i++) {
+        if (packet[24 + i] != RELAY_ADDRESS[i]) return 0;
+    }
+    int16_t end_index = findOptionsEnd(packet, size);
+    if (end_index < 0) return 0;
+    for (int i = DHCP_HEADER_SIZE; i < end_index; ) {
+        if (packet[i] == DHCP_PAD) {
+            i++;
+            continue;
+        }
+        if (packet[i] != DHCP_RELAY_AGENT_INFORMATION) {
+            i += 2 + packet[i + 1];
+            continue;
+        }
+        uint16_t length = 2 + packet[i + 1];
+        memmove(&packet[i], &packet[i + length], size - i - length);
+        memset(&packet[size - length], 0, length);
+        end_index -= length;
+    }
+    if ((packet[10] & (DHCP_BROADCAST_FLAG >> 8)) == 0 && readUInt32(&packet[12]) != 0) {
+        destination = IPAddress(packet[12], packet[13], packet[14], packet[15]);
+    } else {
+        destination = DHCP_BROADCAST;
+    }
+    return size;
+}
+
+// Get the number of requests forwarded
+uint32_t DHCP_RELAY::getRelayedCount() {
+    return _relayed;
+}
+
+// Get the number of replies sent back to clients
+uint32_t DHCP_RELAY::getReturnedCount() {
+    return _returned;
+}
+
+// Get the number of packets dropped
+uint32_t DHCP_RELAY::getDropCount() {
+    return _dropped;
+}
+
+// ********** DHCP UNIT TESTER **********
+// TODO: Fully Implement this class
+
+// Conflict prober stand-in for the unit tests, answers once complete is set
+class DHCP_TEST_PROBER : public DHCP_CONFLICT_PROBER {
+public:
+    IPAddress conflict;                                             // Address another host answers for
+    bool complete;                                                  // Probes have completed
+    uint8_t probes;                                                 // Number of probes started
+    IPAddress probed;                                               // Address of the last probe started
+    bool beginProbe(IPAddress address) {
+        probes++;
+        probed = address;
+        return true;
+    }
+    uint8_t probeStatus(IPAddress address) {
+        if (!complete) return DHCP_PROBE_PENDING;
+        if (address == conflict) return DHCP_PROBE_CONFLICT;
+        return DHCP_PROBE_CLEAR;
+    }
+};
+
+static DHCP_TEST_PROBER test_prober;
+
+// Lease store stand-in for the unit tests, keeps the lease cache in memory
+class DHCP_TEST_LEASE_STORE : public DHCP_LEASE_STORE {
+public:
+    uint8_t cache[DHCP_LEASE_CACHE_SIZE];                           // Saved lease cache
+    bool saved;                                                     // A lease cache was written
+    DHCP_TEST_LEASE_STORE() {
+        saved = false;
+    }
+    bool readLease(uint8_t *data, uint16_t size) {
+        if (!saved) return false;
+        memcpy(data, cache, size);
+        return true;
+    }
+    bool writeLease(const uint8_t *data, uint16_t size) {
+        memcpy(cache, data, size);
+        saved = true;
+        return true;
+    }
+};
+
+// Print stand-in for the unit tests, keeps what was written in memory
+class DHCP_TEST_PRINT : public Print {
+public:
+    uint8_t buffer[1024];                                           // Bytes written
+    size_t length;                                                  // Number of bytes written
+    DHCP_TEST_PRINT() {
+        length = 0;
+    }
+    size_t write(uint8_t c) {
+        if (length >= sizeof(buffer)) return 0;
+        buffer[length++] = c;
+        return 1;
+    }
+};
+
+DHCP_TESTER::DHCP_TESTER() {
+    randomSeed(1111);
+    test_xid = (uint32_t)random(2147483647);
+    test_server_ip = IPAddress(10,0,0,1);
+    test_client_ip = IPAddress(10,0,0,2);
+    uint8_t test_client_mac[] = {0x01, 0xEA, 0xFD, 0xBC, 0x05, 0x06};
+    _dhcp_server = new DHCP_SERVER(IPAddress(10, 0, 0, 1), 32);
+    _dhcp_client = new DHCP_CLIENT(test_client_mac, 6);
+}
+
+DHCP_TESTER::~DHCP_TESTER() {
+    Serial.println(F("Destroying DHCP Tester"));
+    delete _dhcp_server;
+    delete _dhcp_client;
+}
+
+// Create a client request of the given type for the server tests
+DHCP_MESSAGE DHCP_TESTER::createTestRequest(uint8_t message_type) {
+    return _dhcp_client->createDHCPMessage(message_type, test_xid);
+}
+
+// Create a client request asking for an address, with the server identifier of the chosen server unless that is NULL
+DHCP_MESSAGE DHCP_TESTER::createTestRequest(uint8_t message_type, const uint8_t *requested_ip, const uint8_t *server_id) {
+    DHCP_MESSAGE request = createTestRequest(message_type);
+    int16_t opt_index = findDHCPOptionsEnd(&request);
+    opt_index = addDHCPOption(request.options, opt_index, DHCP_REQUESTED_IP, 4, (uint8_t *)requested_ip);
+    if (server_id != NULL) opt_index = addDHCPOption(request.options, opt_index, DHCP_SERVER_IDENTIFIER, 4, (uint8_t *)server_id);
+    request.options[opt_index] = DHCP_END;
+    return request;
+}
+
+// Handle failed tests
+bool DHCP_TESTER::testFailed() {
+    Serial.print(F("[ FAIL ]"));
+    Serial.println();
+    return false;
+}
+
+// Handle successful tests
+bool DHCP_TESTER::testPassed() {
+    Serial.print(F("[  OK  ]"));
+    Serial.println();
+    return true;
+}
+
+// Run SimpleDHCP tests
+bool DHCP_TESTER::runTests() {
+    Serial.println(F("************ Running tests ************"));
+    bool results = true;
+    if (!runServerTests()) results = false;
+    if (!runClientTests()) results = false;
+    if (!runRelayTests()) results = false;
+    Serial.println(F("************ Test Results *************"));
+    Serial.print(F("Final result:    "));
+    if (results) {
+        return testPassed();
+    } else {
+        return testFailed();
+    }
+}
+
+// Run DHCP Server tests
+bool DHCP_TESTER::runServerTests() {
+    Serial.println(F("********** DHCP Server Tests **********"));
+    bool results = true;
+    if (!runServerAddressManagementTests()) results = false;
+    if (!runServerMessageGenerationTests()) results = false;
+    if (!runServerSerializationTests()) results = false;
+    if (!runServerEventLoopTests()) results = false;
+    if (!runServerConflictProbeTests()) results = false;
+    if (!runServerFailoverTests()) results = false;
+    if (!runServerSnapshotTests()) results = false;
+    if (!runServerAllocationPolicyTests()) results = false;
+    if (!runServerConfigurationTests()) results = false;
+    if (!runExtentAllocatorTests()) results = false;
+    if (!runServerRenewalTests()) results = false;
+    if (!runServerPrioritySchedulingTests()) results = false;
+    if (!runServerParsingTests()) results = false;
+    return results;
+}
+
+// Run Server address management tests
+bool DHCP_TESTER::runServerAddressManagementTests() {
+    Serial.println(F("       Address Management Tests        "));
+    bool results = true;
+    if (!testAddressInRange()) results = false;
+    if (!testAddressOutOfRange()) results = false;
+    if (!testAutoAddressAssignment()) results = false;
+    if (!testAddressRelease()) results = false;
+    if (!testAddressReassignment()) results = false;
+    return results;
+}
+
+//
+bool DHCP_TESTER::testAddressInRange() {
+    Serial.print(F("In Range:        "));
+    IPAddress address = _dhcp_server->assignAddress(IPAddress(10, 0, 0, 2));
+    if (address != IPAddress(10, 0, 0, 2)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+//
+bool DHCP_TESTER::testAddressOutOfRange() {
+    Serial.print(F("Out of Range:    "));
+    IPAddress address = _dhcp_server->assignAddress(IPAddress(192, 168, 1, 353));
+    if (address != IPAddress(10, 0, 0, 3)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+//
+bool DHCP_TESTER::testAutoAddressAssignment() {
+    Serial.print(F("Auto Assign:     "));
     IPAddress address = _dhcp_server->getAddressFromPool();
     if (address != IPAddress(10, 0, 0, 4)) return testFailed();
     address = _dhcp_server->assignAddress(address);
@@ -588,64 +2933,902 @@ bool DHCP_TESTER::testAutoAddressAssignment() {
     return testPassed(); // If we reached here then all the tests passed
 }
 
-//
-bool DHCP_TESTER::testAddressRelease() {
-    Serial.print(F("Release:         "));
-    _dhcp_server->releaseAddress(IPAddress(10, 0, 0, 4));
-    if(!_dhcp_server->_addresses[2]) return testFailed();
+//
+bool DHCP_TESTER::testAddressRelease() {
+    Serial.print(F("Release:         "));
+    _dhcp_server->releaseAddress(IPAddress(10, 0, 0, 4));
+    if(!_dhcp_server->_addresses[2]) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test reassignment of released addresses
+bool DHCP_TESTER::testAddressReassignment() {
+    Serial.print(F("Reassignment:    "));
+    IPAddress address = _dhcp_server->getAddressFromPool();
+    if (address != IPAddress(10, 0, 0, 4)) return testFailed();
+    address = _dhcp_server->assignAddress(address);
+    if (address != IPAddress(10, 0, 0, 4)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run Server message generation tests
+bool DHCP_TESTER::runServerMessageGenerationTests() {
+    Serial.println(F("    Server Message Generation Tests    "));
+    bool results = true;
+    if (!testDHCPOFFERGeneration()) results = false;
+    if (!testDHCPACKGeneration()) results = false;
+    if (!testDHCPNAKGeneration()) results = false;
+    return results;
+}
+
+// Run Server DHCP OFFER generation test
+bool DHCP_TESTER::testDHCPOFFERGeneration() {
+    Serial.print(F("DHCP OFFER:      "));
+    DHCP_MESSAGE message = _dhcp_server->createDHCPReply(DHCP_OFFER, test_client_ip, test_xid);
+    // _dhcp_server->printDHCPMessage(message);
+    if (message.op != DHCP_BOOTREPLY) return testFailed();
+    if (message.htype != DHCP_ETHERNET) return testFailed();
+    if (message.hlen != 6) return testFailed();
+    if (message.hops != 0) return testFailed();
+    if (message.xid != test_xid) return testFailed();
+    if (message.secs != 0) return testFailed();
+    if (message.flags != DHCP_BROADCAST_FLAG) return testFailed();
+    for (int i = 0; i < 4; i++) {
+        if (message.ciaddr[i] != 0) return testFailed();
+        if (message.yiaddr[i] != test_client_ip[i]) return testFailed();
+        if (message.siaddr[i] != test_server_ip[i]) return testFailed();
+        if (message.giaddr[i] != 0) return testFailed();
+    }
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run Server DHCP ACK generation test
+bool DHCP_TESTER::testDHCPACKGeneration() {
+    Serial.print(F("DHCP ACK:        "));
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run Server DHCP NAK generation test
+bool DHCP_TESTER::testDHCPNAKGeneration() {
+    Serial.print(F("DHCP NAK:        "));
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run Server reply serialization tests
+bool DHCP_TESTER::runServerSerializationTests() {
+    Serial.println(F("      Server Serialization Tests       "));
+    bool results = true;
+    if (!testReplySerialization()) results = false;
+    if (!testReplyOptionOverload()) results = false;
+    return results;
+}
+
+// Test that replies are written with only the bytes they use
+bool DHCP_TESTER::testReplySerialization() {
+    Serial.print(F("Exact Length:    "));
+    DHCP_MESSAGE message = _dhcp_server->createDHCPReply(DHCP_OFFER, test_client_ip, test_xid);
+    uint8_t buffer[sizeof(DHCP_MESSAGE)];
+    uint16_t length = serializeDHCPMessage(&message, buffer, DHCP_MESSAGE_SIZE - DHCP_IP_UDP_HEADER_SIZE);
+    if (length != DHCP_MIN_PACKET_SIZE) return testFailed();
+    if (buffer[10] != (DHCP_BROADCAST_FLAG >> 8)) return testFailed();
+    if (buffer[236] != 0x63 || buffer[239] != 0x63) return testFailed();
+    if (buffer[DHCP_HEADER_SIZE] != DHCP_MESSAGE_TYPE) return testFailed();
+    if (buffer[DHCP_HEADER_SIZE + 2] != DHCP_OFFER) return testFailed();
+    // Options: type (3), server id (6), lease time (6), subnet mask (6), end (1)
+    if (buffer[DHCP_HEADER_SIZE + 21] != DHCP_END) return testFailed();
+    // Without the legacy minimum the packet ends right after DHCP_END
+    length = serializeDHCPMessage(&message, buffer, DHCP_MIN_PACKET_SIZE - 1);
+    if (length != DHCP_HEADER_SIZE + 22) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that options which do not fit are overloaded into the file and sname fields
+bool DHCP_TESTER::testReplyOptionOverload() {
+    Serial.print(F("Overload:        "));
+    DHCP_MESSAGE message = _dhcp_server->createDHCPReply(DHCP_ACK, test_client_ip, test_xid);
+    uint8_t vendor[120];
+    for (int i = 0; i < 120; i++) {
+        vendor[i] = i;
+    }
+    uint16_t opt_index = 21;                                        // Just past the options from createDHCPReply()
+    opt_index = addDHCPOption(message.options, opt_index, DHCP_VENDOR_INFO, 120, vendor);
+    opt_index = addDHCPOption(message.options, opt_index, DHCP_MESSAGE_OPTION, 100, vendor);
+    opt_index = addDHCPOption(message.options, opt_index, DHCP_VENDOR_CLASS_IDENTIFIER, 50, vendor);
+    message.options[opt_index] = DHCP_END;
+    uint8_t buffer[sizeof(DHCP_MESSAGE)];
+    uint16_t length = serializeDHCPMessage(&message, buffer, 400);
+    if (length > 400) return testFailed();
+    // 157 bytes are left for options, the vendor info fits but the message has to move to the file field
+    if (buffer[DHCP_HEADER_SIZE + 21] != DHCP_VENDOR_INFO) return testFailed();
+    if (buffer[DHCP_HEADER_SIZE + 143] != DHCP_OPTION_OVERLOAD) return testFailed();
+    if (buffer[DHCP_HEADER_SIZE + 145] != DHCP_OVERLOAD_BOTH) return testFailed();
+    if (buffer[DHCP_HEADER_SIZE + 146] != DHCP_END) return testFailed();
+    if (buffer[DHCP_FILE_OFFSET] != DHCP_MESSAGE_OPTION) return testFailed();
+    if (buffer[DHCP_FILE_OFFSET + 102] != DHCP_END) return testFailed();
+    if (buffer[DHCP_SNAME_OFFSET] != DHCP_VENDOR_CLASS_IDENTIFIER) return testFailed();
+    if (buffer[DHCP_SNAME_OFFSET + 52] != DHCP_END) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run Server event loop tests
+bool DHCP_TESTER::runServerEventLoopTests() {
+    Serial.println(F("        Server Event Loop Tests        "));
+    bool results = true;
+    if (!testTimerDeadline()) results = false;
+    if (!testLeaseExpiry()) results = false;
+    if (!testLeaseTimeKept()) results = false;
+    if (!testOfferExpiry()) results = false;
+    if (!testSimulator()) results = false;
+#ifdef SIMPLE_DHCP_TRACE
+    if (!testTraceExport()) results = false;
+    if (!testTraceFlush()) results = false;
+    if (!testTraceReceive()) results = false;
+#endif
+    return results;
+}
+
+// Test that the next timer deadline follows the earliest lease
+bool DHCP_TESTER::testTimerDeadline() {
+    Serial.print(F("Timer Deadline:  "));
+    unsigned long deadline;
+    if (!_dhcp_server->nextTimerDeadline(deadline)) return testFailed();
+    if ((long)(deadline - millis()) > DHCP_DEFAULT_LEASE_TIME * 1000L) return testFailed();
+    _dhcp_server->setLeaseTime(5);
+    IPAddress address = _dhcp_server->assignAddress(_dhcp_server->getAddressFromPool());
+    _dhcp_server->setLeaseTime(DHCP_DEFAULT_LEASE_TIME);
+    if (!_dhcp_server->nextTimerDeadline(deadline)) return testFailed();
+    if ((long)(deadline - millis()) > 5000L) return testFailed();
+    _dhcp_server->releaseAddress(address);
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that a lease time set with setLeaseTime() survives handling a request and is the one handed out
+bool DHCP_TESTER::testLeaseTimeKept() {
+    Serial.print(F("Lease Time:      "));
+    _dhcp_server->setLeaseTime(120);
+    DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(createTestRequest(DHCP_DISCOVER));
+    _dhcp_server->releaseAddress(IPAddress(reply.yiaddr));
+    uint32_t lease_time = _dhcp_server->getLeaseTime();
+    _dhcp_server->setLeaseTime(DHCP_DEFAULT_LEASE_TIME);
+    if (lease_time != 120) return testFailed();
+    int16_t opt_index = findDHCPOption(&reply, DHCP_IP_LEASE_TIME);
+    if (opt_index < 0 || readUInt32(&reply.options[opt_index + 2]) != 120) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that leases are only returned to the pool once their deadline has passed
+bool DHCP_TESTER::testLeaseExpiry() {
+    Serial.print(F("Lease Expiry:    "));
+    _dhcp_server->setLeaseTime(5);
+    IPAddress address = _dhcp_server->assignAddress(_dhcp_server->getAddressFromPool());
+    _dhcp_server->setLeaseTime(DHCP_DEFAULT_LEASE_TIME);
+    unsigned long deadline;
+    if (!_dhcp_server->nextTimerDeadline(deadline)) return testFailed();
+    _dhcp_server->handleTimers(deadline - 1);
+    if (_dhcp_server->isAddressAvailable(address)) return testFailed();
+    _dhcp_server->handleTimers(deadline);
+    if (!_dhcp_server->isAddressAvailable(address)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that an unclaimed offer goes back to the pool once its hold time is up, and a claimed one does not. An
+// offer made after the hold time is shortened expires on its own deadline, ahead of older offers
+bool DHCP_TESTER::testOfferExpiry() {
+    Serial.print(F("Offer Expiry:    "));
+    DHCP_SERVER server(IPAddress(10, 0, 7, 1), 20);
+    server.setOfferHoldTime(1000);
+    IPAddress abandoned = server.offerAddress(DHCP_CLIENT_ADDRESS, 0x5EED0001);
+    IPAddress claimed = server.offerAddress(DHCP_CLIENT_ADDRESS, 0x5EED0002);
+    if (server.offerAddress(DHCP_CLIENT_ADDRESS, 0x5EED0001) != abandoned) return testFailed();   // Retransmitted DISCOVER
+    if (server.isAddressAvailable(abandoned) || server.isAddressAvailable(claimed)) return testFailed();
+    int16_t index = server.getPoolIndex(claimed);
+    server._leases[index].status = DHCP_LEASE_BOUND;                // As confirmRequest() leaves it
+    server._leases[index].expires = millis() + 600000UL;
+    unsigned long deadline;
+    if (!server.nextTimerDeadline(deadline) || (long)(deadline - millis()) > 1000L) return testFailed();
+    server.handleTimers(millis() + 500);
+    if (server.isAddressAvailable(abandoned)) return testFailed();
+    server.handleTimers(millis() + 1000);
+    if (!server.isAddressAvailable(abandoned)) return testFailed();
+    if (server.isAddressAvailable(claimed)) return testFailed();
+    if (server._offer_queue_count != 0) return testFailed();
+    server.setOfferHoldTime(10000);
+    IPAddress held = server.offerAddress(DHCP_CLIENT_ADDRESS, 0x5EED0003);
+    server.setOfferHoldTime(1000);
+    IPAddress shortened = server.offerAddress(DHCP_CLIENT_ADDRESS, 0x5EED0004);
+    server.handleTimers(server._leases[server.getPoolIndex(shortened)].expires);
+    if (!server.isAddressAvailable(shortened) || server.isAddressAvailable(held)) return testFailed();
+    server.handleTimers(server._leases[server.getPoolIndex(held)].expires);
+    if (!server.isAddressAvailable(held)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that the simulator drives the server through days of churn on its virtual clock, and that the memory column
+// is read off the sketch's counter less the simulated clients
+bool DHCP_TESTER::testSimulator() {
+    Serial.print(F("Simulator:       "));
+    DHCP_SERVER server(IPAddress(10, 0, 9, 1), 40);
+    server.setLeaseTime(3600);
+    DHCP_SIM_STATS totals;
+    volatile uint32_t heap_bytes = 20000;
+    {
+        DHCP_SIM_MODEL model = {60, 30, 4 * 3600UL, 12, 50};
+        DHCP_SIMULATOR simulator(&server, model);
+        simulator.setMemoryCounter(&heap_bytes);
+        DHCP_TEST_PRINT out;
+        if (!simulator.run(out, 48)) return testFailed();
+        if (server._clock() != 48 * 3600000UL) return testFailed();
+        simulator.getTotals(totals);
+    }
+    if (server._clock != millis) return testFailed();
+    if (totals.allocations == 0 || totals.renewals == 0 || totals.reboots == 0) return testFailed();
+    if (totals.expired == 0) return testFailed();                   // Departed clients leave their leases to expire
+    if (totals.bound + totals.offered > 40 || totals.online > 60) return testFailed();
+    if (totals.memory != 20000 - 60 * sizeof(DHCP_SIM_CLIENT)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+#ifdef SIMPLE_DHCP_TRACE
+// Test that the stages of a request end up in the trace as Chrome trace events
+bool DHCP_TESTER::testTraceExport() {
+    Serial.print(F("Trace Export:    "));
+    DHCP_TEST_PRINT out;
+    DHCP_TRACE_WRITER writer(out);
+    writer.begin();
+    writer.setMessageType(DHCP_DISCOVER);
+    DHCP_MESSAGE reply = _dhcp_server->createDHCPReply(DHCP_OFFER, test_client_ip, test_xid);
+    (void)reply;
+    writer.end();
+    out.buffer[out.length < sizeof(out.buffer) ? out.length : sizeof(out.buffer) - 1] = 0;
+    const char *trace = (const char *)out.buffer;
+    if (trace[0] != '[') return testFailed();
+    if (strstr(trace, "\"name\":\"build\"") == NULL) return testFailed();
+    if (strstr(trace, "\"ph\":\"X\"") == NULL) return testFailed();
+    if (strstr(trace, "\"message_type\":1") == NULL) return testFailed();
+    if (DHCP_TRACE_WRITER::active != NULL) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that nothing is written out while a span is open, so printing never counts towards a stage, and that the
+// events buffered meanwhile are written once it closes
+bool DHCP_TESTER::testTraceFlush() {
+    Serial.print(F("Trace Flush:     "));
+    DHCP_TEST_PRINT out;
+    DHCP_TRACE_WRITER writer(out);
+    writer.begin();
+    {
+        DHCP_TRACE_SCOPE(DHCP_TRACE_PARSE);
+        for (int i = 0; i < DHCP_TRACE_BUFFER_SIZE + 4; i++) {
+            DHCP_TRACE_SCOPE(DHCP_TRACE_LOOKUP);
+        }
+        if (out.length != 1) return testFailed();                   // Just the opening bracket
+    }
+    if (out.length <= 1 || writer.getDropCount() != 4) return testFailed();
+    writer.end();
+    if (DHCP_TRACE_SPAN::open != 0) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that the receive and validate stages carry the type of the packet at hand rather than the one handled before
+// it. No packet is sent, an idle socket and a packet already in the buffer are enough
+bool DHCP_TESTER::testTraceReceive() {
+    Serial.print(F("Trace Receive:   "));
+    DHCP_SERVER server(IPAddress(10, 0, 7, 1), 8);
+    server.setServerPort(6769);
+    uint8_t buffer[sizeof(DHCP_MESSAGE)];
+    DHCP_MESSAGE request = createTestRequest(DHCP_DISCOVER);
+    uint16_t size = serializeDHCPMessage(&request, buffer, sizeof(buffer));
+    DHCP_TEST_PRINT out;
+    DHCP_TRACE_WRITER writer(out);
+    writer.begin();
+    writer.setMessageType(DHCP_INFORM);                             // Left over from an earlier request
+    if (server.receivePacket(buffer) != 0) return testFailed();
+    if (!server.isValidRequest(buffer, size)) return testFailed();
+    writer.end();
+    out.buffer[out.length < sizeof(out.buffer) ? out.length : sizeof(out.buffer) - 1] = 0;
+    const char *trace = (const char *)out.buffer;
+    if (strstr(trace, "\"name\":\"receive\"") == NULL || getTraceMessageType(trace, "receive") != 0) return testFailed();
+    if (getTraceMessageType(trace, "validate") != DHCP_DISCOVER) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Get the message type of the first event of a stage in a trace, 0 if the stage is not there
+uint8_t DHCP_TESTER::getTraceMessageType(const char *trace, const char *stage) {
+    char name[24];
+    snprintf(name, sizeof(name), "\"name\":\"%s\"", stage);
+    const char *event = strstr(trace, name);
+    if (event == NULL) return 0;
+    const char *message_type = strstr(event, "\"message_type\":");
+    if (message_type == NULL) return 0;
+    return atoi(message_type + strlen("\"message_type\":"));
+}
+#endif
+
+// Run Server conflict probe tests
+bool DHCP_TESTER::runServerConflictProbeTests() {
+    Serial.println(F("      Server Conflict Probe Tests      "));
+    bool results = true;
+    _dhcp_server->setConflictProber(&test_prober);
+    if (!testProbeDefersOffer()) results = false;
+    if (!testProbeConflictQuarantine()) results = false;
+    if (!testProbeCache()) results = false;
+    _dhcp_server->setConflictProber(NULL);
+    return results;
+}
+
+// Test that an offer waits for its probe without blocking the server
+bool DHCP_TESTER::testProbeDefersOffer() {
+    Serial.print(F("Deferred Offer:  "));
+    test_prober.complete = false;
+    test_prober.probes = 0;
+    IPAddress candidate = _dhcp_server->getAddressFromPool();
+    DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(createTestRequest(DHCP_DISCOVER));
+    if (reply.op != DHCP_NO_REPLY) return testFailed();
+    if (test_prober.probes != 1 || test_prober.probed != candidate) return testFailed();
+    if (_dhcp_server->isAddressAvailable(candidate)) return testFailed();
+    // A retransmission joins the probe in flight
+    reply = _dhcp_server->parseDHCPRequest(createTestRequest(DHCP_DISCOVER));
+    if (reply.op != DHCP_NO_REPLY) return testFailed();
+    if (test_prober.probes != 1) return testFailed();
+    _dhcp_server->handleTimers(millis());
+    if (_dhcp_server->_leases[candidate[3] - 2].status != DHCP_LEASE_PROBING) return testFailed();
+    test_prober.complete = true;
+    _dhcp_server->handleTimers(millis());
+    if (_dhcp_server->_leases[candidate[3] - 2].status != DHCP_LEASE_OFFERED) return testFailed();
+    _dhcp_server->releaseAddress(candidate);
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that an answered probe quarantines the address and moves on to the next one
+bool DHCP_TESTER::testProbeConflictQuarantine() {
+    Serial.print(F("Quarantine:      "));
+    test_prober.complete = false;
+    test_prober.probes = 0;
+    IPAddress candidate = IPAddress(10, 0, 0, 20);
+    IPAddress next = _dhcp_server->getAddressFromPool();            // Probed clear by the previous test
+    test_prober.conflict = candidate;
+    uint8_t requested_ip[4] = {candidate[0], candidate[1], candidate[2], candidate[3]};
+    DHCP_MESSAGE request = createTestRequest(DHCP_DISCOVER, requested_ip, NULL);
+    DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(request);
+    if (reply.op != DHCP_NO_REPLY) return testFailed();
+    if (_dhcp_server->_leases[candidate[3] - 2].status != DHCP_LEASE_PROBING) return testFailed();
+    test_prober.complete = true;
+    _dhcp_server->handleTimers(millis());
+    if (_dhcp_server->_leases[candidate[3] - 2].status != DHCP_LEASE_QUARANTINED) return testFailed();
+    if (_dhcp_server->isAddressAvailable(candidate)) return testFailed();
+    if (test_prober.probes != 1) return testFailed();
+    if (_dhcp_server->_leases[next[3] - 2].status != DHCP_LEASE_OFFERED) return testFailed();
+    _dhcp_server->releaseAddress(next);
+    _dhcp_server->releaseAddress(candidate);
+    test_prober.conflict = DHCP_CLIENT_ADDRESS;
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that a recent clear probe lets the offer go out without probing again
+bool DHCP_TESTER::testProbeCache() {
+    Serial.print(F("Probe Cache:     "));
+    test_prober.complete = false;
+    test_prober.probes = 0;
+    IPAddress address = _dhcp_server->getAddressFromPool();         // Probed clear by the previous tests
+    DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(createTestRequest(DHCP_DISCOVER));
+    if (reply.op != DHCP_BOOTREPLY) return testFailed();
+    if (test_prober.probes != 0) return testFailed();
+    if (!(IPAddress(reply.yiaddr) == address)) return testFailed();
+    _dhcp_server->releaseAddress(address);
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Deliver every failover packet one server has for the other
+void DHCP_TESTER::exchangeFailover(DHCP_SERVER *from, DHCP_SERVER *to) {
+    uint8_t buffer[DHCP_FAILOVER_PACKET_SIZE];
+    uint16_t cursor = 0, length;
+    while ((length = from->createFailoverPacket(buffer, cursor, millis())) > 0) {
+        to->parseFailoverPacket(buffer, length, millis());
+    }
+}
+
+// Run Server failover tests, the two servers exchange packets through buffers instead of the network
+bool DHCP_TESTER::runServerFailoverTests() {
+    Serial.println(F("         Server Failover Tests         "));
+    bool results = true;
+    _failover_primary = new DHCP_SERVER(IPAddress(10, 0, 1, 1), 16);
+    _failover_standby = new DHCP_SERVER(IPAddress(10, 0, 1, 1), 16);
+    _failover_primary->enableFailover(IPAddress(127, 0, 0, 1), DHCP_FAILOVER_PRIMARY, 6470, 6471);
+    _failover_standby->enableFailover(IPAddress(127, 0, 0, 1), DHCP_FAILOVER_STANDBY, 6471, 6470);
+    if (!testFailoverReplication()) results = false;
+    if (!testFailoverSplitScope()) results = false;
+    if (!testFailoverDeltaResync()) results = false;
+    if (!testFailoverBulkResync()) results = false;
+    delete _failover_primary;
+    delete _failover_standby;
+#ifdef __linux__
+    if (!testFailoverSockets()) results = false;
+#endif
+    return results;
+}
+
+#ifdef __linux__
+// Test that an UPDATE and its acknowledgement travel over loopback between two servers on one host
+bool DHCP_TESTER::testFailoverSockets() {
+    Serial.print(F("Loopback:        "));
+    DHCP_SERVER primary(IPAddress(10, 0, 1, 1), 16);
+    DHCP_SERVER standby(IPAddress(10, 0, 1, 1), 16);
+    primary.setServerPort(6767);
+    standby.setServerPort(6768);
+    primary.enableFailover(IPAddress(127, 0, 0, 1), DHCP_FAILOVER_PRIMARY, 6474, 6475);
+    standby.enableFailover(IPAddress(127, 0, 0, 1), DHCP_FAILOVER_STANDBY, 6475, 6474);
+    IPAddress address = primary.assignAddress(DHCP_CLIENT_ADDRESS, 0x50C4E7);
+    unsigned long now = millis();
+    primary.handleTimers(now);                  // UPDATE goes out
+    standby.handleTimers(now);                  // Applied, the ACK goes back
+    primary.handleTimers(now);                  // ACK taken
+    int16_t index = standby.getPoolIndex(address);
+    if (standby._leases[index].status != DHCP_LEASE_BOUND || standby._leases[index].mac_crc != 0x50C4E7) return testFailed();
+    if (primary._failover_acked != primary._failover_seq) return testFailed();
+    if (standby.isServing()) return testFailed();                   // The primary was heard from
+    return testPassed(); // If we reached here then all the tests passed
+}
+#endif
+
+// Test that lease changes reach the standby and are acknowledged
+bool DHCP_TESTER::testFailoverReplication() {
+    Serial.print(F("Replication:     "));
+    IPAddress address = _failover_primary->assignAddress(DHCP_CLIENT_ADDRESS, 0x1234);
+    exchangeFailover(_failover_primary, _failover_standby);
+    exchangeFailover(_failover_standby, _failover_primary);
+    if (_failover_standby->isAddressAvailable(address)) return testFailed();
+    if (_failover_standby->_leases[address[3] - 2].mac_crc != 0x1234) return testFailed();
+    if (_failover_primary->_failover_acked != _failover_primary->_failover_seq) return testFailed();
+    _failover_primary->releaseAddress(address);
+    exchangeFailover(_failover_primary, _failover_standby);
+    exchangeFailover(_failover_standby, _failover_primary);
+    if (!_failover_standby->isAddressAvailable(address)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that each server allocates from its own half and the standby only answers while the primary is down
+bool DHCP_TESTER::testFailoverSplitScope() {
+    Serial.print(F("Split Scope:     "));
+    if (_failover_primary->getAddressFromPool() != IPAddress(10, 0, 1, 2)) return testFailed();
+    if (_failover_standby->getAddressFromPool() != IPAddress(10, 0, 1, 10)) return testFailed();
+    _failover_standby->_failover_last_heard = millis();
+    DHCP_MESSAGE reply = _failover_standby->parseDHCPRequest(createTestRequest(DHCP_DISCOVER));
+    if (reply.op != DHCP_NO_REPLY) return testFailed();
+    _failover_standby->_failover_last_heard = millis() - DHCP_FAILOVER_TIMEOUT;
+    reply = _failover_standby->parseDHCPRequest(createTestRequest(DHCP_DISCOVER));
+    if (reply.op != DHCP_BOOTREPLY) return testFailed();
+    if (IPAddress(reply.yiaddr) != IPAddress(10, 0, 1, 10)) return testFailed();
+    // Offers are not replicated, the lease is once the client claims it
+    DHCP_MESSAGE request = createTestRequest(DHCP_REQUEST, reply.yiaddr, reply.siaddr);
+    exchangeFailover(_failover_standby, _failover_primary);
+    if (!_failover_primary->isAddressAvailable(IPAddress(10, 0, 1, 10))) return testFailed();
+    reply = _failover_standby->parseDHCPRequest(request);
+    if (getDHCPMessageType(&reply) != DHCP_ACK) return testFailed();
+    // The standby's lease reaches the primary once the partition heals
+    exchangeFailover(_failover_standby, _failover_primary);
+    if (_failover_primary->isAddressAvailable(IPAddress(10, 0, 1, 10))) return testFailed();
+    _failover_standby->releaseAddress(IPAddress(10, 0, 1, 10));
+    exchangeFailover(_failover_standby, _failover_primary);
+    exchangeFailover(_failover_primary, _failover_standby);
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that a reconnecting peer only gets the changes after its last acknowledgement
+bool DHCP_TESTER::testFailoverDeltaResync() {
+    Serial.print(F("Delta Resync:    "));
+    uint32_t acked = _failover_primary->_failover_acked;
+    IPAddress addresses[3];
+    for (int i = 0; i < 3; i++) {
+        addresses[i] = _failover_primary->assignAddress(DHCP_CLIENT_ADDRESS, i);
+    }
+    uint8_t buffer[DHCP_FAILOVER_PACKET_SIZE];
+    uint16_t cursor = 0;
+    uint16_t length = _failover_primary->createFailoverPacket(buffer, cursor, millis());
+    if (buffer[4] != DHCP_FAILOVER_UPDATE) return testFailed();
+    if (buffer[5] != 3) return testFailed();
+    if (buffer[DHCP_FAILOVER_HEADER_SIZE + 3] != (uint8_t)(acked + 1)) return testFailed();
+    _failover_standby->parseFailoverPacket(buffer, length, millis());
+    exchangeFailover(_failover_standby, _failover_primary);
+    if (_failover_primary->_failover_acked != acked + 3) return testFailed();
+    for (int i = 0; i < 3; i++) {
+        if (_failover_standby->isAddressAvailable(addresses[i])) return testFailed();
+        _failover_primary->releaseAddress(addresses[i]);
+    }
+    exchangeFailover(_failover_primary, _failover_standby);
+    exchangeFailover(_failover_standby, _failover_primary);
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that a peer which fell further behind than the log gets the whole lease table
+bool DHCP_TESTER::testFailoverBulkResync() {
+    Serial.print(F("Bulk Resync:     "));
+    for (int i = 0; i < DHCP_FAILOVER_LOG_SIZE; i++) {
+        _failover_primary->releaseAddress(_failover_primary->assignAddress(DHCP_CLIENT_ADDRESS, i));
+    }
+    IPAddress kept = _failover_primary->assignAddress(DHCP_CLIENT_ADDRESS, 0xBEEF);
+    uint8_t buffer[DHCP_FAILOVER_PACKET_SIZE];
+    uint16_t cursor = 0;
+    _failover_primary->createFailoverPacket(buffer, cursor, millis());
+    if (buffer[4] != DHCP_FAILOVER_BULK) return testFailed();
+    exchangeFailover(_failover_primary, _failover_standby);
+    exchangeFailover(_failover_standby, _failover_primary);
+    if (_failover_standby->isAddressAvailable(kept)) return testFailed();
+    if (_failover_standby->_leases[kept[3] - 2].mac_crc != 0xBEEF) return testFailed();
+    if (_failover_primary->_failover_acked != _failover_primary->_failover_seq) return testFailed();
+    cursor = 0;
+    _failover_primary->createFailoverPacket(buffer, cursor, millis());
+    if (buffer[4] != DHCP_FAILOVER_UPDATE) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run Server lease snapshot tests
+bool DHCP_TESTER::runServerSnapshotTests() {
+    Serial.println(F("         Server Snapshot Tests         "));
+    bool results = true;
+    if (!testLeaseSnapshot()) results = false;
+    if (!testLeaseExportJSON()) results = false;
+    if (!testLeaseExportBinary()) results = false;
+    return results;
+}
+
+// Test that a snapshot holds the leases at the time it was taken
+bool DHCP_TESTER::testLeaseSnapshot() {
+    Serial.print(F("Snapshot:        "));
+    uint16_t bound = 0;
+    for (int i = 0; i < _dhcp_server->address_pool.range; i++) {
+        if (_dhcp_server->_leases[i].status != DHCP_LEASE_FREE) bound++;
+    }
+    uint32_t epoch = _dhcp_server->getSnapshotEpoch();
+    if (_dhcp_server->snapshotLeases() != bound) return testFailed();
+    if (_dhcp_server->getSnapshotEpoch() != epoch + 1) return testFailed();
+    DHCP_LEASE_INFO info;
+    if (!_dhcp_server->getSnapshotLease(0, info)) return testFailed();
+    if (IPAddress(info.address) != IPAddress(10, 0, 0, 2)) return testFailed();
+    if (info.status != DHCP_LEASE_BOUND) return testFailed();
+    // Changes after the snapshot do not show up in it
+    IPAddress address = _dhcp_server->assignAddress(DHCP_CLIENT_ADDRESS);
+    if (_dhcp_server->getSnapshotLease(bound, info)) return testFailed();
+    _dhcp_server->releaseAddress(address);
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that JSON slices concatenate into the same document as a whole export
+bool DHCP_TESTER::testLeaseExportJSON() {
+    Serial.print(F("Export JSON:     "));
+    uint16_t count = _dhcp_server->snapshotLeases();
+    DHCP_TEST_PRINT whole, slices;
+    _dhcp_server->exportLeasesJSON(whole);
+    for (uint16_t i = 0; i < count; i += 2) {
+        _dhcp_server->exportLeasesJSON(slices, i, 2);
+    }
+    if (whole.length == 0 || whole.length != slices.length) return testFailed();
+    if (memcmp(whole.buffer, slices.buffer, whole.length) != 0) return testFailed();
+    const char *start = "{\"epoch\":";
+    if (memcmp(whole.buffer, start, strlen(start)) != 0) return testFailed();
+    if (whole.buffer[whole.length - 2] != ']' || whole.buffer[whole.length - 1] != '}') return testFailed();
+    const char *key = "\"remaining\":";
+    size_t found = 0;
+    for (size_t i = 0; found < strlen(key) && i < whole.length; i++) {
+        found = (whole.buffer[i] == key[found]) ? found + 1 : (whole.buffer[i] == key[0] ? 1 : 0);
+    }
+    if (count > 0 && found != strlen(key)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test the binary export layout
+bool DHCP_TESTER::testLeaseExportBinary() {
+    Serial.print(F("Export Binary:   "));
+    uint16_t count = _dhcp_server->snapshotLeases();
+    DHCP_TEST_PRINT out;
+    size_t written = _dhcp_server->exportLeasesBinary(out);
+    if (written != (size_t)(DHCP_EXPORT_HEADER_SIZE + count * DHCP_EXPORT_RECORD_SIZE)) return testFailed();
+    if (out.buffer[0] != 'S' || out.buffer[3] != 'L') return testFailed();
+    if (((uint16_t)out.buffer[8] << 8 | out.buffer[9]) != count) return testFailed();
+    if (out.buffer[DHCP_EXPORT_HEADER_SIZE + 3] != 2) return testFailed();
+    if (out.buffer[DHCP_EXPORT_HEADER_SIZE + 4] != DHCP_LEASE_BOUND) return testFailed();
     return testPassed(); // If we reached here then all the tests passed
 }
 
-// Test reassignment of released addresses
-bool DHCP_TESTER::testAddressReassignment() {
-    Serial.print(F("Reassignment:    "));
-    IPAddress address = _dhcp_server->getAddressFromPool();
-    if (address != IPAddress(10, 0, 0, 4)) return testFailed();
-    address = _dhcp_server->assignAddress(address);
-    if (address != IPAddress(10, 0, 0, 4)) return testFailed();
+// Run Server allocation policy tests
+bool DHCP_TESTER::runServerAllocationPolicyTests() {
+    Serial.println(F("    Server Allocation Policy Tests     "));
+    bool results = true;
+    if (!testHashedAllocation()) results = false;
+    if (!testHashedCollision()) results = false;
+    return results;
+}
+
+// Test that a client lands on its hashed slot and gets it back after a release and on a restarted server
+bool DHCP_TESTER::testHashedAllocation() {
+    Serial.print(F("Hashed Slot:     "));
+    DHCP_SERVER server(IPAddress(10, 0, 3, 1), 20);
+    server.setAllocationPolicy(DHCP_ALLOCATE_HASHED);
+    IPAddress address = server.assignAddress(DHCP_CLIENT_ADDRESS, 0x5EED0001);
+    if (address != IPAddress(10, 0, 3, 19)) return testFailed();
+    server.releaseAddress(address);
+    server.assignAddress(DHCP_CLIENT_ADDRESS, 0x5EED0008);
+    if (server.assignAddress(DHCP_CLIENT_ADDRESS, 0x5EED0001) != address) return testFailed();
+    DHCP_SERVER restarted(IPAddress(10, 0, 3, 1), 20);
+    restarted.setAllocationPolicy(DHCP_ALLOCATE_HASHED);
+    if (restarted.assignAddress(DHCP_CLIENT_ADDRESS, 0x5EED0001) != address) return testFailed();
     return testPassed(); // If we reached here then all the tests passed
 }
 
-// Run Server message generation tests
-bool DHCP_TESTER::runServerMessageGenerationTests() {
-    Serial.println(F("    Server Message Generation Tests    "));
+// Test that a taken slot moves the client to the next free address, wrapping around within the scope
+bool DHCP_TESTER::testHashedCollision() {
+    Serial.print(F("Hashed Probe:    "));
+    DHCP_SERVER server(IPAddress(10, 0, 3, 1), 20);
+    server.setAllocationPolicy(DHCP_ALLOCATE_HASHED);
+    if (server.assignAddress(DHCP_CLIENT_ADDRESS, 0x5EED0003) != IPAddress(10, 0, 3, 21)) return testFailed();
+    server.assignAddress(IPAddress(10, 0, 3, 2), 0);
+    if (server.assignAddress(DHCP_CLIENT_ADDRESS, 0x5EED0003) != IPAddress(10, 0, 3, 3)) return testFailed();
+    server.setAllocationPolicy(DHCP_ALLOCATE_LOWEST);
+    if (server.assignAddress(DHCP_CLIENT_ADDRESS, 0x5EED0003) != IPAddress(10, 0, 3, 4)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run Server configuration tests
+bool DHCP_TESTER::runServerConfigurationTests() {
+    Serial.println(F("      Server Configuration Tests       "));
     bool results = true;
-    if (!testDHCPOFFERGeneration()) results = false;
-    if (!testDHCPACKGeneration()) results = false;
-    if (!testDHCPNAKGeneration()) results = false;
+    if (!testConfigReload()) results = false;
+    if (!testConfigReservation()) results = false;
     return results;
 }
 
-// Run Server DHCP OFFER generation test
-bool DHCP_TESTER::testDHCPOFFERGeneration() {
-    Serial.print(F("DHCP OFFER:      "));
-    DHCP_MESSAGE message = _dhcp_server->createDHCPReply(DHCP_OFFER, test_client_ip, test_xid);
-    // _dhcp_server->printDHCPMessage(message);
-    if (message.op != DHCP_BOOTREPLY) return testFailed();
-    if (message.htype != DHCP_ETHERNET) return testFailed();
-    if (message.hlen != 6) return testFailed();
-    if (message.hops != 0) return testFailed();
-    if (message.xid != test_xid) return testFailed();
-    if (message.secs != 0) return testFailed();
-    if (message.flags != DHCP_BROADCAST_FLAG) return testFailed();
+// Test that a reload swaps in the new pool and options, keeps shared leases and frees the old arrays later
+bool DHCP_TESTER::testConfigReload() {
+    Serial.print(F("Reload:          "));
+    DHCP_SERVER server(IPAddress(10, 0, 4, 1), 20);
+    IPAddress kept = server.assignAddress(IPAddress(10, 0, 4, 5), 0x5EED0001);
+    IPAddress dropped = server.assignAddress(IPAddress(10, 0, 4, 20), 0x5EED0002);
+    DHCP_SERVER_CONFIG config;
+    server.getConfig(config);
+    uint32_t version = server.getConfigVersion();
+    config.pool.range = 10;
+    config.router[0] = 10;
+    config.router[1] = 0;
+    config.router[2] = 4;
+    config.router[3] = 1;
+    if (!server.reloadConfig(config)) return testFailed();
+    if (server.getConfigVersion() != version + 1) return testFailed();
+    if (server.isAddressAvailable(kept)) return testFailed();
+    if (server._leases[server.getPoolIndex(kept)].mac_crc != 0x5EED0001) return testFailed();
+    if (server.getPoolIndex(dropped) >= 0) return testFailed();
+    if (server._retired_addresses == NULL) return testFailed();
+    server.handleTimers();
+    if (server._retired_addresses != NULL || server._retired_leases != NULL) return testFailed();
+    DHCP_MESSAGE reply = server.createDHCPReply(DHCP_OFFER, kept, test_xid);
+    int16_t opt_index = findDHCPOption(&reply, DHCP_ROUTER);
+    if (opt_index < 0 || reply.options[opt_index + 5] != 1) return testFailed();
+    server.assignAddressPool(IPAddress(10, 0, 4, 1), 40);
+    if (server.isAddressAvailable(kept)) return testFailed();
+    if (!server.isAddressAvailable(IPAddress(10, 0, 4, 41))) return testFailed();
+    if (server.snapshotLeases() != 1) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that a reserved address only goes to its client
+bool DHCP_TESTER::testConfigReservation() {
+    Serial.print(F("Reservation:     "));
+    DHCP_SERVER server(IPAddress(10, 0, 4, 1), 20);
+    DHCP_SERVER_CONFIG config;
+    server.getConfig(config);
+    config.reservation_count = 1;
+    config.reservations[0].client_key = 0x5EED0001;
+    config.reservations[0].address[0] = 10;
+    config.reservations[0].address[1] = 0;
+    config.reservations[0].address[2] = 4;
+    config.reservations[0].address[3] = 2;
+    if (!server.reloadConfig(config)) return testFailed();
+    if (server.assignAddress(DHCP_CLIENT_ADDRESS, 0x5EED0002) != IPAddress(10, 0, 4, 3)) return testFailed();
+    if (server.assignAddress(IPAddress(10, 0, 4, 2), 0x5EED0003) != IPAddress(10, 0, 4, 4)) return testFailed();
+    if (server.assignAddress(DHCP_CLIENT_ADDRESS, 0x5EED0001) != IPAddress(10, 0, 4, 2)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run extent allocator tests
+bool DHCP_TESTER::runExtentAllocatorTests() {
+    Serial.println(F("        Extent Allocator Tests         "));
+    bool results = true;
+    if (!testExtentAssign()) results = false;
+    if (!testExtentRelease()) results = false;
+    return results;
+}
+
+// Test assignment across a /8, memory follows the free runs rather than the range
+bool DHCP_TESTER::testExtentAssign() {
+    Serial.print(F("Extent Assign:   "));
+    DHCP_EXTENT_ALLOCATOR allocator(IPAddress(10, 0, 0, 0), 0x1000000UL);
+    if (allocator.assignAddress(DHCP_CLIENT_ADDRESS) != IPAddress(10, 0, 0, 0)) return testFailed();
+    if (allocator.assignAddress(DHCP_CLIENT_ADDRESS) != IPAddress(10, 0, 0, 1)) return testFailed();
+    if (allocator.getExtentCount() != 1) return testFailed();
+    if (allocator.assignAddress(IPAddress(10, 128, 0, 1)) != IPAddress(10, 128, 0, 1)) return testFailed();
+    if (allocator.assignAddress(IPAddress(10, 255, 255, 255)) != IPAddress(10, 255, 255, 255)) return testFailed();
+    if (allocator.getExtentCount() != 2) return testFailed();
+    if (allocator.isAddressAvailable(IPAddress(10, 128, 0, 1))) return testFailed();
+    if (!allocator.isAddressAvailable(IPAddress(10, 128, 0, 2))) return testFailed();
+    if (allocator.isAddressAvailable(IPAddress(11, 0, 0, 0))) return testFailed();
+    if (allocator.assignAddress(IPAddress(10, 128, 0, 1)) != IPAddress(10, 0, 0, 2)) return testFailed();
+    for (int i = 0; i < 20; i++) {
+        allocator.assignAddress(IPAddress(10, 1, 0, i * 2));
+    }
+    if (allocator.getExtentCount() != 22) return testFailed();
+    if (allocator.getAssignedCount() != 25) return testFailed();
+    uint32_t offset = 0;
+    if (!allocator.getFreeOffset(0x10000, offset) || offset != 0x10001) return testFailed();    // Skips 10.1.0.0
+    if (!allocator.getFreeOffset(0x10001, offset) || offset != 0x10001) return testFailed();
+    DHCP_EXTENT_ALLOCATOR small(IPAddress(10, 0, 0, 2), 2);
+    small.assignAddress(DHCP_CLIENT_ADDRESS);
+    small.assignAddress(DHCP_CLIENT_ADDRESS);
+    if (small.assignAddress(DHCP_CLIENT_ADDRESS) != DHCP_CLIENT_ADDRESS) return testFailed();
+    if (small.getFreeOffset(0, offset)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that released addresses merge back into the free runs around them
+bool DHCP_TESTER::testExtentRelease() {
+    Serial.print(F("Extent Release:  "));
+    DHCP_EXTENT_ALLOCATOR allocator(IPAddress(10, 0, 0, 0), 0x1000000UL);
+    for (int i = 0; i < 5; i++) {
+        allocator.assignAddress(IPAddress(10, 2, 0, i));
+    }
+    allocator.releaseAddress(IPAddress(10, 2, 0, 1));
+    allocator.releaseAddress(IPAddress(10, 2, 0, 3));
+    if (allocator.getExtentCount() != 4) return testFailed();
+    allocator.releaseAddress(IPAddress(10, 2, 0, 2));
+    if (allocator.getExtentCount() != 3) return testFailed();
+    if (allocator.releaseOffset(0x20001)) return testFailed();          // Already free
+    allocator.releaseAddress(IPAddress(10, 2, 0, 0));
+    allocator.releaseAddress(IPAddress(10, 2, 0, 4));
+    if (allocator.getExtentCount() != 1 || allocator.getAssignedCount() != 0) return testFailed();
+    if (allocator.getAddressFromPool() != IPAddress(10, 0, 0, 0)) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run Server renewal tests
+bool DHCP_TESTER::runServerRenewalTests() {
+    Serial.println(F("         Server Renewal Tests          "));
+    bool results = true;
+    if (!testRenewalFastPath()) results = false;
+    if (!testReplyDestination()) results = false;
+    if (!testReplyFlags()) results = false;
+    return results;
+}
+
+// Test that a renewal extends the client's own lease and is answered from the ACK template
+bool DHCP_TESTER::testRenewalFastPath() {
+    Serial.print(F("Renewal:         "));
+    DHCP_SERVER server(IPAddress(10, 0, 5, 1), 20);
+    DHCP_MESSAGE request = createTestRequest(DHCP_REQUEST);
+    server.setLeaseTime(5);
+    IPAddress address = server.assignAddress(IPAddress(10, 0, 5, 7), getDHCPClientKey(&request));
+    server.setLeaseTime(600);
     for (int i = 0; i < 4; i++) {
-        if (message.ciaddr[i] != 0) return testFailed();
-        if (message.yiaddr[i] != test_client_ip[i]) return testFailed();
-        if (message.siaddr[i] != test_server_ip[i]) return testFailed();
-        if (message.giaddr[i] != 0) return testFailed();
+        request.ciaddr[i] = address[i];
     }
+    DHCP_MESSAGE reply = server.parseDHCPRequest(request);
+    if (reply.op != DHCP_BOOTREPLY) return testFailed();
+    if (reply.options[2] != DHCP_ACK) return testFailed();
+    if (memcmp(reply.yiaddr, request.ciaddr, 4) != 0 || memcmp(reply.ciaddr, request.ciaddr, 4) != 0) return testFailed();
+    int16_t opt_index = findDHCPOption(&reply, DHCP_IP_LEASE_TIME);
+    if (opt_index < 0 || readUInt32(&reply.options[opt_index + 2]) != 600) return testFailed();
+    if ((long)(server._leases[server.getPoolIndex(address)].expires - millis()) < 500000L) return testFailed();
+    request.ciaddr[3] = 8;                          // No record of this lease, stay silent
+    if (server.parseDHCPRequest(request).op != DHCP_NO_REPLY) return testFailed();
+    request.ciaddr[3] = 7;
+    request.chaddr[5] ^= 0xFF;                      // Someone else's lease
+    reply = server.parseDHCPRequest(request);
+    if (reply.op != DHCP_BOOTREPLY || reply.options[2] != DHCP_NAK) return testFailed();
     return testPassed(); // If we reached here then all the tests passed
 }
 
-// Run Server DHCP ACK generation test
-bool DHCP_TESTER::testDHCPACKGeneration() {
-    Serial.print(F("DHCP ACK:        "));
+// Test that replies go to the relay agent, then to ciaddr, and are broadcast otherwise
+bool DHCP_TESTER::testReplyDestination() {
+    Serial.print(F("Destination:     "));
+    DHCP_MESSAGE reply = _dhcp_server->createDHCPReply(DHCP_ACK, test_client_ip, test_xid);
+    uint16_t port;
+    if (_dhcp_server->getReplyDestination(&reply, port) != DHCP_BROADCAST || port != DHCP_CLIENT_PORT) return testFailed();
+    for (int i = 0; i < 4; i++) {
+        reply.ciaddr[i] = test_client_ip[i];
+    }
+    if (_dhcp_server->getReplyDestination(&reply, port) != test_client_ip || port != DHCP_CLIENT_PORT) return testFailed();
+    reply.giaddr[0] = 10;
+    reply.giaddr[3] = 254;
+    if (_dhcp_server->getReplyDestination(&reply, port) != IPAddress(10, 0, 0, 254)) return testFailed();
+    if (port != DHCP_SERVER_PORT) return testFailed();
     return testPassed(); // If we reached here then all the tests passed
 }
 
-// Run Server DHCP NAK generation test
-bool DHCP_TESTER::testDHCPNAKGeneration() {
-    Serial.print(F("DHCP NAK:        "));
+// Test that the broadcast bit of a request read off the wire comes back in the same place on the replies answered
+// from the templates, an INFORM and a renewal
+bool DHCP_TESTER::testReplyFlags() {
+    Serial.print(F("Reply Flags:     "));
+    uint8_t packet[sizeof(DHCP_MESSAGE)];
+    DHCP_MESSAGE inform = _dhcp_client->createDHCPMessage(DHCP_INFORM, test_xid, test_client_ip);
+    DHCP_MESSAGE renewal = _dhcp_client->createDHCPMessage(DHCP_REQUEST, test_xid);
+    IPAddress address = _dhcp_server->assignAddress(DHCP_CLIENT_ADDRESS, getDHCPClientKey(&renewal));
+    for (int i = 0; i < 4; i++) {
+        renewal.ciaddr[i] = address[i];
+    }
+    DHCP_MESSAGE *requests[2] = {&inform, &renewal};
+    bool passed = true;
+    for (int i = 0; i < 2; i++) {
+        requests[i]->flags = DHCP_BROADCAST_FLAG;
+        serializeDHCPMessage(requests[i], packet, sizeof(packet));
+        if (packet[10] != 0x80 || packet[11] != 0) passed = false;
+        readDHCPHeader((DHCP_MESSAGE *)packet);                     // As handleRequest() does
+        DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(*(DHCP_MESSAGE *)packet);
+        if (getDHCPMessageType(&reply) != DHCP_ACK) passed = false;
+        serializeDHCPMessage(&reply, packet, sizeof(packet));
+        if (packet[10] != 0x80 || packet[11] != 0) passed = false;
+    }
+    _dhcp_server->releaseAddress(address);
+    if (!passed) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run Server priority scheduling tests
+bool DHCP_TESTER::runServerPrioritySchedulingTests() {
+    Serial.println(F("   Server Priority Scheduling Tests    "));
+    bool results = true;
+    if (!testPriorityOrder()) results = false;
+    if (!testPriorityDrops()) results = false;
+    return results;
+}
+
+// Test that REQUESTs are served first while DISCOVERs still get one turn per round
+bool DHCP_TESTER::testPriorityOrder() {
+    Serial.print(F("Priority Order:  "));
+    DHCP_SERVER server(IPAddress(10, 0, 6, 1), 20);
+    if (!server.enablePriorityScheduling(8)) return testFailed();
+    DHCP_MESSAGE discover = createTestRequest(DHCP_DISCOVER);
+    DHCP_MESSAGE inform = createTestRequest(DHCP_INFORM);
+    DHCP_MESSAGE request = createTestRequest(DHCP_REQUEST);
+    server.enqueueRequest((uint8_t *)&discover, 300);
+    server.enqueueRequest((uint8_t *)&discover, 301);
+    server.enqueueRequest((uint8_t *)&inform, 320);
+    for (int i = 0; i < 6; i++) {
+        server.enqueueRequest((uint8_t *)&request, 340 + i);
+    }
+    const uint8_t expected[9] = {DHCP_REQUEST, DHCP_REQUEST, DHCP_REQUEST, DHCP_REQUEST, DHCP_INFORM, DHCP_DISCOVER,
+                                 DHCP_REQUEST, DHCP_REQUEST, DHCP_DISCOVER};
+    const uint16_t expected_size[9] = {340, 341, 342, 343, 320, 300, 344, 345, 301};
+    uint16_t packet_size;
+    for (int i = 0; i < 9; i++) {
+        uint8_t *packet = server.dequeueRequest(packet_size);
+        if (packet == NULL || getDHCPMessageType((DHCP_MESSAGE *)packet) != expected[i]) return testFailed();
+        if (packet_size != expected_size[i]) return testFailed();
+    }
+    if (server.dequeueRequest(packet_size) != NULL) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that a full queue drops and counts only packets of its own class, and that depths whose queues would not
+// fit a 16 bit size_t are refused. The queues are drained directly so no replies are sent
+bool DHCP_TESTER::testPriorityDrops() {
+    Serial.print(F("Priority Drops:  "));
+    DHCP_SERVER server(IPAddress(10, 0, 6, 1), 20);
+    if (server.enablePriorityScheduling(DHCP_PRIORITY_MAX_DEPTH + 1)) return testFailed();
+    if (!server.enablePriorityScheduling(2)) return testFailed();
+    DHCP_MESSAGE discover = createTestRequest(DHCP_DISCOVER);
+    DHCP_MESSAGE request = createTestRequest(DHCP_REQUEST);
+    for (int i = 0; i < 5; i++) {
+        server.enqueueRequest((uint8_t *)&discover, sizeof(DHCP_MESSAGE));
+    }
+    if (!server.enqueueRequest((uint8_t *)&request, sizeof(DHCP_MESSAGE))) return testFailed();
+    if (server.getQueueDepth(DHCP_PRIORITY_DISCOVER) != 2 || server.getDropCount(DHCP_PRIORITY_DISCOVER) != 3) return testFailed();
+    if (server.getQueueDepth(DHCP_PRIORITY_REQUEST) != 1 || server.getDropCount(DHCP_PRIORITY_REQUEST) != 0) return testFailed();
+    unsigned long deadline;
+    if (!server.nextTimerDeadline(deadline) || (long)(deadline - millis()) > 0) return testFailed();
+    const uint8_t expected[3] = {DHCP_REQUEST, DHCP_DISCOVER, DHCP_DISCOVER};
+    uint16_t packet_size;
+    for (int i = 0; i < 3; i++) {
+        uint8_t *packet = server.dequeueRequest(packet_size);
+        if (packet == NULL || getDHCPMessageType((DHCP_MESSAGE *)packet) != expected[i]) return testFailed();
+    }
+    if (server.dequeueRequest(packet_size) != NULL) return testFailed();
+    if (server.getQueueDepth(DHCP_PRIORITY_DISCOVER) != 0 || server.getQueueDepth(DHCP_PRIORITY_REQUEST) != 0) return testFailed();
     return testPassed(); // If we reached here then all the tests passed
 }
 
@@ -654,6 +3837,7 @@ bool DHCP_TESTER::runServerParsingTests() {
     Serial.println(F("     Server Message Parsing Tests      "));
     bool results = true;
     if (!testDHCPDISCOVERParsing()) results = false;
+    if (!testRapidCommit()) results = false;
     if (!testDHCPINFORMParsing()) results = false;
     if (!testDHCPREQUESTParsing()) results = false;
     if (!testDHCPDECLINEParsing()) results = false;
@@ -667,15 +3851,73 @@ bool DHCP_TESTER::testDHCPDISCOVERParsing() {
     return testPassed(); // If we reached here then all the tests passed
 }
 
+// Test that a DISCOVER asking for Rapid Commit is bound and ACKed only where the server allows it
+bool DHCP_TESTER::testRapidCommit() {
+    Serial.print(F("Rapid Commit:    "));
+    DHCP_SERVER server(IPAddress(10, 0, 8, 1), 8);
+    uint8_t mac[] = {0x02, 0x52, 0x41, 0x50, 0x49, 0x44};
+    DHCP_CLIENT client(mac, 6);
+    DHCP_MESSAGE message = client.startExchange();
+    if (findDHCPOption(&message, DHCP_RAPID_COMMIT) < 0) return testFailed();
+    // Not allowed, the usual OFFER
+    DHCP_MESSAGE reply = server.parseDHCPRequest(message);
+    if (getDHCPMessageType(&reply) != DHCP_OFFER || findDHCPOption(&reply, DHCP_RAPID_COMMIT) >= 0) return testFailed();
+    // Allowed, the offer is committed and ACKed with Rapid Commit. The switch is a configuration reload
+    uint32_t version = server.getConfigVersion();
+    server.setRapidCommit(true);
+    if (!server.getRapidCommit() || server.getConfigVersion() != version + 1) return testFailed();
+    message = client.startExchange();
+    reply = server.parseDHCPRequest(message);
+    if (getDHCPMessageType(&reply) != DHCP_ACK || findDHCPOption(&reply, DHCP_RAPID_COMMIT) < 0) return testFailed();
+    IPAddress address = IPAddress(reply.yiaddr);
+    if (server._leases[server.getPoolIndex(address)].status != DHCP_LEASE_BOUND) return testFailed();
+    message = client.parseDHCPReply(&reply);
+    if (message.op != DHCP_NO_REPLY || client.getState() != DHCP_CLIENT_BOUND) return testFailed();
+    if (client.getAddress() != address) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
 // Run Server DHCP INFORM parsing test
 bool DHCP_TESTER::testDHCPINFORMParsing() {
     Serial.print(F("DHCP INFORM:     "));
+    DHCP_MESSAGE request = createTestRequest(DHCP_INFORM);
+    uint8_t client_ip[4] = {192, 168, 7, 20};                       // Statically addressed, outside the pool
+    memcpy(request.ciaddr, client_ip, 4);
+    uint16_t assigned = _dhcp_server->snapshotLeases();
+    DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(request);
+    if (reply.op != DHCP_BOOTREPLY) return testFailed();
+    if (reply.xid != test_xid) return testFailed();
+    if (getDHCPMessageType(&reply) != DHCP_ACK) return testFailed();
+    if (memcmp(reply.ciaddr, client_ip, 4) != 0) return testFailed();
+    if (readUInt32(reply.yiaddr) != 0) return testFailed();
+    if (findDHCPOption(&reply, DHCP_IP_LEASE_TIME) >= 0) return testFailed();
+    if (findDHCPOption(&reply, DHCP_SUBNET_MASK) < 0) return testFailed();
+    if (_dhcp_server->snapshotLeases() != assigned) return testFailed();
     return testPassed(); // If we reached here then all the tests passed
 }
 
 // Run Server DHCP REQUEST parsing test
 bool DHCP_TESTER::testDHCPREQUESTParsing() {
     Serial.print(F("DHCP REQUEST:    "));
+    DHCP_SERVER server(IPAddress(10, 0, 7, 1), 20);
+    DHCP_MESSAGE reply = server.parseDHCPRequest(createTestRequest(DHCP_DISCOVER));
+    IPAddress offered = IPAddress(reply.yiaddr);
+    if (server._leases[server.getPoolIndex(offered)].status != DHCP_LEASE_OFFERED) return testFailed();
+    DHCP_MESSAGE request = createTestRequest(DHCP_REQUEST, reply.yiaddr, reply.siaddr);
+    reply = server.parseDHCPRequest(request);
+    if (getDHCPMessageType(&reply) != DHCP_ACK || IPAddress(reply.yiaddr) != offered) return testFailed();
+    if (server._leases[server.getPoolIndex(offered)].status != DHCP_LEASE_BOUND) return testFailed();
+    // Someone else's address is refused
+    request.chaddr[5] ^= 0xFF;
+    reply = server.parseDHCPRequest(request);
+    if (getDHCPMessageType(&reply) != DHCP_NAK) return testFailed();
+    // A client that chose another server gives its offer back
+    reply = server.parseDHCPRequest(createTestRequest(DHCP_DISCOVER));
+    offered = IPAddress(reply.yiaddr);
+    uint8_t other_server[4] = {10, 0, 7, 254};
+    request = createTestRequest(DHCP_REQUEST, reply.yiaddr, other_server);
+    if (server.parseDHCPRequest(request).op != DHCP_NO_REPLY) return testFailed();
+    if (!server.isAddressAvailable(offered)) return testFailed();
     return testPassed(); // If we reached here then all the tests passed
 }
 
@@ -697,6 +3939,8 @@ bool DHCP_TESTER::runClientTests() {
     bool results = true;
     if (!runClientMessageGenerationTests()) results = false;
     if (!runClientParsingTests()) results = false;
+    if (!runClientLeaseCacheTests()) results = false;
+    if (!runClientRenewalTests()) results = false;
     return results;
 }
 
@@ -727,6 +3971,15 @@ bool DHCP_TESTER::testDHCPINFORMGeneration() {
 // Run Client DHCP REQUEST generation test
 bool DHCP_TESTER::testDHCPREQUESTGeneration() {
     Serial.print(F("DHCP REQUEST:    "));
+    DHCP_MESSAGE message = _dhcp_client->createDHCPMessage(DHCP_REQUEST, test_xid, test_client_ip);
+    if (message.op != DHCP_BOOTREQUEST || message.xid != test_xid) return testFailed();
+    if (getDHCPMessageType(&message) != DHCP_REQUEST) return testFailed();
+    int16_t opt_index = findDHCPOption(&message, DHCP_REQUESTED_IP);
+    if (opt_index < 0 || message.options[opt_index + 1] != 4) return testFailed();
+    for (int i = 0; i < 4; i++) {
+        if (message.options[opt_index + 2 + i] != test_client_ip[i]) return testFailed();
+        if (message.ciaddr[i] != 0) return testFailed();
+    }
     return testPassed(); // If we reached here then all the tests passed
 }
 
@@ -739,6 +3992,12 @@ bool DHCP_TESTER::testDHCPDECLINEGeneration() {
 // Run Client DHCP RELEASE generation test
 bool DHCP_TESTER::testDHCPRELEASEGeneration() {
     Serial.print(F("DHCP RELEASE:    "));
+    DHCP_MESSAGE message = _dhcp_client->createDHCPMessage(DHCP_RELEASE, test_xid, test_client_ip);
+    if (getDHCPMessageType(&message) != DHCP_RELEASE) return testFailed();
+    if (findDHCPOption(&message, DHCP_REQUESTED_IP) >= 0) return testFailed();
+    for (int i = 0; i < 4; i++) {
+        if (message.ciaddr[i] != test_client_ip[i]) return testFailed();
+    }
     return testPassed(); // If we reached here then all the tests passed
 }
 
@@ -768,4 +4027,803 @@ bool DHCP_TESTER::testDHCPACKParsing() {
 bool DHCP_TESTER::testDHCPNAKParsing() {
     Serial.print(F("DHCP NAK:        "));
     return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run Client lease cache tests
+bool DHCP_TESTER::runClientLeaseCacheTests() {
+    Serial.println(F("       Client Lease Cache Tests        "));
+    bool results = true;
+    if (!testLeaseCacheReboot()) results = false;
+    if (!testLeaseCacheFallback()) results = false;
+    return results;
+}
+
+// Test that a restarted client gets its cached lease back with a single REQUEST
+bool DHCP_TESTER::testLeaseCacheReboot() {
+    Serial.print(F("Init Reboot:     "));
+    DHCP_SERVER server(IPAddress(10, 0, 1, 1), 8);
+    DHCP_TEST_LEASE_STORE store;
+    uint8_t mac[] = {0x02, 0x4C, 0x45, 0x41, 0x53, 0x45};
+    DHCP_CLIENT first(mac, 6);
+    first.setLeaseStore(&store);
+    // Nothing cached, full exchange
+    DHCP_MESSAGE message = first.startExchange();
+    if (getDHCPMessageType(&message) != DHCP_DISCOVER) return testFailed();
+    DHCP_MESSAGE reply = server.parseDHCPRequest(message);
+    message = first.parseDHCPReply(&reply);
+    if (first.getState() != DHCP_CLIENT_REQUESTING || findDHCPOption(&message, DHCP_SERVER_IDENTIFIER) < 0) return testFailed();
+    reply = server.parseDHCPRequest(message);
+    message = first.parseDHCPReply(&reply);
+    if (first.getState() != DHCP_CLIENT_BOUND || message.op != DHCP_NO_REPLY || !store.saved) return testFailed();
+    IPAddress address = first.getAddress();
+    // Restart, the cached address is requested straight away and without a server identifier
+    DHCP_CLIENT second(mac, 6);
+    second.setLeaseStore(&store);
+    message = second.startExchange();
+    if (second.getState() != DHCP_CLIENT_REBOOTING || getDHCPMessageType(&message) != DHCP_REQUEST) return testFailed();
+    if (findDHCPOption(&message, DHCP_SERVER_IDENTIFIER) >= 0) return testFailed();
+    reply = server.parseDHCPRequest(message);
+    if (getDHCPMessageType(&reply) != DHCP_ACK) return testFailed();
+    message = second.parseDHCPReply(&reply);
+    if (second.getState() != DHCP_CLIENT_BOUND || message.op != DHCP_NO_REPLY) return testFailed();
+    if (second.getAddress() != address || second.getServerAddress() != IPAddress(10, 0, 1, 1)) return testFailed();
+    if (second.getLeaseTime() != server.getLeaseTime()) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that a NAKed or corrupt lease cache falls back to a full exchange
+bool DHCP_TESTER::testLeaseCacheFallback() {
+    Serial.print(F("Reboot NAK:      "));
+    DHCP_SERVER server(IPAddress(10, 0, 1, 1), 8);
+    DHCP_TEST_LEASE_STORE store;
+    uint8_t mac[] = {0x02, 0x4C, 0x45, 0x41, 0x53, 0x45};
+    DHCP_CLIENT owner(mac, 6);
+    owner.setLeaseStore(&store);
+    DHCP_MESSAGE message = owner.startExchange();
+    DHCP_MESSAGE reply = server.parseDHCPRequest(message);
+    message = owner.parseDHCPReply(&reply);
+    reply = server.parseDHCPRequest(message);
+    owner.parseDHCPReply(&reply);
+    if (owner.getState() != DHCP_CLIENT_BOUND) return testFailed();
+    // Another client restarting with this cache asks for an address the server has bound to someone else
+    mac[5] ^= 0xFF;
+    DHCP_CLIENT other(mac, 6);
+    other.setLeaseStore(&store);
+    message = other.startExchange();
+    if (other.getState() != DHCP_CLIENT_REBOOTING) return testFailed();
+    reply = server.parseDHCPRequest(message);
+    if (getDHCPMessageType(&reply) != DHCP_NAK) return testFailed();
+    message = other.parseDHCPReply(&reply);
+    if (other.getState() != DHCP_CLIENT_SELECTING || getDHCPMessageType(&message) != DHCP_DISCOVER) return testFailed();
+    if (other.loadLease()) return testFailed();
+    // A cache that fails its checksum is ignored
+    owner.saveLease();
+    store.cache[4] ^= 0x01;
+    message = other.startExchange();
+    if (other.getState() != DHCP_CLIENT_SELECTING || getDHCPMessageType(&message) != DHCP_DISCOVER) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Run Client renewal tests
+bool DHCP_TESTER::runClientRenewalTests() {
+    Serial.println(F("         Client Renewal Tests          "));
+    bool results = true;
+    if (!testClientRenewing()) results = false;
+    if (!testClientRebinding()) results = false;
+    return results;
+}
+
+// Test that the client asks the server that granted its lease to extend it at T1, and that the server takes the
+// REQUEST down its renewal fast path
+bool DHCP_TESTER::testClientRenewing() {
+    Serial.print(F("Renewing:        "));
+    DHCP_SERVER server(IPAddress(10, 0, 1, 1), 8);
+    server.setLeaseTime(1000);
+    uint8_t mac[] = {0x02, 0x52, 0x45, 0x4E, 0x45, 0x57};
+    DHCP_CLIENT client(mac, 6);
+    bindTestClient(&server, &client);
+    if (client.getState() != DHCP_CLIENT_BOUND) return testFailed();
+    IPAddress address = client.getAddress();
+    unsigned long bound_at = client._bound_at;
+    client.handleTimers(bound_at + 499000UL);
+    if (client.getState() != DHCP_CLIENT_BOUND) return testFailed();
+    client.handleTimers(bound_at + 500000UL);                       // T1 is half the lease
+    if (client.getState() != DHCP_CLIENT_RENEWING || client.getAddress() != address) return testFailed();
+    if (client.getDestination() != IPAddress(10, 0, 1, 1)) return testFailed();
+    if (client.getRenewRetryTime(bound_at + 500000UL) != 187500UL) return testFailed();
+    if (client.getRenewRetryTime(bound_at + 870000UL) != DHCP_CLIENT_RENEW_RETRY_TIME) return testFailed();
+    DHCP_MESSAGE message = client.createStateMessage();
+    if (getDHCPMessageType(&message) != DHCP_REQUEST || !server.isRenewal(&message)) return testFailed();
+    if (IPAddress(message.ciaddr[0], message.ciaddr[1], message.ciaddr[2], message.ciaddr[3]) != address) return testFailed();
+    DHCP_MESSAGE reply = server.parseDHCPRequest(message);
+    if (getDHCPMessageType(&reply) != DHCP_ACK) return testFailed();
+    message = client.parseDHCPReply(&reply);
+    if (client.getState() != DHCP_CLIENT_BOUND || message.op != DHCP_NO_REPLY) return testFailed();
+    if (client.getAddress() != address || client.getLeaseTime() != 1000) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that the client broadcasts its REQUEST at T2, and starts over on a NAK or once the lease runs out
+bool DHCP_TESTER::testClientRebinding() {
+    Serial.print(F("Rebinding:       "));
+    DHCP_SERVER server(IPAddress(10, 0, 1, 1), 8);
+    server.setLeaseTime(1000);
+    uint8_t mac[] = {0x02, 0x52, 0x45, 0x42, 0x49, 0x4E};
+    DHCP_CLIENT client(mac, 6);
+    bindTestClient(&server, &client);
+    IPAddress address = client.getAddress();
+    client.handleTimers(client._bound_at + 875000UL);               // T2 is seven eighths of the lease
+    if (client.getState() != DHCP_CLIENT_REBINDING || client.getDestination() != DHCP_BROADCAST) return testFailed();
+    DHCP_MESSAGE message = client.createStateMessage();
+    DHCP_MESSAGE reply = server.parseDHCPRequest(message);
+    message = client.parseDHCPReply(&reply);
+    if (client.getState() != DHCP_CLIENT_BOUND || client.getAddress() != address) return testFailed();
+    // The lease runs out with nobody answering
+    client.handleTimers(client._bound_at + 875000UL);
+    client.handleTimers(client._bound_at + 1000000UL);
+    if (client.getState() != DHCP_CLIENT_SELECTING || client.getAddress() != DHCP_CLIENT_ADDRESS) return testFailed();
+    // The server has given the address to someone else in the meantime
+    bindTestClient(&server, &client);
+    address = client.getAddress();
+    server.releaseAddress(address);
+    server.assignAddress(address, 0x1234);
+    client.handleTimers(client._bound_at + 875000UL);
+    message = client.createStateMessage();
+    reply = server.parseDHCPRequest(message);
+    if (getDHCPMessageType(&reply) != DHCP_NAK) return testFailed();
+    message = client.parseDHCPReply(&reply);
+    if (client.getState() != DHCP_CLIENT_SELECTING || getDHCPMessageType(&message) != DHCP_DISCOVER) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Take a client through a full exchange with a server
+void DHCP_TESTER::bindTestClient(DHCP_SERVER *server, DHCP_CLIENT *client) {
+    DHCP_MESSAGE message = client->startDiscovery();
+    DHCP_MESSAGE reply = server->parseDHCPRequest(message);
+    message = client->parseDHCPReply(&reply);
+    reply = server->parseDHCPRequest(message);
+    client->parseDHCPReply(&reply);
+}
+
+// Run Relay tests
+bool DHCP_TESTER::runRelayTests() {
+    Serial.println(F("********** DHCP Relay Tests ***********"));
+    bool results = true;
+    if (!testRelayRequest()) results = false;
+    if (!testRelayReply()) results = false;
+    return results;
+}
+
+// Test that a relayed request carries the hop, giaddr and option 82, and that a server answers it through the relay
+bool DHCP_TESTER::testRelayRequest() {
+    Serial.print(F("Relay Request:   "));
+    DHCP_RELAY relay(IPAddress(10, 0, 10, 1));
+    const uint8_t circuit_id[] = {'p', 'o', 'r', 't', '1'};
+    relay.setCircuitId(circuit_id, sizeof(circuit_id));
+    uint8_t packet[sizeof(DHCP_MESSAGE)];
+    DHCP_MESSAGE message = createTestRequest(DHCP_DISCOVER);
+    uint16_t size = serializeDHCPMessage(&message, packet, sizeof(packet));
+    size = relay.relayRequest(packet, size);
+    if (size < DHCP_MIN_PACKET_SIZE) return testFailed();
+    DHCP_MESSAGE *relayed = (DHCP_MESSAGE *)packet;
+    if (relayed->hops != 1 || relayed->giaddr[0] != 10 || relayed->giaddr[2] != 10) return testFailed();
+    int16_t opt_index = findDHCPOption(relayed, DHCP_RELAY_AGENT_INFORMATION);
+    if (opt_index < 0 || relayed->options[opt_index + 1] != 2 + sizeof(circuit_id)) return testFailed();
+    if (relayed->options[opt_index + 2] != DHCP_AGENT_CIRCUIT_ID) return testFailed();
+    if (memcmp(&relayed->options[opt_index + 4], circuit_id, sizeof(circuit_id)) != 0) return testFailed();
+    if (getDHCPMessageType(relayed) != DHCP_DISCOVER) return testFailed();
+    // The server answers through the relay
+    DHCP_SERVER server(IPAddress(10, 0, 11, 1), 8);
+    DHCP_MESSAGE reply = server.parseDHCPRequest(*relayed);
+    uint16_t port;
+    if (server.getReplyDestination(&reply, port) != IPAddress(10, 0, 10, 1) || port != DHCP_SERVER_PORT) return testFailed();
+    // A second relay leaves giaddr alone, and the hop limit holds
+    size = relay.relayRequest(packet, size);
+    if (size == 0 || relayed->hops != 2 || relayed->giaddr[2] != 10) return testFailed();
+    relayed->hops = DHCP_RELAY_MAX_HOPS;
+    if (relay.relayRequest(packet, size) != 0) return testFailed();
+    // A client that sends its own option 82 is not trusted
+    message = createTestRequest(DHCP_DISCOVER);
+    opt_index = findDHCPOptionsEnd(&message);
+    opt_index = addDHCPOption(message.options, opt_index, DHCP_RELAY_AGENT_INFORMATION, sizeof(circuit_id), circuit_id);
+    message.options[opt_index] = DHCP_END;
+    size = serializeDHCPMessage(&message, packet, sizeof(packet));
+    if (relay.relayRequest(packet, size) != 0) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// Test that a reply loses option 82 and goes back to the client the way it can receive it
+bool DHCP_TESTER::testRelayReply() {
+    Serial.print(F("Relay Reply:     "));
+    DHCP_RELAY relay(IPAddress(10, 0, 10, 1));
+    const uint8_t circuit_id[] = {DHCP_AGENT_CIRCUIT_ID, 3, 'p', 'o', 'r'};
+    uint8_t giaddr[4] = {10, 0, 10, 1};
+    uint8_t packet[sizeof(DHCP_MESSAGE)];
+    DHCP_MESSAGE reply = _dhcp_server->createDHCPReply(DHCP_OFFER, test_client_ip, test_xid);
+    memcpy(reply.giaddr, giaddr, 4);
+    int16_t opt_index = findDHCPOptionsEnd(&reply);
+    opt_index = addDHCPOption(reply.options, opt_index, DHCP_RELAY_AGENT_INFORMATION, sizeof(circuit_id), circuit_id);
+    reply.options[opt_index] = DHCP_END;
+    uint16_t size = serializeDHCPMessage(&reply, packet, sizeof(packet));
+    IPAddress destination;
+    uint16_t relayed_size = relay.relayReply(packet, size, destination);
+    if (relayed_size != size || destination != DHCP_BROADCAST) return testFailed();
+    DHCP_MESSAGE *relayed = (DHCP_MESSAGE *)packet;
+    if (findDHCPOption(relayed, DHCP_RELAY_AGENT_INFORMATION) >= 0) return testFailed();
+    if (getDHCPMessageType(relayed) != DHCP_OFFER || findDHCPOption(relayed, DHCP_IP_LEASE_TIME) < 0) return testFailed();
+    // A renewing client is answered directly
+    reply = _dhcp_server->createDHCPReply(DHCP_ACK, test_client_ip, test_xid);
+    memcpy(reply.giaddr, giaddr, 4);
+    reply.flags = 0;
+    for (int i = 0; i < 4; i++) {
+        reply.ciaddr[i] = test_client_ip[i];
+    }
+    size = serializeDHCPMessage(&reply, packet, sizeof(packet));
+    if (relay.relayReply(packet, size, destination) == 0 || destination != test_client_ip) return testFailed();
+    // Replies for another relay are not ours to send
+    packet[24 + 3] = 2;
+    if (relay.relayReply(packet, size, destination) != 0) return testFailed();
+    return testPassed(); // If we reached here then all the tests passed
+}
+
+// ********** DHCP BENCHMARK **********
+
+DHCP_BENCHMARK::DHCP_BENCHMARK() {
+    uint8_t bench_client_mac[] = {0x02, 0xBE, 0x4C, 0x00, 0x00, 0x01};
+    _dhcp_server = new DHCP_SERVER(IPAddress(10, 0, 0, 1), DHCP_BENCH_POOL_SIZE);
+    _dhcp_client = new DHCP_CLIENT(bench_client_mac, 6);
+    _iterations = DHCP_BENCH_DEFAULT_ITERATIONS;
+    _allocations = NULL;
+    _baseline = NULL;
+    _baseline_count = 0;
+    _threshold = DHCP_BENCH_DEFAULT_THRESHOLD;
+}
+
+DHCP_BENCHMARK::DHCP_BENCHMARK(uint16_t iterations) : DHCP_BENCHMARK() {
+    if (iterations > 0) _iterations = iterations;
+}
+
+DHCP_BENCHMARK::~DHCP_BENCHMARK() {
+    delete _dhcp_server;
+    delete _dhcp_client;
+}
+
+// Count allocations with a counter the sketch increments from its operator new
+void DHCP_BENCHMARK::setAllocationCounter(const volatile uint32_t *allocations) {
+    _allocations = allocations;
+}
+
+// Set the results to compare against, a result slower than its baseline by more than threshold percent fails the run
+void DHCP_BENCHMARK::setBaseline(const DHCP_BENCH_RESULT *baseline, uint8_t count, uint8_t threshold) {
+    _baseline = baseline;
+    _baseline_count = count;
+    _threshold = threshold;
+}
+
+// Get the current allocation count, always 0 without a counter
+uint32_t DHCP_BENCHMARK::getAllocations() {
+    if (_allocations == NULL) return 0;
+    return *_allocations;
+}
+
+// Bind fill percent of the pool, lowest addresses first
+void DHCP_BENCHMARK::fillPool(uint8_t fill) {
+    uint8_t range = _dhcp_server->address_pool.range;
+    for (int i = 0; i < range; i++) {
+        _dhcp_server->releaseAddress(_dhcp_server->getPoolAddress(i));
+    }
+    uint16_t bound = (uint16_t)range * fill / 100;
+    for (int i = 0; i < bound; i++) {
+        _dhcp_server->assignAddress(_dhcp_server->getPoolAddress(i), i);
+    }
+}
+
+// DISCOVER with the options a typical desktop client sends
+DHCP_MESSAGE DHCP_BENCHMARK::createDiscover() {
+    DHCP_MESSAGE message = _dhcp_client->createDHCPMessage(DHCP_DISCOVER, 0x3903F326);
+    uint8_t client_id[7] = {DHCP_ETHERNET, 0x02, 0xBE, 0x4C, 0x00, 0x00, 0x01};
+    uint8_t max_size[2] = {0x05, 0xDC};
+    uint8_t parameters[10] = {DHCP_SUBNET_MASK, DHCP_ROUTER, DHCP_DNS_NAME_SERVER, DHCP_HOST_NAME, DHCP_DOMAIN_NAME,
+                              DHCP_BROADCAST_ADDRESS, DHCP_NTP_SERVERS, DHCP_IP_LEASE_TIME, DHCP_RENEWAL_TIME_VALUE,
+                              DHCP_REBINDING_TIME_VALUE};
+    const char *host_name = "bench-host";
+    const char *vendor = "MSFT 5.0";
+    uint16_t opt_index = 3;
+    opt_index = addDHCPOption(message.options, opt_index, DHCP_CLIENT_IDENTIFIER, 7, client_id);
+    opt_index = addDHCPOption(message.options, opt_index, DHCP_MAX_MESSAGE_SIZE, 2, max_size);
+    opt_index = addDHCPOption(message.options, opt_index, DHCP_HOST_NAME, strlen(host_name), (const uint8_t *)host_name);
+    opt_index = addDHCPOption(message.options, opt_index, DHCP_VENDOR_CLASS_IDENTIFIER, strlen(vendor), (const uint8_t *)vendor);
+    opt_index = addDHCPOption(message.options, opt_index, DHCP_PARAMETER_REQUEST_LIST, 10, parameters);
+    message.options[opt_index] = DHCP_END;
+    return message;
+}
+
+// REQUEST in the SELECTING state for an offered address with the options a typical desktop client sends
+DHCP_MESSAGE DHCP_BENCHMARK::createRequest(IPAddress offered) {
+    DHCP_MESSAGE message = createDiscover();
+    message.options[2] = DHCP_REQUEST;
+    uint8_t requested_ip[4] = {offered[0], offered[1], offered[2], offered[3]};
+    uint8_t server_id[4] = {_dhcp_server->SERVER_ADDRESS[0], _dhcp_server->SERVER_ADDRESS[1],
+                            _dhcp_server->SERVER_ADDRESS[2], _dhcp_server->SERVER_ADDRESS[3]};
+    uint16_t opt_index = 0;
+    while (message.options[opt_index] != DHCP_END) opt_index += 2 + message.options[opt_index + 1];
+    opt_index = addDHCPOption(message.options, opt_index, DHCP_REQUESTED_IP, 4, requested_ip);
+    opt_index = addDHCPOption(message.options, opt_index, DHCP_SERVER_IDENTIFIER, 4, server_id);
+    message.options[opt_index] = DHCP_END;
+    return message;
+}
+
+// Print a result as a DHCP_BENCH_RESULT initializer and check it against the baseline, returns false if it regressed.
+// Allocations and the baseline comparison follow in a comment so the line can be pasted into a baseline table as is.
+// elapsed is the fastest of the DHCP_BENCH_REPEATS runs and allocations are counted over all of them
+bool DHCP_BENCHMARK::report(Print &out, const char *name, uint8_t fill, unsigned long elapsed, uint32_t allocations) {
+    uint32_t ns_per_op = (uint32_t)((elapsed * 1000.0) / _iterations);
+    bool passed = true;
+    out.print(F("    {\""));
+    out.print(name);
+    out.print(F("\", "));
+    out.print(fill);
+    out.print(F(", "));
+    out.print(ns_per_op);
+    out.print(F("},  // allocs_per_op "));
+    out.print((double)allocations / ((uint32_t)_iterations * DHCP_BENCH_REPEATS), 3);
+    const DHCP_BENCH_RESULT *baseline = NULL;
+    for (int i = 0; i < _baseline_count; i++) {
+        if (_baseline[i].fill == fill && strcmp(_baseline[i].name, name) == 0) baseline = &_baseline[i];
+    }
+    if (baseline == NULL) {
+        out.println(F(", new"));
+        return true;
+    }
+    out.print(F(", baseline "));
+    out.print(baseline->ns_per_op);
+    if ((uint64_t)ns_per_op * 100 > (uint64_t)baseline->ns_per_op * (100 + _threshold)) {
+        passed = false;
+        out.println(F(", REGRESSED"));
+    } else {
+        out.println(F(", ok"));
+    }
+    return passed;
+}
+
+// Check a benchmark exercises the path it is named after, a reply of the wrong type is reported and fails the run
+bool DHCP_BENCHMARK::expectReply(Print &out, const char *name, uint8_t fill, DHCP_MESSAGE *reply, uint8_t type) {
+    if (reply->op == DHCP_BOOTREPLY && getDHCPMessageType(reply) == type) return true;
+    out.print(F("    // "));
+    out.print(name);
+    out.print(F(" at "));
+    out.print(fill);
+    out.println(F("% fill got the wrong reply, not measured"));
+    return false;
+}
+
+// parseDHCPRequest() for a DISCOVER, the offered address is released again so the pool fill stays put
+bool DHCP_BENCHMARK::benchParseDiscover(Print &out, uint8_t fill) {
+    fillPool(fill);
+    DHCP_MESSAGE request = createDiscover();
+    uint32_t allocations = getAllocations();
+    unsigned long elapsed = 0;
+    for (uint8_t repeat = 0; repeat < DHCP_BENCH_REPEATS; repeat++) {
+        unsigned long started = micros();
+        for (uint16_t i = 0; i < _iterations; i++) {
+            DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(request);
+            _dhcp_server->releaseAddress(IPAddress(reply.yiaddr));
+        }
+        unsigned long time = micros() - started;
+        if (repeat == 0 || time < elapsed) elapsed = time;
+    }
+    return report(out, "parse_discover", fill, elapsed, getAllocations() - allocations);
+}
+
+// parseDHCPRequest() for a REQUEST of an offered address, after the first ACK the lease stays bound to the client
+// so every iteration takes the same ACK path
+bool DHCP_BENCHMARK::benchParseRequest(Print &out, uint8_t fill) {
+    fillPool(fill);
+    DHCP_MESSAGE offer = _dhcp_server->parseDHCPRequest(createDiscover());
+    if (!expectReply(out, "parse_request", fill, &offer, DHCP_OFFER)) return false;
+    DHCP_MESSAGE request = createRequest(IPAddress(offer.yiaddr));
+    DHCP_MESSAGE ack = _dhcp_server->parseDHCPRequest(request);
+    if (!expectReply(out, "parse_request", fill, &ack, DHCP_ACK)) return false;
+    uint32_t allocations = getAllocations();
+    unsigned long elapsed = 0;
+    for (uint8_t repeat = 0; repeat < DHCP_BENCH_REPEATS; repeat++) {
+        unsigned long started = micros();
+        for (uint16_t i = 0; i < _iterations; i++) {
+            DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(request);
+            (void)reply;
+        }
+        unsigned long time = micros() - started;
+        if (repeat == 0 || time < elapsed) elapsed = time;
+    }
+    return report(out, "parse_request", fill, elapsed, getAllocations() - allocations);
+}
+
+// parseDHCPRequest() for a renewal of a lease the client holds
+bool DHCP_BENCHMARK::benchParseRenewal(Print &out, uint8_t fill) {
+    fillPool(fill);
+    DHCP_MESSAGE request = createDiscover();
+    request.options[2] = DHCP_REQUEST;
+    IPAddress address = _dhcp_server->assignAddress(DHCP_CLIENT_ADDRESS, getDHCPClientKey(&request));
+    for (int i = 0; i < 4; i++) {
+        request.ciaddr[i] = address[i];
+    }
+    DHCP_MESSAGE ack = _dhcp_server->parseDHCPRequest(request);
+    if (!expectReply(out, "parse_renewal", fill, &ack, DHCP_ACK)) return false;
+    uint32_t allocations = getAllocations();
+    unsigned long elapsed = 0;
+    for (uint8_t repeat = 0; repeat < DHCP_BENCH_REPEATS; repeat++) {
+        unsigned long started = micros();
+        for (uint16_t i = 0; i < _iterations; i++) {
+            DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(request);
+            (void)reply;
+        }
+        unsigned long time = micros() - started;
+        if (repeat == 0 || time < elapsed) elapsed = time;
+    }
+    return report(out, "parse_renewal", fill, elapsed, getAllocations() - allocations);
+}
+
+// createDHCPReply() for an OFFER
+bool DHCP_BENCHMARK::benchCreateReply(Print &out, uint8_t fill) {
+    fillPool(fill);
+    uint32_t allocations = getAllocations();
+    unsigned long elapsed = 0;
+    for (uint8_t repeat = 0; repeat < DHCP_BENCH_REPEATS; repeat++) {
+        unsigned long started = micros();
+        for (uint16_t i = 0; i < _iterations; i++) {
+            DHCP_MESSAGE reply = _dhcp_server->createDHCPReply(DHCP_OFFER, IPAddress(10, 0, 0, 2), i);
+            (void)reply;
+        }
+        unsigned long time = micros() - started;
+        if (repeat == 0 || time < elapsed) elapsed = time;
+    }
+    return report(out, "create_reply", fill, elapsed, getAllocations() - allocations);
+}
+
+// getAddressFromPool(), the result goes to a volatile so the search is not optimized away
+bool DHCP_BENCHMARK::benchGetAddress(Print &out, uint8_t fill) {
+    fillPool(fill);
+    volatile uint8_t sink;
+    uint32_t allocations = getAllocations();
+    unsigned long elapsed = 0;
+    for (uint8_t repeat = 0; repeat < DHCP_BENCH_REPEATS; repeat++) {
+        unsigned long started = micros();
+        for (uint16_t i = 0; i < _iterations; i++) {
+            IPAddress address = _dhcp_server->getAddressFromPool();
+            sink = address[3];
+        }
+        unsigned long time = micros() - started;
+        if (repeat == 0 || time < elapsed) elapsed = time;
+    }
+    (void)sink;
+    return report(out, "get_address", fill, elapsed, getAllocations() - allocations);
+}
+
+// assignAddress() followed by releaseAddress()
+bool DHCP_BENCHMARK::benchAssignRelease(Print &out, uint8_t fill) {
+    fillPool(fill);
+    uint32_t allocations = getAllocations();
+    unsigned long elapsed = 0;
+    for (uint8_t repeat = 0; repeat < DHCP_BENCH_REPEATS; repeat++) {
+        unsigned long started = micros();
+        for (uint16_t i = 0; i < _iterations; i++) {
+            _dhcp_server->releaseAddress(_dhcp_server->assignAddress(DHCP_CLIENT_ADDRESS, i));
+        }
+        unsigned long time = micros() - started;
+        if (repeat == 0 || time < elapsed) elapsed = time;
+    }
+    return report(out, "assign_release", fill, elapsed, getAllocations() - allocations);
+}
+
+// Run every benchmark at an empty, half full and 99% full pool. Each is timed DHCP_BENCH_REPEATS times and the fastest
+// run is kept, so an interrupt or a busy host does not fail the gate. Results are printed as DHCP_BENCH_RESULT
+// initializers so a good run can be pasted in as the next baseline, the last line says whether the run passed
+bool DHCP_BENCHMARK::runBenchmarks(Print &out) {
+    const uint8_t fills[3] = {0, 50, 99};
+    bool results = true;
+    if (_baseline_count == 0) out.println(F("// No baseline set, results are not checked for regressions"));
+    out.println(F("const DHCP_BENCH_RESULT baseline[] = {"));
+    for (int i = 0; i < 3; i++) {
+        if (!benchParseDiscover(out, fills[i])) results = false;
+        if (!benchParseRequest(out, fills[i])) results = false;
+        if (!benchParseRenewal(out, fills[i])) results = false;
+        if (!benchCreateReply(out, fills[i])) results = false;
+        if (!benchGetAddress(out, fills[i])) results = false;
+        if (!benchAssignRelease(out, fills[i])) results = false;
+    }
+    fillPool(0);
+    out.println(F("};"));
+    out.println(results ? F("DHCP BENCHMARK PASSED") : F("DHCP BENCHMARK FAILED"));
+    return results;
+}
+
+// ********** DHCP SIMULATOR **********
+
+// Share of the peak arrival rate for each hour of the day in percent: quiet nights, a morning rush and a busy afternoon
+static const uint8_t dhcp_sim_diurnal[24] = {
+    10, 5, 5, 5, 5, 10, 25, 60, 100, 90, 70, 60, 70, 80, 90, 80, 70, 60, 50, 40, 30, 25, 20, 15
+};
+
+uint64_t DHCP_SIMULATOR::_now = 0;
+
+// DHCP_SIMULATOR Constructor, the clock is shared so only one simulator runs at a time
+DHCP_SIMULATOR::DHCP_SIMULATOR(DHCP_SERVER *server, const DHCP_SIM_MODEL &model) {
+    _dhcp_server = server;
+    _model = model;
+    _clients = NULL;
+    _step = DHCP_SIM_DEFAULT_STEP;
+    _arrival_credit = 0;
+    _allocations = NULL;
+    _heap_bytes = NULL;
+    memset(&_interval, 0, sizeof(_interval));
+    memset(&_totals, 0, sizeof(_totals));
+    _now = 0;
+    _dhcp_server->setClock(getTime);
+}
+
+DHCP_SIMULATOR::~DHCP_SIMULATOR() {
+    delete [] _clients;
+    _dhcp_server->setClock(NULL);
+}
+
+// Virtual millis() handed to the server, it wraps after 49.7 days like millis() and the server's timers expect that
+unsigned long DHCP_SIMULATOR::getTime() {
+    return (unsigned long)_now;
+}
+
+// Set the virtual seconds per step, shorter steps resolve timers more finely but take longer to run
+void DHCP_SIMULATOR::setStep(uint16_t step) {
+    if (step < 1) step = 1;
+    _step = step;
+}
+
+// Count heap allocations with a counter the sketch keeps, see examples/allocation_counter.h
+void DHCP_SIMULATOR::setAllocationCounter(const volatile uint32_t *allocations) {
+    _allocations = allocations;
+}
+
+// Measure heap use with a counter of live bytes the sketch keeps, see examples/allocation_counter.h
+void DHCP_SIMULATOR::setMemoryCounter(const volatile uint32_t *heap_bytes) {
+    _heap_bytes = heap_bytes;
+}
+
+// Get the current allocation count, 0 without a counter
+uint32_t DHCP_SIMULATOR::getAllocations() {
+    if (_allocations == NULL) return 0;
+    return *_allocations;
+}
+
+// Get the statistics of everything run so far
+void DHCP_SIMULATOR::getTotals(DHCP_SIM_STATS &totals) {
+    totals = _totals;
+}
+
+// Run hours of virtual traffic and print one CSV line per virtual hour, returns false if the client population
+// does not fit in memory
+bool DHCP_SIMULATOR::run(Print &out, uint32_t hours) {
+    if (_clients == NULL) {
+        _clients = new DHCP_SIM_CLIENT[_model.clients];
+        if (_clients == NULL) return false;
+        memset(_clients, 0, sizeof(DHCP_SIM_CLIENT) * _model.clients);
+    }
+    out.println(F("hour,online,bound,offered,free_runs,memory,discovers,alloc_ns,renewals,reboots,naks,exhausted,expired,expiry_us,max_expiry_us,heap_allocations"));
+    uint32_t steps = hours * 3600UL / _step;
+    uint64_t next_report = _now + DHCP_SIM_REPORT_INTERVAL;
+    uint32_t allocations = getAllocations();
+    for (uint32_t i = 0; i < steps; i++) {
+        runStep();
+        if (_now < next_report) continue;
+        _interval.heap_allocations = getAllocations() - allocations;
+        allocations = getAllocations();
+        countLeases(_interval);
+        report(out, (uint32_t)(_now / 3600000UL));
+        addStats(_totals, _interval);
+        memset(&_interval, 0, sizeof(_interval));
+        next_report += DHCP_SIM_REPORT_INTERVAL;
+    }
+    return true;
+}
+
+// Advance the clock by one step: arrivals for the time of day, departures, renewals at T1, reboot waves and then
+// the server timers, whose cost is what the expiry columns show
+void DHCP_SIMULATOR::runStep() {
+    _now += (uint32_t)_step * 1000UL;
+    unsigned long now = getTime();                  // What the server sees, client deadlines are kept the same way
+    uint8_t hour = (_now / 3600000UL) % 24;
+    _arrival_credit += (uint64_t)_model.arrivals_per_hour * dhcp_sim_diurnal[hour] * _step;
+    while (_arrival_credit >= 360000UL && _model.clients > 0) {
+        _arrival_credit -= 360000UL;
+        uint16_t start = random(_model.clients);
+        for (uint16_t i = 0; i < _model.clients; i++) {
+            uint16_t index = (start + i) % _model.clients;
+            if (_clients[index].online) continue;
+            arrive(index);
+            // Sessions vary from half to one and a half times the mean
+            _clients[index].departs_at = now + _model.session_time * 10UL * (50 + random(101));
+            break;
+        }
+    }
+    for (uint16_t i = 0; i < _model.clients; i++) {
+        DHCP_SIM_CLIENT *client = &_clients[i];
+        if (!client->online) continue;
+        if ((long)(now - client->departs_at) >= 0) {
+            client->online = false;                 // Leaves without a RELEASE, the lease runs out on the server
+            continue;
+        }
+        if ((long)(now - client->renew_at) >= 0) renew(i);
+    }
+    if (_model.reboot_interval > 0 && _now % ((uint32_t)_model.reboot_interval * 3600000UL) < (uint32_t)_step * 1000UL) {
+        for (uint16_t i = 0; i < _model.clients; i++) {
+            if (_clients[i].online && random(100) < _model.reboot_percent) reboot(i);
+        }
+    }
+    DHCP_SIM_STATS before, after;
+    countLeases(before);
+    unsigned long started = micros();
+    _dhcp_server->handleTimers(now);
+    uint32_t elapsed = micros() - started;
+    countLeases(after);
+    _interval.expired += (before.bound + before.offered) - (after.bound + after.offered);
+    _interval.expiry_us += elapsed;
+    if (elapsed > _interval.max_expiry_us) _interval.max_expiry_us = elapsed;
+}
+
+// Create a message from a simulated client, the client number goes in a locally administered chaddr
+DHCP_MESSAGE DHCP_SIMULATOR::createMessage(uint16_t client, uint8_t message_type) {
+    DHCP_MESSAGE message;
+    memset(&message, 0, sizeof(message));
+    message.op = DHCP_BOOTREQUEST;
+    message.htype = DHCP_ETHERNET;
+    message.hlen = DHCP_MAC_ADDRESS_LENGTH;
+    message.xid = (uint32_t)random(2147483647);
+    message.flags = DHCP_BROADCAST_FLAG;
+    uint8_t chaddr[DHCP_MAC_ADDRESS_LENGTH] = {0x02, 0x53, 0x49, 0x4D, (uint8_t)(client >> 8), (uint8_t)client};
+    memcpy(message.chaddr, chaddr, DHCP_MAC_ADDRESS_LENGTH);
+    uint16_t opt_index = addDHCPOption(message.options, 0, DHCP_MESSAGE_TYPE, 1, &message_type);
+    message.options[opt_index] = DHCP_END;
+    return message;
+}
+
+// A client joins with a full exchange, it stays offline if the pool is exhausted
+void DHCP_SIMULATOR::arrive(uint16_t client) {
+    DHCP_MESSAGE request = createMessage(client, DHCP_DISCOVER);
+    _interval.discovers++;
+    unsigned long started = micros();
+    DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(request);
+    _interval.allocation_us += micros() - started;
+    if (reply.op != DHCP_BOOTREPLY || getDHCPMessageType(&reply) != DHCP_OFFER) {
+        _interval.exhausted++;
+        return;
+    }
+    request = createMessage(client, DHCP_REQUEST);
+    int16_t opt_index = findDHCPOptionsEnd(&request);
+    opt_index = addDHCPOption(request.options, opt_index, DHCP_REQUESTED_IP, 4, reply.yiaddr);
+    opt_index = addDHCPOption(request.options, opt_index, DHCP_SERVER_IDENTIFIER, 4, reply.siaddr);
+    request.options[opt_index] = DHCP_END;
+    reply = _dhcp_server->parseDHCPRequest(request);
+    if (reply.op != DHCP_BOOTREPLY || getDHCPMessageType(&reply) != DHCP_ACK) return;
+    _interval.allocations++;
+    bind(client, &reply);
+}
+
+// A client renews at T1, a client the server has forgotten starts over
+void DHCP_SIMULATOR::renew(uint16_t client) {
+    DHCP_MESSAGE request = createMessage(client, DHCP_REQUEST);
+    memcpy(request.ciaddr, _clients[client].address, 4);
+    request.flags = 0;
+    DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(request);
+    if (reply.op == DHCP_BOOTREPLY && getDHCPMessageType(&reply) == DHCP_ACK) {
+        _interval.renewals++;
+        bind(client, &reply);
+        return;
+    }
+    if (reply.op == DHCP_BOOTREPLY && getDHCPMessageType(&reply) == DHCP_NAK) _interval.naks++;
+    _clients[client].online = false;
+    arrive(client);
+}
+
+// A client restarts and asks for its address back with an INIT-REBOOT REQUEST, a full exchange follows if that fails
+void DHCP_SIMULATOR::reboot(uint16_t client) {
+    DHCP_MESSAGE request = createMessage(client, DHCP_REQUEST);
+    int16_t opt_index = findDHCPOptionsEnd(&request);
+    opt_index = addDHCPOption(request.options, opt_index, DHCP_REQUESTED_IP, 4, _clients[client].address);
+    request.options[opt_index] = DHCP_END;
+    _interval.reboots++;
+    DHCP_MESSAGE reply = _dhcp_server->parseDHCPRequest(request);
+    if (reply.op == DHCP_BOOTREPLY && getDHCPMessageType(&reply) == DHCP_ACK) {
+        bind(client, &reply);
+        return;
+    }
+    if (reply.op == DHCP_BOOTREPLY && getDHCPMessageType(&reply) == DHCP_NAK) _interval.naks++;
+    _clients[client].online = false;
+    arrive(client);
+}
+
+// A client takes the lease an ACK grants and renews it halfway through
+void DHCP_SIMULATOR::bind(uint16_t client, DHCP_MESSAGE *reply) {
+    memcpy(_clients[client].address, reply->yiaddr, 4);
+    _clients[client].online = true;
+    _clients[client].renew_at = getTime() + _dhcp_server->getLeaseTime() * 500UL;
+}
+
+// Count bound leases, held offers and runs of free addresses, and read heap use off the sketch's counter. The
+// client table is the simulator's own and is left out, what remains is the server and the sketch around it
+void DHCP_SIMULATOR::countLeases(DHCP_SIM_STATS &stats) {
+    DHCP_SERVER *server = _dhcp_server;
+    uint8_t range = server->address_pool.range;
+    stats.bound = 0;
+    stats.offered = 0;
+    stats.free_runs = 0;
+    for (int i = 0; i < range; i++) {
+        if (server->_leases[i].status == DHCP_LEASE_BOUND) stats.bound++;
+        if (server->_leases[i].status == DHCP_LEASE_OFFERED) stats.offered++;
+        if (server->_addresses[i] && (i == 0 || !server->_addresses[i - 1])) stats.free_runs++;
+    }
+    stats.memory = 0;
+    if (_heap_bytes != NULL) {
+        stats.memory = *_heap_bytes;
+        if (_clients != NULL) stats.memory -= (uint32_t)_model.clients * sizeof(DHCP_SIM_CLIENT);
+    }
+    stats.online = 0;
+    if (_clients == NULL) return;
+    for (uint16_t i = 0; i < _model.clients; i++) {
+        if (_clients[i].online) stats.online++;
+    }
+}
+
+// Add the counters of an interval to the totals, the occupancy columns keep their latest values
+void DHCP_SIMULATOR::addStats(DHCP_SIM_STATS &totals, const DHCP_SIM_STATS &interval) {
+    totals.online = interval.online;
+    totals.bound = interval.bound;
+    totals.offered = interval.offered;
+    totals.free_runs = interval.free_runs;
+    totals.memory = interval.memory;
+    totals.discovers += interval.discovers;
+    totals.allocations += interval.allocations;
+    totals.allocation_us += interval.allocation_us;
+    totals.renewals += interval.renewals;
+    totals.reboots += interval.reboots;
+    totals.naks += interval.naks;
+    totals.exhausted += interval.exhausted;
+    totals.expired += interval.expired;
+    totals.expiry_us += interval.expiry_us;
+    if (interval.max_expiry_us > totals.max_expiry_us) totals.max_expiry_us = interval.max_expiry_us;
+    totals.heap_allocations += interval.heap_allocations;
+}
+
+// Print the current interval as a CSV line
+void DHCP_SIMULATOR::report(Print &out, uint32_t hour) {
+    uint32_t alloc_ns = 0;
+    if (_interval.discovers > 0) alloc_ns = (uint32_t)((_interval.allocation_us * 1000.0) / _interval.discovers);
+    out.print(hour);
+    out.print(F(","));
+    out.print(_interval.online);
+    out.print(F(","));
+    out.print(_interval.bound);
+    out.print(F(","));
+    out.print(_interval.offered);
+    out.print(F(","));
+    out.print(_interval.free_runs);
+    out.print(F(","));
+    out.print(_interval.memory);
+    out.print(F(","));
+    out.print(_interval.discovers);
+    out.print(F(","));
+    out.print(alloc_ns);
+    out.print(F(","));
+    out.print(_interval.renewals);
+    out.print(F(","));
+    out.print(_interval.reboots);
+    out.print(F(","));
+    out.print(_interval.naks);
+    out.print(F(","));
+    out.print(_interval.exhausted);
+    out.print(F(","));
+    out.print(_interval.expired);
+    out.print(F(","));
+    out.print(_interval.expiry_us);
+    out.print(F(","));
+    out.print(_interval.max_expiry_us);
+    out.print(F(","));
+    out.println(_interval.heap_allocations);
 }
\ No newline at end of file
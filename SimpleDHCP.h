@@ -22,6 +22,27 @@
 #include <Ethernet.h>
 #include <EthernetUDP.h>
 
+// Tracing, define SIMPLE_DHCP_TRACE in the build flags to compile the trace scopes in, they cost nothing otherwise
+// #define SIMPLE_DHCP_TRACE
+
+#if defined(SIMPLE_DHCP_TRACE) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SIMPLE_DHCP_USDT
+#endif
+#endif
+
+// Client lease cache storage, EEPROM on boards that have it and a small file on Linux
+#if defined(ARDUINO) && defined(__has_include)
+#if __has_include(<EEPROM.h>)
+#include <EEPROM.h>
+#define SIMPLE_DHCP_EEPROM
+#endif
+#endif
+#ifdef __linux__
+#include <stdio.h>
+#endif
+
 // ********** Definitions **********
 
 // Library Specific Definitions
@@ -32,6 +53,13 @@
 // DHCP Message limits
 #define DHCP_MESSAGE_SIZE                   576                     // DHCP Minimum message size
 #define DHCP_DEFAULT_OPTIONS_SIZE           344                     // DHCP Default Options size
+#define DHCP_HEADER_SIZE                    240                     // DHCP Fixed fields including the magic cookie
+#define DHCP_SNAME_OFFSET                   44                      // DHCP Offset of the sname field
+#define DHCP_SNAME_SIZE                     64                      // DHCP Size of the sname field
+#define DHCP_FILE_OFFSET                    108                     // DHCP Offset of the file field
+#define DHCP_FILE_SIZE                      128                     // DHCP Size of the file field
+#define DHCP_IP_UDP_HEADER_SIZE             28                      // DHCP IP and UDP header overhead counted by the max message size option
+#define DHCP_MIN_PACKET_SIZE                300                     // DHCP Minimum BOOTP payload accepted by legacy relays (RFC 1542)
 
 // DHCP Ports
 #define DHCP_SERVER_PORT                    67                      // Port for DHCP server to listen on
@@ -85,6 +113,119 @@
 // DHCP Lease Parameters
 #define DHCP_DEFAULT_MAX_LEASES             16                      // DHCP Default Maximum Leases
 #define DHCP_DEFAULT_LEASE_TIME             ((long)60*60*24)        // DHCP Default Lease Time
+#define DHCP_MAX_LEASE_TIME                 ((long)60*60*24*24)     // DHCP Maximum Lease Time, keeps millis() deadlines comparable across rollover
+
+// DHCP Lease States
+#define DHCP_LEASE_FREE                     0                       // DHCP Lease is not in use
+#define DHCP_LEASE_BOUND                    1                       // DHCP Lease is bound to a client
+#define DHCP_LEASE_PROBING                  2                       // DHCP Lease is held while the address is probed for conflicts
+#define DHCP_LEASE_QUARANTINED              3                       // DHCP Lease is held back because another host answered a probe
+#define DHCP_LEASE_OFFERED                  4                       // DHCP Lease is held for a client that was sent an OFFER
+#define DHCP_DEFAULT_OFFER_HOLD_TIME        30000UL                 // DHCP Lease time in ms an offer is held waiting for a REQUEST
+
+// DHCP Allocation Policies
+#define DHCP_ALLOCATE_LOWEST                0                       // DHCP Allocation of the lowest free address in the scope
+#define DHCP_ALLOCATE_HASHED                1                       // DHCP Allocation from a slot picked by the client key, so clients keep their address across restarts
+
+// DHCP Server Configuration
+#define DHCP_MAX_RESERVATIONS               8                       // DHCP Configuration maximum addresses reserved for specific clients
+#define DHCP_OPTION_TEMPLATE_SIZE           48                      // DHCP Configuration size of a pre-built reply option block
+
+// DHCP Extent Allocator
+#define DHCP_EXTENT_INITIAL_CAPACITY        4                       // DHCP Extent Allocator free runs allocated up front, doubled as needed
+
+// DHCP Priority Scheduling
+#define DHCP_PRIORITY_REQUEST               0                       // DHCP Priority class of messages that complete or end a binding
+#define DHCP_PRIORITY_INFORM                1                       // DHCP Priority class of INFORM messages
+#define DHCP_PRIORITY_DISCOVER              2                       // DHCP Priority class of DISCOVER and unknown messages
+#define DHCP_PRIORITY_CLASSES               3                       // DHCP Priority number of classes
+#define DHCP_PRIORITY_WEIGHT_REQUEST        4                       // DHCP Priority requests served per scheduling round
+#define DHCP_PRIORITY_WEIGHT_INFORM         2                       // DHCP Priority informs served per scheduling round
+#define DHCP_PRIORITY_WEIGHT_DISCOVER       1                       // DHCP Priority discovers served per scheduling round
+#define DHCP_PRIORITY_ROUND                 (DHCP_PRIORITY_WEIGHT_REQUEST + DHCP_PRIORITY_WEIGHT_INFORM + DHCP_PRIORITY_WEIGHT_DISCOVER) // DHCP Priority packets served per full round
+#define DHCP_PRIORITY_MAX_DEPTH             64                      // DHCP Priority maximum queue depth, keeps each queue under 64 KB where size_t is 16 bit
+
+// DHCP Conflict Probing
+#define DHCP_PROBE_PENDING                  0                       // DHCP Probe has not completed, or no cached result
+#define DHCP_PROBE_CLEAR                    1                       // DHCP Probe got no answer, the address is free
+#define DHCP_PROBE_CONFLICT                 2                       // DHCP Probe was answered, the address is in use
+#define DHCP_PROBE_TIMEOUT                  500UL                   // DHCP Probe time in ms after which silence counts as clear
+#define DHCP_PROBE_CACHE_TIME               60000UL                 // DHCP Probe time in ms a clear result is trusted without probing again
+#define DHCP_QUARANTINE_TIME                3600000UL               // DHCP Probe time in ms a conflicting address is held back
+#define DHCP_MAX_PENDING_PROBES             4                       // DHCP Probe maximum offers waiting on a probe
+
+// DHCP Failover
+#define DHCP_FAILOVER_PORT                  647                     // DHCP Failover port lease updates are exchanged on
+#define DHCP_FAILOVER_MAGIC                 (0x53444846)            // DHCP Failover packet marker
+#define DHCP_FAILOVER_DISABLED              0                       // DHCP Failover role of a standalone server
+#define DHCP_FAILOVER_PRIMARY               1                       // DHCP Failover role of the active server
+#define DHCP_FAILOVER_STANDBY               2                       // DHCP Failover role of the server that answers only while the primary is down
+#define DHCP_FAILOVER_UPDATE                1                       // DHCP Failover packet carrying sequenced lease changes
+#define DHCP_FAILOVER_BULK                  2                       // DHCP Failover packet carrying a slice of the full lease table
+#define DHCP_FAILOVER_ASSIGN                1                       // DHCP Failover lease change, address bound or renewed
+#define DHCP_FAILOVER_RELEASE               2                       // DHCP Failover lease change, address returned to the pool
+#define DHCP_FAILOVER_LOG_SIZE              32                      // DHCP Failover lease changes kept for delta resync
+#define DHCP_FAILOVER_BATCH                 16                      // DHCP Failover lease changes per packet
+#define DHCP_FAILOVER_HEADER_SIZE           14                      // DHCP Failover packet header size
+#define DHCP_FAILOVER_RECORD_SIZE           14                      // DHCP Failover lease change size on the wire
+#define DHCP_FAILOVER_PACKET_SIZE           (DHCP_FAILOVER_HEADER_SIZE + DHCP_FAILOVER_BATCH * DHCP_FAILOVER_RECORD_SIZE)
+#define DHCP_FAILOVER_INTERVAL              1000UL                  // DHCP Failover time in ms between batches and heartbeats
+#define DHCP_FAILOVER_TIMEOUT               5000UL                  // DHCP Failover time in ms without hearing the peer before it counts as down
+
+// DHCP Lease Export
+#define DHCP_EXPORT_MAGIC                   (0x5344484C)            // DHCP Lease Export binary format marker
+#define DHCP_EXPORT_HEADER_SIZE             10                      // DHCP Lease Export binary header size
+#define DHCP_EXPORT_RECORD_SIZE             13                      // DHCP Lease Export binary record size
+
+// DHCP Benchmarks
+#define DHCP_BENCH_POOL_SIZE                200                     // DHCP Benchmark pool size
+#define DHCP_BENCH_DEFAULT_ITERATIONS       1000                    // DHCP Benchmark default operations per measurement
+#define DHCP_BENCH_DEFAULT_THRESHOLD        10                      // DHCP Benchmark default allowed regression in percent
+#define DHCP_BENCH_REPEATS                  5                       // DHCP Benchmark timed runs per measurement, the fastest is reported
+
+// DHCP Relay Agent
+#define DHCP_RELAY_MAX_SERVERS              4                       // DHCP Relay upstream servers requests are forwarded to
+#define DHCP_RELAY_MAX_HOPS                 16                      // DHCP Relay requests that already took this many hops are dropped (RFC 1542)
+#define DHCP_RELAY_BATCH                    8                       // DHCP Relay packets handled per handleReadable() call
+#define DHCP_RELAY_MAX_ID_SIZE              32                      // DHCP Relay maximum circuit and remote ID length
+#define DHCP_AGENT_CIRCUIT_ID               1                       // DHCP Relay Agent Circuit ID Sub-option
+#define DHCP_AGENT_REMOTE_ID                2                       // DHCP Relay Agent Remote ID Sub-option
+
+// DHCP Simulator
+#define DHCP_SIM_DEFAULT_STEP               60                      // DHCP Simulator default virtual seconds per step
+#define DHCP_SIM_REPORT_INTERVAL            3600000UL               // DHCP Simulator virtual ms between report lines
+
+// DHCP Trace Stages
+#define DHCP_TRACE_RECEIVE                  0                       // DHCP Trace reading a packet off the socket
+#define DHCP_TRACE_VALIDATE                 1                       // DHCP Trace checking the fixed header
+#define DHCP_TRACE_PARSE                    2                       // DHCP Trace walking the options and dispatching the request
+#define DHCP_TRACE_LOOKUP                   3                       // DHCP Trace finding the client's lease or offer
+#define DHCP_TRACE_ALLOCATE                 4                       // DHCP Trace picking an address from the pool
+#define DHCP_TRACE_BUILD                    5                       // DHCP Trace building the reply
+#define DHCP_TRACE_SEND                     6                       // DHCP Trace serializing and sending the reply
+#define DHCP_TRACE_STAGES                   7                       // DHCP Trace number of stages
+#define DHCP_TRACE_BUFFER_SIZE              32                      // DHCP Trace events buffered before they are written out
+
+// DHCP Client States
+#define DHCP_CLIENT_INIT                    0                       // DHCP Client has no lease and has not started an exchange
+#define DHCP_CLIENT_SELECTING               1                       // DHCP Client sent a DISCOVER and waits for an OFFER
+#define DHCP_CLIENT_REQUESTING              2                       // DHCP Client sent a REQUEST for an offered address
+#define DHCP_CLIENT_REBOOTING               3                       // DHCP Client sent an INIT-REBOOT REQUEST for its cached address
+#define DHCP_CLIENT_BOUND                   4                       // DHCP Client holds a lease
+#define DHCP_CLIENT_RENEWING                5                       // DHCP Client past T1, asks the server that granted the lease to extend it
+#define DHCP_CLIENT_REBINDING               6                       // DHCP Client past T2, asks any server to extend the lease
+#define DHCP_CLIENT_RETRY_TIME              4000UL                  // DHCP Client time in ms before a message is sent again
+#define DHCP_CLIENT_RENEW_RETRY_TIME        60000UL                 // DHCP Client shortest time in ms between REQUESTs while renewing or rebinding
+#define DHCP_CLIENT_MAX_RETRIES             4                       // DHCP Client REQUESTs sent for an offer before starting over
+#define DHCP_CLIENT_REBOOT_RETRIES          2                       // DHCP Client INIT-REBOOT REQUESTs sent before falling back to a full exchange
+
+// DHCP Client Lease Cache
+#define DHCP_LEASE_CACHE_MAGIC              (0x5344484B)            // DHCP Lease Cache marker
+#define DHCP_LEASE_CACHE_SIZE               32                      // DHCP Lease Cache size in storage
+#define DHCP_EEPROM_LEASE_OFFSET            0                       // DHCP Lease Cache default EEPROM address
+
+// DHCP Reply Codes
+#define DHCP_NO_REPLY                       0                       // DHCP Reply op code for requests that are answered later or not at all
 
 // DHCP Options
 // RFC 1497 Vendor Extensions
@@ -173,6 +314,8 @@
 #define DHCP_CLIENT_IDENTIFIER              61                      // DHCP Client Identifier Option
 #define DHCP_TFTP_SERVER_NAME               66                      // DHCP TFTP Server Name Option
 #define DHCP_BOOTFILE_NAME                  67                      // DHCP Bootfile Name Option
+#define DHCP_RAPID_COMMIT                   80                      // DHCP Rapid Commit Option (RFC 4039)
+#define DHCP_RELAY_AGENT_INFORMATION        82                      // DHCP Relay Agent Information Option (RFC 3046)
 
 // ********** Constants **********
 
@@ -199,13 +342,15 @@ typedef struct DHCP_MESSAGE {
     uint8_t     sname[64];                                          // Server Name
     uint8_t     bootf[128];                                         // Boot Filename
     uint8_t     magic[4];                                           // Magic Cookie
-    uint8_t     options[DHCP_DEFAULT_OPTIONS_SIZE];                 // DHCP Options - Assumes max DHCP message is DHCP_MESSAGE_SIZE (576) - TODO: Implement dynamic options size
+    uint8_t     options[DHCP_DEFAULT_OPTIONS_SIZE];                 // DHCP Options - Working area, serializeDHCPMessage() sizes the packet on the wire
 } DHCP_MESSAGE;
 
 // DHCP Lease Structure
 typedef struct DHCP_LEASE {
     byte            status;                                         // Lease Status
-    long            expires;                                        // Expiry Time
+    unsigned long   expires;                                        // Expiry Time in millis()
+    byte            probe;                                          // Cached conflict probe result
+    unsigned long   probe_expires;                                  // Cached conflict probe expiry time in millis()
     unsigned long   mac_crc;                                        // MAC Cyclic Redundancy Check
     unsigned long   host_crc;                                       // Host Cyclic Redundancy Check
 } DHCP_LEASE;
@@ -218,11 +363,228 @@ typedef struct DHCP_ADDRESS_POOL {
     uint8_t range;
 } DHCP_ADDRESS_POOL;
 
+// DHCP Address Reservation
+typedef struct DHCP_RESERVATION {
+    uint32_t    client_key;                                         // Client key the address is held for, see getDHCPClientKey()
+    uint8_t     address[4];                                         // Reserved network address, ignored if it is outside the pool
+} DHCP_RESERVATION;
+
+// DHCP Server Configuration, built off to the side and swapped in whole by reloadConfig()
+typedef struct DHCP_SERVER_CONFIG {
+    uint8_t     server_address[4];                                  // Server network address, sent as the Server Identifier
+    DHCP_ADDRESS_POOL pool;                                         // Address pool
+    uint32_t    lease_time;                                         // Lease time in seconds
+    uint8_t     subnet_mask[4];                                     // Subnet Mask Option
+    uint8_t     router[4];                                          // Router Option, left out when 0.0.0.0
+    uint8_t     dns_server[4];                                      // DNS Name Server Option, left out when 0.0.0.0
+    uint8_t     reservation_count;                                  // Number of reservations in use
+    DHCP_RESERVATION reservations[DHCP_MAX_RESERVATIONS];           // Addresses held for specific clients
+    bool        rapid_commit;                                       // Answer a DISCOVER that asks for Rapid Commit with an ACK
+} DHCP_SERVER_CONFIG;
+
+// DHCP Offer Expiry, offers share one hold time so the queue of them stays in expiry order
+typedef struct DHCP_OFFER_EXPIRY {
+    uint8_t     index;                                              // Pool index of the offered address
+    unsigned long expires;                                          // Expiry Time in millis(), stale once the lease no longer matches
+} DHCP_OFFER_EXPIRY;
+
+// DHCP Trace Event
+typedef struct DHCP_TRACE_EVENT {
+    uint8_t     stage;                                              // DHCP_TRACE_RECEIVE to DHCP_TRACE_SEND
+    uint8_t     message_type;                                       // Message type of the request being handled, 0 if not known yet
+    unsigned long start;                                            // Start time in micros()
+    unsigned long duration;                                         // Duration in micros()
+} DHCP_TRACE_EVENT;
+
+// DHCP Free Address Extent
+typedef struct DHCP_EXTENT {
+    uint32_t    start;                                              // Offset of the first free address from the allocator base
+    uint32_t    length;                                             // Number of free addresses in the run
+} DHCP_EXTENT;
+
+// DHCP Offer Waiting on a Conflict Probe
+typedef struct DHCP_PENDING_PROBE {
+    bool        active;                                             // Probe is in flight
+    uint8_t     index;                                              // Pool index of the probed address
+    unsigned long started;                                          // Probe start time in millis()
+    uint32_t    xid;                                                // Transaction Identifier of the DISCOVER
+    uint8_t     htype;                                              // Hardware Type of the client
+    uint8_t     hlen;                                               // Hardware Address Length of the client
+    uint8_t     giaddr[4];                                          // Relay Agent Address of the DISCOVER
+    uint8_t     chaddr[16];                                         // Client Hardware Address
+    uint32_t    client_key;                                         // Client key of the DISCOVER
+    uint16_t    max_message_size;                                   // Maximum message size accepted by the client
+} DHCP_PENDING_PROBE;
+
+// DHCP Failover Lease Change
+typedef struct DHCP_FAILOVER_RECORD {
+    uint32_t    seq;                                                // Sequence number
+    uint8_t     op;                                                 // DHCP_FAILOVER_ASSIGN or DHCP_FAILOVER_RELEASE
+    uint8_t     index;                                              // Pool index of the address
+    uint32_t    client_key;                                         // Client key the address is bound to
+    unsigned long expires;                                          // Expiry Time in millis()
+} DHCP_FAILOVER_RECORD;
+
+// DHCP Lease Snapshot Entry
+typedef struct DHCP_LEASE_INFO {
+    uint8_t     address[4];                                         // Leased network address
+    byte        status;                                             // Lease Status
+    uint32_t    remaining;                                          // Seconds until the lease expires
+    uint32_t    client_key;                                         // Client key the address is bound to
+} DHCP_LEASE_INFO;
+
+// DHCP Benchmark Result
+typedef struct DHCP_BENCH_RESULT {
+    const char  *name;                                              // Benchmark name
+    uint8_t     fill;                                               // Pool fill in percent
+    uint32_t    ns_per_op;                                          // Nanoseconds per operation
+} DHCP_BENCH_RESULT;
+
+// DHCP Client Lease
+typedef struct DHCP_CLIENT_LEASE {
+    uint8_t     address[4];                                         // Leased network address
+    uint8_t     server_id[4];                                       // Server that granted the lease
+    uint8_t     subnet_mask[4];                                     // Subnet mask option
+    uint8_t     router[4];                                          // Router option, 0.0.0.0 if none
+    uint8_t     dns_server[4];                                      // DNS server option, 0.0.0.0 if none
+    uint32_t    lease_time;                                         // Lease time in seconds
+    uint32_t    renewal_time;                                       // T1 in seconds, when renewing starts
+    uint32_t    rebinding_time;                                     // T2 in seconds, when rebinding starts
+} DHCP_CLIENT_LEASE;
+
+// DHCP Simulator Population Model
+typedef struct DHCP_SIM_MODEL {
+    uint16_t    clients;                                            // Client population, online or not
+    uint16_t    arrivals_per_hour;                                  // Arrivals per hour at the busiest hour of the day
+    uint32_t    session_time;                                       // Mean seconds a client stays, it leaves without a RELEASE
+    uint16_t    reboot_interval;                                    // Hours between reboot waves, 0 for none
+    uint8_t     reboot_percent;                                     // Percent of online clients that reboot in a wave
+} DHCP_SIM_MODEL;
+
+// DHCP Simulator Client
+typedef struct DHCP_SIM_CLIENT {
+    uint8_t     address[4];                                         // Address the client holds
+    bool        online;                                             // Client is on the network
+    unsigned long renew_at;                                         // Virtual millis() the client renews (T1), compared wrap safe
+    unsigned long departs_at;                                       // Virtual millis() the client leaves, compared wrap safe
+} DHCP_SIM_CLIENT;
+
+// DHCP Simulator Statistics, per report interval or for the whole run
+typedef struct DHCP_SIM_STATS {
+    uint16_t    online;                                             // Clients online at the end of the interval
+    uint16_t    bound;                                              // Bound leases at the end of the interval
+    uint16_t    offered;                                            // Offers held at the end of the interval
+    uint16_t    free_runs;                                          // Runs of free addresses, pool fragmentation
+    uint32_t    memory;                                             // Bytes live on the heap besides the simulated clients, 0 without a memory counter
+    uint32_t    discovers;                                          // DISCOVERs sent
+    uint32_t    allocations;                                        // Addresses handed out by full exchanges
+    uint32_t    allocation_us;                                      // Time spent answering DISCOVERs in us
+    uint32_t    renewals;                                           // Leases renewed
+    uint32_t    reboots;                                            // INIT-REBOOT REQUESTs sent
+    uint32_t    naks;                                               // NAKs received
+    uint32_t    exhausted;                                          // DISCOVERs left unanswered
+    uint32_t    expired;                                            // Leases and offers returned to the pool by the timers
+    uint32_t    expiry_us;                                          // Time spent in handleTimers() in us
+    uint32_t    max_expiry_us;                                      // Longest handleTimers() call in us
+    uint32_t    heap_allocations;                                   // Heap allocations, 0 without an allocation counter
+} DHCP_SIM_STATS;
+
+// Time source in ms, millis() on hardware or a virtual clock in the simulator
+typedef unsigned long (*DHCP_CLOCK)();
+
+// ********** Functions **********
+
+uint16_t addDHCPOption(uint8_t *, uint16_t, uint8_t, uint8_t, const uint8_t *);    // Append an option to an options list
+uint16_t serializeDHCPMessage(DHCP_MESSAGE *, uint8_t *, uint16_t);                 // Write a DHCP message using only the bytes it needs
+void readDHCPHeader(DHCP_MESSAGE *);                                                // Put the 16 bit fields of a message read off the wire in host order
+int16_t findDHCPOption(DHCP_MESSAGE *, uint8_t);                                    // Find an option in a message, -1 if it is not present
+int16_t findDHCPOptionsEnd(DHCP_MESSAGE *);                                         // Find the End option of a message, -1 if it has none
+uint32_t getDHCPClientKey(DHCP_MESSAGE *);                                          // CRC32 of the client identifier, or of chaddr without one
+uint8_t getDHCPMessageType(DHCP_MESSAGE *);                                         // Message type of a message, 0 if it has none
+
 // ********** Classes **********
 
+// DHCP Conflict Prober Interface, implemented by the application on top of ARP or ICMP echo
+class DHCP_CONFLICT_PROBER {
+public:
+    virtual ~DHCP_CONFLICT_PROBER() {}
+    virtual bool beginProbe(IPAddress) = 0;                         // Start probing an address, false if no probe could be started
+    virtual uint8_t probeStatus(IPAddress) = 0;                     // DHCP_PROBE_PENDING, DHCP_PROBE_CLEAR or DHCP_PROBE_CONFLICT
+};
+
+// DHCP Lease Store Interface, keeps the client lease cache across restarts
+class DHCP_LEASE_STORE {
+public:
+    virtual ~DHCP_LEASE_STORE() {}
+    virtual bool readLease(uint8_t *, uint16_t) = 0;                // Read the saved lease cache, false if nothing could be read
+    virtual bool writeLease(const uint8_t *, uint16_t) = 0;         // Save the lease cache, false if it could not be written
+};
+
+#ifdef SIMPLE_DHCP_EEPROM
+// DHCP EEPROM Lease Store, only bytes that changed are written to spare the EEPROM
+class DHCP_EEPROM_LEASE_STORE : public DHCP_LEASE_STORE {
+private:
+    int _offset;                                                    // DHCP EEPROM Lease Store address of the lease cache
+public:
+    DHCP_EEPROM_LEASE_STORE();                                      // DHCP EEPROM Lease Store at DHCP_EEPROM_LEASE_OFFSET
+    DHCP_EEPROM_LEASE_STORE(int);                                   // DHCP EEPROM Lease Store at the given address
+    bool readLease(uint8_t *, uint16_t);                            // DHCP EEPROM Lease Store read the lease cache
+    bool writeLease(const uint8_t *, uint16_t);                     // DHCP EEPROM Lease Store save the lease cache
+};
+#endif
+
+#ifdef __linux__
+// DHCP File Lease Store, a torn write fails the cache checksum and costs one full exchange
+class DHCP_FILE_LEASE_STORE : public DHCP_LEASE_STORE {
+private:
+    const char *_path;                                              // DHCP File Lease Store path of the lease cache file
+public:
+    DHCP_FILE_LEASE_STORE(const char *);                            // DHCP File Lease Store at the given path
+    bool readLease(uint8_t *, uint16_t);                            // DHCP File Lease Store read the lease cache
+    bool writeLease(const uint8_t *, uint16_t);                     // DHCP File Lease Store save the lease cache
+};
+#endif
+
+// DHCP Extent Allocator, tracks free runs of addresses so memory grows with fragmentation rather than range size.
+// Addresses are offsets from a base, which lets the same allocator cover a /8 or the low bits of an IPv6 prefix.
+// Finding the run that holds an offset is a binary search, O(log n) in the number of runs. Splitting or merging a
+// run moves the runs after it, so assigning and releasing are O(n) memmove in the worst case. The server's own
+// pool of at most 255 addresses stays on a fixed bool array, which never allocates and is smaller once fragmented
+class DHCP_EXTENT_ALLOCATOR {
+private:
+    // Members
+    uint32_t _base;                                                 // DHCP Extent Allocator first address of the range
+    uint32_t _size;                                                 // DHCP Extent Allocator number of addresses in the range
+    uint32_t _assigned;                                             // DHCP Extent Allocator number of assigned addresses
+    DHCP_EXTENT *_extents;                                          // DHCP Extent Allocator free runs sorted by start, never adjacent
+    uint16_t _extent_count;                                         // DHCP Extent Allocator number of free runs
+    uint16_t _extent_capacity;                                      // DHCP Extent Allocator number of free runs allocated
+    // Methods
+    uint16_t findExtent(uint32_t);                                  // DHCP Extent Allocator index of the first run starting after an offset
+    bool insertExtent(uint16_t, uint32_t, uint32_t);                // DHCP Extent Allocator insert a run, false if out of memory
+    void removeExtent(uint16_t);                                    // DHCP Extent Allocator remove a run
+    bool getOffset(IPAddress, uint32_t &);                          // DHCP Extent Allocator offset of an address, false if outside the range
+public:
+    DHCP_EXTENT_ALLOCATOR(IPAddress, uint32_t);                     // DHCP Extent Allocator over size addresses from a base address
+    ~DHCP_EXTENT_ALLOCATOR();                                       // DHCP Extent Allocator
+    bool assignOffset(uint32_t);                                    // DHCP Extent Allocator assign an offset, false if it is taken or out of range
+    bool releaseOffset(uint32_t);                                   // DHCP Extent Allocator release an offset, false if it was not assigned
+    bool isOffsetAvailable(uint32_t);                               // DHCP Extent Allocator check if an offset is free
+    bool getFreeOffset(uint32_t &);                                 // DHCP Extent Allocator lowest free offset, false if the range is exhausted
+    bool getFreeOffset(uint32_t, uint32_t &);                       // DHCP Extent Allocator lowest free offset at or after an offset, false if there is none
+    IPAddress assignAddress(IPAddress);                             // DHCP Extent Allocator assign the requested address, or the lowest free one
+    void releaseAddress(IPAddress);                                 // DHCP Extent Allocator release an assigned address
+    bool isAddressAvailable(IPAddress);                             // DHCP Extent Allocator check if an address is in the range and free
+    IPAddress getAddressFromPool();                                 // DHCP Extent Allocator lowest free address, 0.0.0.0 if exhausted
+    uint32_t getAssignedCount();                                    // DHCP Extent Allocator number of assigned addresses
+    uint16_t getExtentCount();                                      // DHCP Extent Allocator number of free runs
+};
+
 // DHCP Server Class
 class DHCP_SERVER {
     friend class DHCP_TESTER;
+    friend class DHCP_BENCHMARK;
+    friend class DHCP_SIMULATOR;
 private:
     // Members
     bool _verbose;                                                  // DHCP Server verbosity
@@ -230,15 +592,100 @@ private:
     IPAddress SERVER_ADDRESS;                                       // DHCP Server Network Address
     DHCP_ADDRESS_POOL address_pool;                                 // DHCP Server Address Pool
     bool *_addresses;                                               // DHCP Server address tracker
+    DHCP_LEASE *_leases;                                            // DHCP Server lease timers, one per address in the pool
+    DHCP_SERVER_CONFIG *_config;                                    // DHCP Server current configuration
+    uint32_t _config_version;                                       // DHCP Server number of configurations loaded
+    uint8_t _ack_template[DHCP_OPTION_TEMPLATE_SIZE];               // DHCP Server options of a renewal ACK, rebuilt with the configuration
+    uint8_t _ack_template_size;                                     // DHCP Server length of the renewal ACK options
+    uint8_t _inform_template[DHCP_OPTION_TEMPLATE_SIZE];            // DHCP Server options of an INFORM reply, rebuilt with the configuration
+    uint8_t _inform_template_size;                                  // DHCP Server length of the INFORM reply options
+    DHCP_SERVER_CONFIG *_retired_config;                            // DHCP Server configuration replaced by the last reload, freed after a grace period
+    bool *_retired_addresses;                                       // DHCP Server address tracker replaced by the last reload
+    DHCP_LEASE *_retired_leases;                                    // DHCP Server lease timers replaced by the last reload
+    uint32_t _lease_time;                                           // DHCP Server lease time in seconds
+    unsigned long _offer_hold_time;                                 // DHCP Server time in ms an offer is held waiting for a REQUEST
+    DHCP_OFFER_EXPIRY *_offer_queue;                                // DHCP Server offers in expiry order, one slot per address in the pool
+    uint8_t _offer_queue_head;                                      // DHCP Server slot of the oldest offer
+    uint8_t _offer_queue_count;                                     // DHCP Server offers in the queue, including stale ones
+    uint16_t _max_message_size;                                     // DHCP Server maximum message size accepted by the current client
+    DHCP_CONFLICT_PROBER *_prober;                                  // DHCP Server conflict prober, NULL when probing is disabled
+    DHCP_PENDING_PROBE _probes[DHCP_MAX_PENDING_PROBES];            // DHCP Server offers waiting on a conflict probe
+    uint8_t _scope_start;                                           // DHCP Server first pool index this server allocates from
+    uint8_t _scope_end;                                             // DHCP Server pool index past the last one this server allocates from
+    uint8_t _allocation_policy;                                     // DHCP Server allocation policy
+    uint8_t _failover_role;                                         // DHCP Server failover role
+    EthernetUDP FAILOVER_SOCKET;                                    // DHCP Server failover UDP Socket
+    IPAddress FAILOVER_PEER;                                        // DHCP Server failover peer network address
+    uint32_t _failover_session;                                     // DHCP Server failover session, changes on every start
+    uint32_t _failover_peer_session;                                // DHCP Server failover session of the peer
+    uint16_t _failover_port;                                        // DHCP Server failover port this server listens on
+    uint16_t _failover_peer_port;                                   // DHCP Server failover port the peer listens on
+    DHCP_FAILOVER_RECORD _failover_log[DHCP_FAILOVER_LOG_SIZE];     // DHCP Server failover lease changes not yet known to be replicated
+    uint32_t _failover_seq;                                         // DHCP Server failover sequence number of the last local lease change
+    uint32_t _failover_acked;                                       // DHCP Server failover last sequence number acknowledged by the peer
+    uint32_t _failover_sent;                                        // DHCP Server failover last sequence number sent to the peer
+    uint32_t _failover_received;                                    // DHCP Server failover last sequence number applied from the peer
+    uint16_t _failover_bulk_next;                                   // DHCP Server failover next pool index expected in a bulk resync
+    bool _failover_ack_pending;                                     // DHCP Server failover peer is owed an acknowledgement
+    unsigned long _failover_last_heard;                             // DHCP Server failover millis() the peer was last heard from
+    unsigned long _failover_last_sent;                              // DHCP Server failover millis() of the last batch sent
+    uint16_t _snapshot_size;                                        // DHCP Server number of entries the snapshot buffer holds
+    DHCP_LEASE_INFO *_snapshot;                                     // DHCP Server lease snapshot, allocated on first use
+    uint16_t _snapshot_count;                                       // DHCP Server leases in the snapshot
+    uint32_t _snapshot_epoch;                                       // DHCP Server snapshot number, increases with every snapshot
+    uint8_t _queue_depth;                                           // DHCP Server packets each priority queue holds, 0 when scheduling is off
+    uint8_t *_queues[DHCP_PRIORITY_CLASSES];                        // DHCP Server priority queues of raw packets
+    uint16_t *_queue_sizes[DHCP_PRIORITY_CLASSES];                  // DHCP Server size of each queued packet, slot for slot
+    uint8_t _queue_head[DHCP_PRIORITY_CLASSES];                     // DHCP Server slot of the oldest packet in each queue
+    uint8_t _queue_count[DHCP_PRIORITY_CLASSES];                    // DHCP Server packets waiting in each queue
+    uint8_t _queue_credit[DHCP_PRIORITY_CLASSES];                   // DHCP Server packets each queue may still send this round
+    uint32_t _queue_drops[DHCP_PRIORITY_CLASSES];                   // DHCP Server packets dropped because their queue was full
+    DHCP_CLOCK _clock;                                              // DHCP Server time source in ms
     // Methods
+    void initServer(IPAddress, uint8_t, bool);                      // DHCP Server shared constructor body
+    int16_t getPoolIndex(IPAddress);                                // DHCP Server index of an address in the pool, -1 if outside it
+    IPAddress getPoolAddress(uint8_t);                              // DHCP Server network address at an index in the pool
     IPAddress getAddressFromPool();                                 // DHCP Server Get Network Address from pool
+    IPAddress getAddressFromPool(uint32_t);                         // DHCP Server Get Network Address from pool for a client key
+    int16_t getReservedIndex(uint32_t);                             // DHCP Server pool index reserved for a client key, -1 if none
+    bool isReservedForOther(uint8_t, uint32_t);                     // DHCP Server check if a pool index is reserved for another client
+    void resetScope();                                              // DHCP Server set the allocation scope for the failover role
+    void freeRetiredConfig();                                       // DHCP Server free what the last reload replaced
     bool isAddressAvailable(IPAddress);                             // DHCP Server check if network address is valid and available
     IPAddress assignAddress(IPAddress);                             // DHCP Server Assign Network Address
+    IPAddress assignAddress(IPAddress, uint32_t);                   // DHCP Server Assign Network Address to a client key
     void releaseAddress(IPAddress);                                 // DHCP Server release assigned address
+    IPAddress offerAddress(IPAddress, uint32_t);                    // DHCP Server hold an address for a client until it sends a REQUEST
+    int16_t findOffer(uint32_t);                                    // DHCP Server pool index offered to a client key, -1 if none
+    void queueOfferExpiry(uint8_t);                                 // DHCP Server add an offer to the expiry queue
+    void expireOffers(unsigned long);                               // DHCP Server return unclaimed offers to the pool
+    DHCP_MESSAGE confirmRequest(DHCP_MESSAGE *, IPAddress, IPAddress); // DHCP Server turn an offer into a lease, or refuse the REQUEST
     void printDHCPMessage(DHCP_MESSAGE);                            // DHCP Server Print the raw DHCP message
     void printRawUDPPayload(uint8_t *, uint16_t);                   // DHCP Server Print the raw UDP payload
     DHCP_MESSAGE parseDHCPRequest(DHCP_MESSAGE);                    // DHCP Server Request Parser
     DHCP_MESSAGE createDHCPReply(uint8_t, IPAddress, uint32_t);     // DHCP Server Create Reply to Request
+    void sendDHCPReply(DHCP_MESSAGE *, uint8_t *, uint16_t);        // DHCP Server Serialize and send a reply using the given buffer
+    IPAddress getReplyDestination(DHCP_MESSAGE *, uint16_t &);      // DHCP Server address and port a reply goes to
+    uint16_t receivePacket(uint8_t *);                              // DHCP Server read a pending packet, returns its size or 0 if none
+    void handleRequest(uint8_t *, uint16_t);                        // DHCP Server parse a raw request and send the reply
+    bool isValidRequest(uint8_t *, uint16_t);                       // DHCP Server check the fixed header of a raw request
+    uint8_t classifyRequest(uint8_t *);                             // DHCP Server priority class of a raw request
+    bool enqueueRequest(uint8_t *, uint16_t);                       // DHCP Server queue a raw request and its size, false if its queue is full
+    uint8_t *dequeueRequest(uint16_t &);                            // DHCP Server next raw request and its size in schedule order, NULL if none
+    void freeQueues();                                              // DHCP Server free the priority queues
+    void buildOptionTemplates();                                    // DHCP Server pre-build the reply option blocks from the configuration
+    bool isRenewal(DHCP_MESSAGE *);                                 // DHCP Server check if a request renews a lease the client already holds
+    DHCP_MESSAGE renewLease(DHCP_MESSAGE *);                        // DHCP Server extend a lease and answer from the ACK template
+    DHCP_MESSAGE answerInform(DHCP_MESSAGE *);                      // DHCP Server answer an INFORM from the INFORM template
+    DHCP_MESSAGE createTemplateReply(DHCP_MESSAGE *, const uint8_t *, uint8_t); // DHCP Server reply to a request with a pre-built option block
+    bool beginConflictProbe(DHCP_MESSAGE *, IPAddress);             // DHCP Server Hold an offer until its address has been probed
+    void handleConflictProbes(unsigned long);                       // DHCP Server Offer or quarantine addresses whose probes completed
+    bool isServing();                                               // DHCP Server answers clients, false for a standby whose primary is up
+    void logLeaseChange(uint8_t, uint8_t);                          // DHCP Server record a lease change for the failover peer
+    void applyLeaseChange(uint8_t, uint8_t, uint32_t, uint32_t, unsigned long); // DHCP Server apply a lease change from the failover peer
+    uint16_t createFailoverPacket(uint8_t *, uint16_t &, unsigned long); // DHCP Server build the next failover packet, 0 when there is nothing left
+    void parseFailoverPacket(uint8_t *, uint16_t, unsigned long);   // DHCP Server apply a failover packet from the peer
+    void handleFailover(unsigned long);                             // DHCP Server exchange failover packets with the peer
 public:
     // Constructors
     DHCP_SERVER();                                                  // DHCP Server Default Constructor, this constructor should be avoided
@@ -251,19 +698,134 @@ public:
     bool setVerbosity(bool);                                        // DHCP Server set verbosity
     uint8_t checkForRequests();                                     // DHCP Server Check for requests
     void assignAddressPool(IPAddress, uint8_t);                     // DHCP Server Assign Address Pool range
+    uint32_t getLeaseTime();                                        // DHCP Server get lease time in seconds
+    void setLeaseTime(uint32_t);                                    // DHCP Server set lease time in seconds
+    unsigned long getOfferHoldTime();                               // DHCP Server get time in ms offers are held
+    void setOfferHoldTime(unsigned long);                           // DHCP Server set time in ms offers are held
+    void setConflictProber(DHCP_CONFLICT_PROBER *);                 // DHCP Server probe addresses before offering them, NULL disables
+    uint8_t getAllocationPolicy();                                  // DHCP Server allocation policy
+    void setAllocationPolicy(uint8_t);                              // DHCP Server set allocation policy, DHCP_ALLOCATE_LOWEST or DHCP_ALLOCATE_HASHED
+    void getConfig(DHCP_SERVER_CONFIG &);                           // DHCP Server copy of the current configuration
+    bool reloadConfig(const DHCP_SERVER_CONFIG &);                  // DHCP Server swap in a new configuration, leases in the new pool carry over
+    uint32_t getConfigVersion();                                    // DHCP Server number of configurations loaded
+    bool getRapidCommit();                                          // DHCP Server check if Rapid Commit is allowed
+    void setRapidCommit(bool);                                      // DHCP Server allow Rapid Commit, two message exchanges for clients that ask
+    void enableFailover(IPAddress, uint8_t);                        // DHCP Server replicate leases with a peer as DHCP_FAILOVER_PRIMARY or DHCP_FAILOVER_STANDBY
+    void enableFailover(IPAddress, uint8_t, uint16_t, uint16_t);    // DHCP Server replicate leases with a peer, with the local and peer failover ports
+    void setServerPort(uint16_t);                                   // DHCP Server listen for requests on another port than DHCP_SERVER_PORT
+    // Lease snapshots for admin tooling
+    uint16_t snapshotLeases();                                      // DHCP Server take a lease snapshot, returns the number of leases in it
+    uint32_t getSnapshotEpoch();                                    // DHCP Server number of the current snapshot
+    bool getSnapshotLease(uint16_t, DHCP_LEASE_INFO &);             // DHCP Server lease at an index in the snapshot
+    size_t exportLeasesJSON(Print &);                               // DHCP Server write the whole snapshot as JSON
+    size_t exportLeasesJSON(Print &, uint16_t, uint16_t);           // DHCP Server write a slice of the snapshot as JSON
+    size_t exportLeasesBinary(Print &);                             // DHCP Server write the whole snapshot in binary
+    size_t exportLeasesBinary(Print &, uint16_t, uint16_t);         // DHCP Server write a slice of the snapshot in binary
+    // Event loop integration
+    EthernetUDP *getSocket();                                       // DHCP Server socket to watch for readability
+    uint8_t handleReadable();                                       // DHCP Server handle pending requests, returns how many were handled
+    void handleTimers();                                            // DHCP Server run timers that are due now
+    void handleTimers(unsigned long);                               // DHCP Server run timers that are due at the given millis()
+    bool nextTimerDeadline(unsigned long &);                        // DHCP Server millis() of the next timer, false if none are pending
+    void setClock(DHCP_CLOCK);                                      // DHCP Server time source in ms, NULL restores millis()
+    // Priority scheduling under overload
+    bool enablePriorityScheduling(uint8_t);                         // DHCP Server queue requests by type with the given depth up to DHCP_PRIORITY_MAX_DEPTH, 0 disables
+    uint8_t getQueueDepth(uint8_t);                                 // DHCP Server packets waiting in a priority class
+    uint32_t getDropCount(uint8_t);                                 // DHCP Server packets dropped from a priority class
 };
 
-// DHCP Client Class - TODO: Implement
+// DHCP Client Class
 class DHCP_CLIENT {
     friend class DHCP_TESTER;
+    friend class DHCP_BENCHMARK;
 private:
+    // Members
     uint8_t H_ADDRESS[16];                                          // DHCP Client
+    EthernetUDP DHCP_SOCKET;                                        // DHCP Client UDP Socket
+    DHCP_LEASE_STORE *_store;                                       // DHCP Client lease cache storage, NULL when leases are not kept
+    DHCP_CLIENT_LEASE _lease;                                       // DHCP Client lease being requested or held
+    uint8_t _state;                                                 // DHCP Client state
+    uint32_t _xid;                                                  // DHCP Client transaction of the current exchange
+    uint8_t _retries;                                               // DHCP Client times the current message was sent
+    unsigned long _sent_at;                                         // DHCP Client millis() the current message was last sent
+    unsigned long _bound_at;                                        // DHCP Client millis() the lease was bound
+    bool _rapid_commit;                                             // DHCP Client asks for Rapid Commit in its DISCOVERs
+    // Methods
+    void initClient(uint8_t [], uint8_t);                           // DHCP Client shared constructor body
+    uint16_t beginDHCPMessage(DHCP_MESSAGE *, uint8_t, uint32_t);   // DHCP Client fill the fixed fields and message type, returns the next options index
     DHCP_MESSAGE createDHCPMessage(uint8_t, uint32_t);              // DHCP Client
-    DHCP_MESSAGE createDHCPMessage(uint8_t, uint32_t, IPAddress);   // DHCP Client
+    DHCP_MESSAGE createDHCPMessage(uint8_t, uint32_t, IPAddress);   // DHCP Client message about an address, requested or held depending on the type
+    DHCP_MESSAGE createStateMessage();                              // DHCP Client message the current state sends
+    DHCP_MESSAGE startExchange();                                   // DHCP Client first message after a restart, INIT-REBOOT when a lease is cached
+    DHCP_MESSAGE startDiscovery();                                  // DHCP Client first message of a full exchange
+    DHCP_MESSAGE startRenewal(uint8_t);                             // DHCP Client first REQUEST to extend the lease, RENEWING or REBINDING
+    unsigned long getRenewRetryTime(unsigned long);                 // DHCP Client time in ms until the next REQUEST while renewing or rebinding
+    IPAddress getDestination();                                     // DHCP Client where the current state sends its messages
+    DHCP_MESSAGE parseDHCPReply(DHCP_MESSAGE *);                    // DHCP Client Reply Parser, returns the next message to send
+    void readLeaseOptions(DHCP_MESSAGE *);                          // DHCP Client take the address and lease options from a reply
+    void bindLease(DHCP_MESSAGE *);                                 // DHCP Client take the lease an ACK grants
+    void sendDHCPMessage(DHCP_MESSAGE *, uint8_t *);                // DHCP Client Serialize and send a message to getDestination() using the given buffer
+    bool loadLease();                                               // DHCP Client read the lease cache, false if there is no valid one
+    bool saveLease();                                               // DHCP Client write the lease cache
+    void clearLease();                                              // DHCP Client invalidate the lease cache
 public:
+    // Constructors
     DHCP_CLIENT();                                                  // DHCP Client
     DHCP_CLIENT(uint8_t [], uint8_t);                               // DHCP Client
+    // Destructor
     ~DHCP_CLIENT();                                                 // DHCP Client
+    // Public methods
+    void setLeaseStore(DHCP_LEASE_STORE *);                         // DHCP Client keep the lease across restarts, NULL disables
+    void setRapidCommit(bool);                                      // DHCP Client ask for Rapid Commit, on by default
+    void begin();                                                   // DHCP Client start, with a single REQUEST when a lease is cached
+    uint8_t checkForReplies();                                      // DHCP Client Check for replies, returns 1 if one was handled
+    void handleTimers(unsigned long);                               // DHCP Client retransmit and fall back at the given millis()
+    uint8_t getState();                                             // DHCP Client state
+    IPAddress getAddress();                                         // DHCP Client leased address, 0.0.0.0 while it holds none
+    IPAddress getServerAddress();                                   // DHCP Client server that granted the lease
+    IPAddress getSubnetMask();                                      // DHCP Client subnet mask
+    IPAddress getRouter();                                          // DHCP Client router
+    IPAddress getDNSServer();                                       // DHCP Client DNS server
+    uint32_t getLeaseTime();                                        // DHCP Client lease time in seconds
+};
+
+// DHCP Relay Agent (RFC 1542), forwards client broadcasts to the upstream servers and their replies back. Both
+// directions are rewritten in place in one receive buffer, nothing is allocated per packet
+class DHCP_RELAY {
+    friend class DHCP_TESTER;
+private:
+    // Members
+    EthernetUDP DHCP_SOCKET;                                        // DHCP Relay UDP Socket, clients and servers both send to port 67
+    IPAddress RELAY_ADDRESS;                                        // DHCP Relay network address on the client side, sent as giaddr
+    IPAddress _servers[DHCP_RELAY_MAX_SERVERS];                     // DHCP Relay upstream servers
+    uint8_t _server_count;                                          // DHCP Relay number of upstream servers
+    uint8_t _circuit_id[DHCP_RELAY_MAX_ID_SIZE];                    // DHCP Relay Agent Circuit ID
+    uint8_t _circuit_id_length;                                     // DHCP Relay Agent Circuit ID length, 0 leaves it out
+    uint8_t _remote_id[DHCP_RELAY_MAX_ID_SIZE];                     // DHCP Relay Agent Remote ID
+    uint8_t _remote_id_length;                                      // DHCP Relay Agent Remote ID length, 0 leaves it out
+    uint8_t _packet[sizeof(DHCP_MESSAGE)];                          // DHCP Relay receive buffer, packets are forwarded from here
+    uint32_t _relayed;                                              // DHCP Relay requests forwarded
+    uint32_t _returned;                                             // DHCP Relay replies sent back to clients
+    uint32_t _dropped;                                              // DHCP Relay packets dropped
+    // Methods
+    int16_t findOptionsEnd(uint8_t *, uint16_t);                    // DHCP Relay index of the End option of a raw packet, -1 if it has none
+    uint16_t relayRequest(uint8_t *, uint16_t);                     // DHCP Relay rewrite a raw request for the servers, returns its new size or 0 to drop it
+    uint16_t relayReply(uint8_t *, uint16_t, IPAddress &);          // DHCP Relay rewrite a raw reply for the client, returns its new size or 0 to drop it
+    void sendPacket(IPAddress, uint16_t, uint16_t);                 // DHCP Relay send the receive buffer
+public:
+    // Constructors
+    DHCP_RELAY(IPAddress);                                          // DHCP Relay with its client side network address
+    // Destructor
+    ~DHCP_RELAY();                                                  // DHCP Relay
+    // Public methods
+    bool addServer(IPAddress);                                      // DHCP Relay add an upstream server, false if there is no room
+    void setCircuitId(const uint8_t *, uint8_t);                    // DHCP Relay Agent Circuit ID, length 0 leaves it out
+    void setRemoteId(const uint8_t *, uint8_t);                     // DHCP Relay Agent Remote ID, length 0 leaves it out
+    EthernetUDP *getSocket();                                       // DHCP Relay socket to watch for readability
+    uint8_t handleReadable();                                       // DHCP Relay handle up to DHCP_RELAY_BATCH pending packets, returns how many
+    uint32_t getRelayedCount();                                     // DHCP Relay requests forwarded
+    uint32_t getReturnedCount();                                    // DHCP Relay replies sent back to clients
+    uint32_t getDropCount();                                        // DHCP Relay packets dropped
 };
 
 // DHCP Unit Tester
@@ -272,6 +834,8 @@ private:
     // Members
     DHCP_SERVER *_dhcp_server;                                      // DHCP Tester
     DHCP_CLIENT *_dhcp_client;                                      // DHCP Tester
+    DHCP_SERVER *_failover_primary;                                 // DHCP Tester
+    DHCP_SERVER *_failover_standby;                                 // DHCP Tester
     IPAddress test_client_ip;                                       // DHCP Tester
     IPAddress test_server_ip;                                       // DHCP Tester
     uint32_t test_xid;                                              // DHCP Tester
@@ -284,12 +848,63 @@ private:
     bool testAutoAddressAssignment();
     bool testAddressRelease();
     bool testAddressReassignment();
+    bool runServerSerializationTests();                             // DHCP Tester
+    bool testReplySerialization();                                  // DHCP Tester
+    bool testReplyOptionOverload();                                 // DHCP Tester
+    bool runServerEventLoopTests();                                 // DHCP Tester
+    bool testTimerDeadline();                                       // DHCP Tester
+    bool testLeaseExpiry();                                         // DHCP Tester
+    bool testLeaseTimeKept();                                       // DHCP Tester
+    bool testOfferExpiry();                                         // DHCP Tester
+    bool testSimulator();                                           // DHCP Tester
+    bool runServerConflictProbeTests();                             // DHCP Tester
+    bool testProbeDefersOffer();                                    // DHCP Tester
+    bool testProbeConflictQuarantine();                             // DHCP Tester
+    bool testProbeCache();                                          // DHCP Tester
+    bool runServerFailoverTests();                                  // DHCP Tester
+    bool testFailoverReplication();                                 // DHCP Tester
+    bool testFailoverSplitScope();                                  // DHCP Tester
+    bool testFailoverDeltaResync();                                 // DHCP Tester
+    bool testFailoverBulkResync();                                  // DHCP Tester
+#ifdef __linux__
+    bool testFailoverSockets();                                     // DHCP Tester
+#endif
+    void exchangeFailover(DHCP_SERVER *, DHCP_SERVER *);            // DHCP Tester
+    bool runServerSnapshotTests();                                  // DHCP Tester
+    bool testLeaseSnapshot();                                       // DHCP Tester
+    bool testLeaseExportJSON();                                     // DHCP Tester
+    bool testLeaseExportBinary();                                   // DHCP Tester
+    bool runServerAllocationPolicyTests();                          // DHCP Tester
+    bool testHashedAllocation();                                    // DHCP Tester
+    bool testHashedCollision();                                     // DHCP Tester
+    bool runServerConfigurationTests();                             // DHCP Tester
+    bool testConfigReload();                                        // DHCP Tester
+    bool testConfigReservation();                                   // DHCP Tester
+    bool runExtentAllocatorTests();                                 // DHCP Tester
+    bool testExtentAssign();                                        // DHCP Tester
+    bool testExtentRelease();                                       // DHCP Tester
+    bool runServerRenewalTests();                                   // DHCP Tester
+    bool testRenewalFastPath();                                     // DHCP Tester
+    bool testReplyDestination();                                    // DHCP Tester
+    bool testReplyFlags();                                          // DHCP Tester
+    bool runServerPrioritySchedulingTests();                        // DHCP Tester
+    bool testPriorityOrder();                                       // DHCP Tester
+    bool testPriorityDrops();                                       // DHCP Tester
+#ifdef SIMPLE_DHCP_TRACE
+    bool testTraceExport();                                         // DHCP Tester
+    bool testTraceFlush();                                          // DHCP Tester
+    bool testTraceReceive();                                        // DHCP Tester
+    uint8_t getTraceMessageType(const char *, const char *);        // DHCP Tester
+#endif
+    DHCP_MESSAGE createTestRequest(uint8_t);                        // DHCP Tester
+    DHCP_MESSAGE createTestRequest(uint8_t, const uint8_t *, const uint8_t *); // DHCP Tester
     bool runServerMessageGenerationTests();                         // DHCP Tester
     bool testDHCPOFFERGeneration();                                 // DHCP Tester
     bool testDHCPACKGeneration();                                   // DHCP Tester
     bool testDHCPNAKGeneration();                                   // DHCP Tester
     bool runServerParsingTests();                                   // DHCP Tester
     bool testDHCPDISCOVERParsing();                                 // DHCP Tester
+    bool testRapidCommit();                                         // DHCP Tester
     bool testDHCPINFORMParsing();                                   // DHCP Tester
     bool testDHCPREQUESTParsing();                                  // DHCP Tester
     bool testDHCPDECLINEParsing();                                  // DHCP Tester
@@ -305,10 +920,132 @@ private:
     bool testDHCPOFFERParsing();                                    // DHCP Tester
     bool testDHCPACKParsing();                                      // DHCP Tester
     bool testDHCPNAKParsing();                                      // DHCP Tester
+    bool runClientLeaseCacheTests();                                // DHCP Tester
+    bool testLeaseCacheReboot();                                    // DHCP Tester
+    bool testLeaseCacheFallback();                                  // DHCP Tester
+    bool runClientRenewalTests();                                   // DHCP Tester
+    bool testClientRenewing();                                      // DHCP Tester
+    bool testClientRebinding();                                     // DHCP Tester
+    void bindTestClient(DHCP_SERVER *, DHCP_CLIENT *);              // DHCP Tester
+    bool runRelayTests();                                           // DHCP Tester
+    bool testRelayRequest();                                        // DHCP Tester
+    bool testRelayReply();                                          // DHCP Tester
 public:
     DHCP_TESTER();                                                  // DHCP Tester
     ~DHCP_TESTER();                                                 // DHCP Tester
     bool runTests();                                                // DHCP Tester
 };
 
+// DHCP Micro-benchmarks for the server hot paths
+class DHCP_BENCHMARK {
+private:
+    // Members
+    DHCP_SERVER *_dhcp_server;                                      // DHCP Benchmark server under test
+    DHCP_CLIENT *_dhcp_client;                                      // DHCP Benchmark client building the requests
+    uint16_t _iterations;                                           // DHCP Benchmark operations per measurement
+    const volatile uint32_t *_allocations;                          // DHCP Benchmark allocation counter kept by the sketch, NULL if none
+    const DHCP_BENCH_RESULT *_baseline;                             // DHCP Benchmark baseline results
+    uint8_t _baseline_count;                                        // DHCP Benchmark number of baseline results
+    uint8_t _threshold;                                             // DHCP Benchmark allowed regression in percent
+    // Methods
+    void fillPool(uint8_t);                                         // DHCP Benchmark bind a percentage of the pool
+    uint32_t getAllocations();                                      // DHCP Benchmark current allocation count
+    DHCP_MESSAGE createDiscover();                                  // DHCP Benchmark DISCOVER with a typical option mix
+    DHCP_MESSAGE createRequest(IPAddress);                          // DHCP Benchmark REQUEST for an offered address with a typical option mix
+    bool report(Print &, const char *, uint8_t, unsigned long, uint32_t); // DHCP Benchmark print a result and check it against the baseline
+    bool expectReply(Print &, const char *, uint8_t, DHCP_MESSAGE *, uint8_t); // DHCP Benchmark check the reply type before a measurement
+    bool benchParseDiscover(Print &, uint8_t);                      // DHCP Benchmark parseDHCPRequest() for a DISCOVER
+    bool benchParseRequest(Print &, uint8_t);                       // DHCP Benchmark parseDHCPRequest() for a REQUEST
+    bool benchParseRenewal(Print &, uint8_t);                       // DHCP Benchmark parseDHCPRequest() for a renewal
+    bool benchCreateReply(Print &, uint8_t);                        // DHCP Benchmark createDHCPReply()
+    bool benchGetAddress(Print &, uint8_t);                         // DHCP Benchmark getAddressFromPool()
+    bool benchAssignRelease(Print &, uint8_t);                      // DHCP Benchmark assignAddress() and releaseAddress()
+public:
+    DHCP_BENCHMARK();                                               // DHCP Benchmark
+    DHCP_BENCHMARK(uint16_t);                                       // DHCP Benchmark with operations per measurement
+    ~DHCP_BENCHMARK();                                              // DHCP Benchmark
+    void setAllocationCounter(const volatile uint32_t *);           // DHCP Benchmark count allocations with a counter the sketch keeps
+    void setBaseline(const DHCP_BENCH_RESULT *, uint8_t, uint8_t);  // DHCP Benchmark results to compare against and allowed regression in percent
+    bool runBenchmarks(Print &);                                    // DHCP Benchmark run all benchmarks, false if any regressed or misbehaved
+};
+
+// DHCP Lease Lifecycle Simulator, drives a server on a virtual clock with a synthetic client population so weeks
+// of churn run in seconds
+class DHCP_SIMULATOR {
+private:
+    // Members
+    static uint64_t _now;                                           // DHCP Simulator virtual time in ms, 64 bit so hours and days never wrap
+    DHCP_SERVER *_dhcp_server;                                      // DHCP Simulator server under study
+    DHCP_SIM_MODEL _model;                                          // DHCP Simulator population model
+    DHCP_SIM_CLIENT *_clients;                                      // DHCP Simulator client population
+    uint16_t _step;                                                 // DHCP Simulator virtual seconds per step
+    uint64_t _arrival_credit;                                       // DHCP Simulator arrivals owed, in arrivals * 360000
+    const volatile uint32_t *_allocations;                          // DHCP Simulator allocation counter kept by the sketch, NULL if none
+    const volatile uint32_t *_heap_bytes;                           // DHCP Simulator live heap bytes counter kept by the sketch, NULL if none
+    DHCP_SIM_STATS _interval;                                       // DHCP Simulator statistics of the current report interval
+    DHCP_SIM_STATS _totals;                                         // DHCP Simulator statistics of the whole run
+    // Methods
+    static unsigned long getTime();                                 // DHCP Simulator virtual millis() handed to the server, wraps like millis()
+    DHCP_MESSAGE createMessage(uint16_t, uint8_t);                  // DHCP Simulator message from a simulated client
+    void arrive(uint16_t);                                          // DHCP Simulator client joins with a full exchange
+    void renew(uint16_t);                                           // DHCP Simulator client renews its lease
+    void reboot(uint16_t);                                          // DHCP Simulator client restarts and asks for its address back
+    void bind(uint16_t, DHCP_MESSAGE *);                            // DHCP Simulator client takes the lease an ACK grants
+    void runStep();                                                 // DHCP Simulator advance the clock by one step
+    void countLeases(DHCP_SIM_STATS &);                             // DHCP Simulator pool occupancy, fragmentation and memory
+    uint32_t getAllocations();                                      // DHCP Simulator current allocation count
+    void addStats(DHCP_SIM_STATS &, const DHCP_SIM_STATS &);        // DHCP Simulator add the counters of one interval to another
+    void report(Print &, uint32_t);                                 // DHCP Simulator print an interval as a CSV line
+public:
+    DHCP_SIMULATOR(DHCP_SERVER *, const DHCP_SIM_MODEL &);          // DHCP Simulator, takes over the server's clock
+    ~DHCP_SIMULATOR();                                              // DHCP Simulator, gives the server millis() back
+    void setStep(uint16_t);                                         // DHCP Simulator virtual seconds per step
+    void setAllocationCounter(const volatile uint32_t *);           // DHCP Simulator count allocations with a counter the sketch keeps
+    void setMemoryCounter(const volatile uint32_t *);               // DHCP Simulator measure heap use with a live bytes counter the sketch keeps
+    bool run(Print &, uint32_t);                                    // DHCP Simulator run hours of traffic, one CSV line per hour, false if out of memory
+    void getTotals(DHCP_SIM_STATS &);                               // DHCP Simulator statistics of the whole run
+};
+
+#ifdef SIMPLE_DHCP_TRACE
+// DHCP Trace Writer, buffers trace events and writes them out as Chrome trace JSON for chrome://tracing or Perfetto
+class DHCP_TRACE_WRITER {
+private:
+    // Members
+    Print *_out;                                                    // DHCP Trace output
+    DHCP_TRACE_EVENT _events[DHCP_TRACE_BUFFER_SIZE];               // DHCP Trace events not yet written
+    uint8_t _count;                                                 // DHCP Trace number of buffered events
+    bool _first;                                                    // DHCP Trace nothing has been written since begin()
+    uint8_t _message_type;                                          // DHCP Trace message type of the request being handled
+    uint32_t _dropped;                                              // DHCP Trace events lost because the buffer filled inside a span
+public:
+    static DHCP_TRACE_WRITER *active;                               // DHCP Trace writer spans report to, NULL if none
+    DHCP_TRACE_WRITER(Print &);                                     // DHCP Trace writer to a Print
+    void begin();                                                   // DHCP Trace open the JSON array and start collecting
+    void end();                                                     // DHCP Trace stop collecting, write what is buffered and close the array
+    void flush();                                                   // DHCP Trace write the buffered events
+    void setMessageType(uint8_t);                                   // DHCP Trace message type later events belong to
+    void record(uint8_t, unsigned long, unsigned long);             // DHCP Trace buffer an event, flushing once no span is open
+    uint32_t getDropCount();                                        // DHCP Trace events lost since begin()
+};
+
+// DHCP Trace Span, times the enclosing scope
+class DHCP_TRACE_SPAN {
+private:
+    uint8_t _stage;                                                 // DHCP Trace stage being timed
+    unsigned long _start;                                           // DHCP Trace start time in micros()
+public:
+    static uint8_t open;                                            // DHCP Trace spans not yet closed, the writer only flushes at 0
+    DHCP_TRACE_SPAN(uint8_t);                                       // DHCP Trace start timing a stage
+    ~DHCP_TRACE_SPAN();                                             // DHCP Trace report the stage to the active writer and USDT
+};
+
+#define DHCP_TRACE_CONCAT_(a, b)            a##b
+#define DHCP_TRACE_CONCAT(a, b)             DHCP_TRACE_CONCAT_(a, b)
+#define DHCP_TRACE_SCOPE(stage)             DHCP_TRACE_SPAN DHCP_TRACE_CONCAT(dhcp_trace_span_, __LINE__)(stage)
+#define DHCP_TRACE_MESSAGE_TYPE(type)       do { if (DHCP_TRACE_WRITER::active != NULL) DHCP_TRACE_WRITER::active->setMessageType(type); } while (0)
+#else
+#define DHCP_TRACE_SCOPE(stage)
+#define DHCP_TRACE_MESSAGE_TYPE(type)       do { } while (0)
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,54 @@
+// Counting allocator shared by the example sketches. It replaces the global operator new and delete, so include it
+// from one file of a sketch only. Every heap allocation the library makes goes through here: the benchmark reports
+// allocations per operation from allocation_count and the simulator reports heap use from allocated_bytes
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+volatile uint32_t allocation_count = 0;                             // Allocations made since the sketch started
+volatile uint32_t allocated_bytes = 0;                              // Bytes allocated and not yet freed
+
+// Each block is prefixed with its size so a delete can take it off allocated_bytes, the union keeps the block aligned
+union ALLOCATION_HEADER {
+    size_t size;
+    long double align;
+    void *pointer;
+};
+
+// Allocate a block and count it, NULL if the heap is exhausted
+static void *countedAllocate(size_t size) {
+    ALLOCATION_HEADER *header = (ALLOCATION_HEADER *)malloc(sizeof(ALLOCATION_HEADER) + size);
+    if (header == NULL) return NULL;
+    header->size = size;
+    allocation_count++;
+    allocated_bytes += size;
+    return header + 1;
+}
+
+// Free a block allocated by countedAllocate()
+static void countedFree(void *pointer) {
+    if (pointer == NULL) return;
+    ALLOCATION_HEADER *header = (ALLOCATION_HEADER *)pointer - 1;
+    allocated_bytes -= header->size;
+    free(header);
+}
+
+void *operator new(size_t size) {
+    return countedAllocate(size);
+}
+
+void *operator new[](size_t size) {
+    return countedAllocate(size);
+}
+
+void operator delete(void *pointer) {
+    countedFree(pointer);
+}
+
+void operator delete[](void *pointer) {
+    countedFree(pointer);
+}
+
+#endif
\ No newline at end of file
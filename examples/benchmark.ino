@@ -0,0 +1,25 @@
+#include <SimpleDHCP.h>
+#include "allocation_counter.h"                 // Counts the library's heap allocations for allocs_per_op
+#include "benchmark_baseline.h"                 // Results of the reference run the gate compares against
+
+// The regression gate is ON: a run ends with "DHCP BENCHMARK FAILED" if any result is more than
+// DHCP_BENCH_DEFAULT_THRESHOLD percent slower than its row in benchmark_baseline.h. That baseline comes from the
+// reference machine, on another board copy the baseline[] block a good run prints over it first. Set
+// BENCH_BASELINE to 0 to only print results
+#define BENCH_BASELINE 1
+
+DHCP_BENCHMARK *dhcp_benchmark;
+
+void setup() {
+    Serial.begin(9600);
+    delay(500);
+    dhcp_benchmark = new DHCP_BENCHMARK();
+    dhcp_benchmark->setAllocationCounter(&allocation_count);
+#if BENCH_BASELINE
+    dhcp_benchmark->setBaseline(baseline, sizeof(baseline) / sizeof(baseline[0]), DHCP_BENCH_DEFAULT_THRESHOLD);
+#endif
+    dhcp_benchmark->runBenchmarks(Serial);     // Ends with DHCP BENCHMARK PASSED or DHCP BENCHMARK FAILED
+}
+
+void loop() {
+}
\ No newline at end of file
@@ -0,0 +1,31 @@
+// Regression baseline for examples/benchmark.ino, in the format runBenchmarks() prints so a new one can be pasted
+// over it as is. Recorded on the reference machine: an x86-64 Intel Xeon host build with g++ 12.2 -O2, 1000
+// iterations, each row the slowest result over 8 runs. Boards are far slower than this, so record a
+// baseline on the board under test before relying on the gate there
+#ifndef BENCHMARK_BASELINE_H
+#define BENCHMARK_BASELINE_H
+
+#include <SimpleDHCP.h>
+
+const DHCP_BENCH_RESULT baseline[] = {
+    {"parse_discover", 0, 473},
+    {"parse_request", 0, 284},
+    {"parse_renewal", 0, 286},
+    {"create_reply", 0, 37},
+    {"get_address", 0, 10},
+    {"assign_release", 0, 73},
+    {"parse_discover", 50, 748},
+    {"parse_request", 50, 289},
+    {"parse_renewal", 50, 283},
+    {"create_reply", 50, 38},
+    {"get_address", 50, 271},
+    {"assign_release", 50, 331},
+    {"parse_discover", 99, 984},
+    {"parse_request", 99, 290},
+    {"parse_renewal", 99, 279},
+    {"create_reply", 99, 39},
+    {"get_address", 99, 503},
+    {"assign_release", 99, 568},
+};
+
+#endif
\ No newline at end of file
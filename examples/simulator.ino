@@ -0,0 +1,29 @@
+#include <SimpleDHCP.h>
+#include "allocation_counter.h"                 // Counts the heap allocations and bytes behind the memory columns
+
+// 250 devices sharing 200 addresses, peaking at 60 arrivals an hour, staying 6 hours on average and with a third
+// of them rebooting once a day
+const DHCP_SIM_MODEL model = {250, 60, 6UL * 60 * 60, 24, 33};
+
+DHCP_SERVER *dhcp_server;
+DHCP_SIMULATOR *dhcp_simulator;
+
+void setup() {
+    Serial.begin(9600);
+    delay(500);
+    dhcp_server = new DHCP_SERVER(IPAddress(192, 168, 1, 1), 200);
+    dhcp_server->setLeaseTime(4UL * 60 * 60);
+    dhcp_simulator = new DHCP_SIMULATOR(dhcp_server, model);
+    dhcp_simulator->setAllocationCounter(&allocation_count);
+    dhcp_simulator->setMemoryCounter(&allocated_bytes);
+    bool sim_results = dhcp_simulator->run(Serial, 7 * 24);  // One week
+    Serial.println(F("***************************************"));
+    if (sim_results) {
+        Serial.println(F("Simulation complete"));
+    } else {
+        Serial.println(F("Not enough memory for the client population"));
+    }
+}
+
+void loop() {
+}
\ No newline at end of file